@@ -0,0 +1,138 @@
+/**
+ * Response builder microbenchmark: the per-response work between a parsed
+ * request and the queued head, case by case.
+ *
+ * build: make bench-builder
+ * run:   ./bench/builder_bench [iterations]
+ */
+#define SERVER_NO_MAIN
+#include "../server.c"
+
+/**
+ * WORKLOAD
+ */
+static const char kRequest[] =
+    "GET /jquery-1.4.3.min.js HTTP/1.1\r\n"
+    "Host: localhost:8000\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:125.0) Gecko/20100101 Firefox/125.0\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "If-None-Match: \"1a2b3c-12fb2-65f0a1b2.1c9c3800\", \"1a2b3c-12fb2-65f0a1b2.1c9c3800-gzip\"\r\n"
+    "If-Modified-Since: Tue, 19 Mar 2024 10:00:00 GMT\r\n"
+    "Range: bytes=0-1023,4096-8191,-512\r\n"
+    "\r\n";
+
+typedef enum {
+    CASE_OK_HEAD,
+    CASE_VALIDATORS,
+    CASE_NEGOTIATE,
+    CASE_CONDITIONAL,
+    CASE_RANGES,
+    CASE_ERROR_BODY,
+    CASE_MIME,
+    CASE_NORMALIZE,
+    CASE_KINDS,
+} bench_case_t;
+
+static const char* kCaseNames[CASE_KINDS] = {
+    "ok_head", "validators", "negotiate", "conditional", "ranges", "error_body", "mime", "normalize",
+};
+
+double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/// @brief average nanoseconds per call of one case
+double run(bench_case_t which, const http_request_t* request, const struct stat* st, long iterations) {
+    char buffer[4096];
+    validators_t validators;
+    byte_range_t ranges[MAX_RANGES];
+    volatile size_t sink = 0;
+    make_validators(st, ENC_IDENTITY, &validators);
+
+    static const char* paths[] = { "/index.html", "/css/style.css", "/images/wine3.jpg", "/favicon.ico" };
+    static const char* targets[] = {
+        "/jquery-1.4.3.min.js", "/css/style.css?v=20240319", "/fancybox/../images/wine%203.jpg", "//images/./wine3.jpg",
+    };
+
+    double start = now_ns();
+    for (long it = 0; it < iterations; it++) {
+        strbuf_t sb;
+        sb_init(&sb, buffer, sizeof(buffer));
+
+        switch (which) {
+            case CASE_OK_HEAD:
+                sb_ok_head(&sb, request->version, request->version_len, st->st_size, "application/javascript",
+                           ENC_GZIP, 1, &validators, 1);
+                sink += sb.len;
+                break;
+            case CASE_VALIDATORS:
+                make_validators(st, it & 1 ? ENC_GZIP : ENC_IDENTITY, &validators);
+                sink += validators.etag_len;
+                break;
+            case CASE_NEGOTIATE:
+                sink += http_accept_encodings(request);
+                break;
+            case CASE_CONDITIONAL:
+                sink += http_has_preconditions(request) + http_not_modified(request, &validators);
+                break;
+            case CASE_RANGES: {
+                int num_ranges = http_parse_ranges(request, &validators, st->st_size, ranges);
+                for (int i = 0; i < num_ranges; i++) sb_content_range(&sb, ranges[i].start, ranges[i].end, st->st_size);
+                sink += sb.len;
+                break;
+            }
+            case CASE_ERROR_BODY:
+                sb_status_line(&sb, request->version, request->version_len, 404, "Not Found");
+                sb_header_u(&sb, "Content-Length", 0);
+                sb_header(&sb, "Content-Type", "text/html");
+                sb_header(&sb, "Connection", "keep-alive");
+                sb_append(&sb, "\r\n", 2);
+                sink += sb.len;
+                break;
+            case CASE_MIME:
+                sink += (size_t) get_mime_type(paths[it & 3]);
+                break;
+            case CASE_NORMALIZE:
+                sink += http_normalize_path(targets[it & 3], strlen(targets[it & 3]), buffer, sizeof(buffer));
+                break;
+            default:
+                break;
+        }
+    }
+    (void) sink;
+    return (now_ns() - start) / iterations;
+}
+
+int main(int argc, char* argv[]) {
+    long iterations = 1000000;
+    if (argc > 1 && (!IS_OK_APP(try_conv_long(argv[1], &iterations)) || iterations < 1)) {
+        printf("usage: %s [iterations]\n", argv[0]);
+        return APP_ERR;
+    }
+
+    http_request_t request;
+    size_t scan_pos = 0;
+    if (http_parse_request(kRequest, strlen(kRequest), &scan_pos, &request) <= 0) {
+        printf("workload request doesn't parse\n");
+        return APP_ERR;
+    }
+
+    // a fixed identity, so validators and ETags are the same on every run
+    struct stat st = {0};
+    st.st_ino = 0x1a2b3c;
+    st.st_size = 77746;
+    st.st_mtim.tv_sec = 0x65f0a1b2;
+    st.st_mtim.tv_nsec = 0x1c9c3800;
+
+    printf("{\"benchmark\":\"builder\",\"iterations\":%ld,\"results\":[", iterations);
+    for (int i = 0; i < CASE_KINDS; i++) {
+        printf("%s{\"case\":\"%s\",\"ns\":%.1f}", i ? "," : "", kCaseNames[i], run(i, &request, &st, iterations));
+    }
+    printf("]}\n");
+    return APP_OK;
+}
@@ -0,0 +1,585 @@
+/**
+ * HTTP/1.1 load generator: keeps a fixed number of connections busy from a
+ * few epoll threads, requesting files of the document root, and reports
+ * throughput and latency percentiles as one JSON line.
+ *
+ * build: make bench-load
+ * run:   ./bench/loadgen [-c conns] [-t threads] [-d seconds] [-W warmup] [-p depth]
+ *                        [-k] [-m small|large|mixed] [-r root] [-s seed] [host] <port>
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <ftw.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * CONSTANTS
+ */
+#define MAX_THREADS 64
+#define MAX_CONNS 65536
+#define MAX_PATHS 4096
+#define MAX_DEPTH 64
+#define MAX_REQUEST_LEN 512
+#define RECV_BUFFER_SIZE (64 * 1024)
+#define EPOLL_EVENTS 256
+
+// files up to this size count as "small" in the file mix
+#define SMALL_FILE_MAX (16 * 1024)
+
+// same log-linear layout as the server's histograms: 8 buckets per power
+// of two (12.5% precision), nanosecond values up to 2^40
+#define HIST_SUB_BITS 3
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_OCTAVES 40
+#define HIST_BUCKETS ((HIST_OCTAVES - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+/**
+ * TYPES
+ */
+typedef enum {
+    MIX_MIXED,
+    MIX_SMALL,
+    MIX_LARGE,
+} file_mix_t;
+
+typedef struct {
+    char* path;
+    off_t size;
+    char request[MAX_REQUEST_LEN];
+    size_t request_len;
+} target_t;
+
+typedef struct {
+    uint64_t buckets[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+} histogram_t;
+
+typedef struct {
+    uint64_t requests;
+    uint64_t bytes;
+    uint64_t non_2xx;
+    uint64_t errors;
+    histogram_t latency;
+} stats_t;
+
+typedef struct {
+    int fd;
+    int connecting;
+
+    // send times of in-flight requests, oldest at `head`
+    uint64_t sent_at[MAX_DEPTH];
+    int head;
+    int inflight;
+
+    // unsent request bytes
+    char out[MAX_DEPTH * MAX_REQUEST_LEN];
+    size_t out_off;
+    size_t out_len;
+
+    // response framing
+    char in[RECV_BUFFER_SIZE];
+    size_t in_len;
+    int in_body;
+    int status;
+    uint64_t body_left;
+    uint64_t response_bytes;
+
+    // the last response said Connection: close
+    int server_close;
+} client_t;
+
+typedef struct {
+    pthread_t thread;
+    int id;
+    int epfd;
+    int num_clients;
+    client_t* clients;
+    uint64_t rng;
+    stats_t stats;
+} loader_t;
+
+/**
+ * CONFIGURATION
+ */
+static struct sockaddr_storage gAddr;
+static socklen_t gAddrLen;
+static char gHost[256] = "127.0.0.1";
+static int gPort;
+static int gConns = 64;
+static int gThreads = 4;
+static int gDepth = 1;
+static int gKeepAlive = 1;
+static double gDuration = 10;
+static double gWarmup = 1;
+static file_mix_t gMix = MIX_MIXED;
+static const char* gRoot = "./www";
+static uint64_t gSeed = 1;
+
+static target_t gTargets[MAX_PATHS];
+static int gNumTargets;
+
+// stats are reset when the warmup ends and frozen at the deadline
+static uint64_t gMeasureStart;
+static uint64_t gMeasureEnd;
+
+/**
+ * HELPERS
+ */
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t xorshift64(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static inline size_t hist_index(uint64_t value) {
+    if (value < HIST_SUB_BUCKETS) return value;
+    unsigned octave = 63 - __builtin_clzll(value);
+    if (octave >= HIST_OCTAVES) return HIST_BUCKETS - 1;
+    return (size_t) (octave - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS +
+        ((value >> (octave - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+}
+
+/// @brief largest value that falls into a bucket
+uint64_t hist_upper(size_t idx) {
+    if (idx < HIST_SUB_BUCKETS) return idx;
+    unsigned octave = idx / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+    uint64_t width = 1ULL << (octave - HIST_SUB_BITS);
+    return ((HIST_SUB_BUCKETS + idx % HIST_SUB_BUCKETS) << (octave - HIST_SUB_BITS)) + width - 1;
+}
+
+static inline void hist_record(histogram_t* hist, uint64_t value) {
+    hist->buckets[hist_index(value)]++;
+    hist->count++;
+    hist->sum += value;
+    if (value > hist->max) hist->max = value;
+}
+
+/// @brief value at quantile q, reported as its bucket's upper edge
+uint64_t hist_quantile(const histogram_t* hist, double q) {
+    if (hist->count == 0) return 0;
+    uint64_t rank = (uint64_t) (q * hist->count);
+    if (rank >= hist->count) rank = hist->count - 1;
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen > rank) return hist_upper(i) < hist->max ? hist_upper(i) : hist->max;
+    }
+    return hist->max;
+}
+
+int parse_int(const char* str, int min, int max, int* result) {
+    char* end;
+    errno = 0;
+    long value = strtol(str, &end, 10);
+    if (errno || *end != '\0' || end == str || value < min || value > max) return 0;
+    *result = value;
+    return 1;
+}
+
+/**
+ * CORPUS
+ */
+
+/// @brief collect regular files under the document root, skipping
+/// resource forks, editor backups and names that would need percent-encoding
+int collect_file(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+    if (type != FTW_F || gNumTargets >= MAX_PATHS) return 0;
+
+    const char* name = path + ftw->base;
+    if (strncmp(name, "._", 2) == 0 || name[strlen(name) - 1] == '~') return 0;
+
+    const char* rel = path + strlen(gRoot);
+    if (strpbrk(rel, " %?#\"") || strlen(rel) + 128 > MAX_REQUEST_LEN) return 0;
+
+    int keep = gMix == MIX_MIXED ||
+        (gMix == MIX_SMALL && st->st_size <= SMALL_FILE_MAX) ||
+        (gMix == MIX_LARGE && st->st_size > SMALL_FILE_MAX);
+    if (!keep) return 0;
+
+    gTargets[gNumTargets].path = strdup(rel);
+    gTargets[gNumTargets].size = st->st_size;
+    gNumTargets++;
+    return 0;
+}
+
+int compare_targets(const void* a, const void* b) {
+    return strcmp(((const target_t*) a)->path, ((const target_t*) b)->path);
+}
+
+/// @brief prebuild one request per file, in a stable order so a seed
+/// always produces the same request sequence
+int build_targets(void) {
+    if (nftw(gRoot, collect_file, 16, FTW_PHYS) != 0) {
+        fprintf(stderr, "failed to walk '%s': %s\n", gRoot, strerror(errno));
+        return 0;
+    }
+    if (gNumTargets == 0) {
+        fprintf(stderr, "no files under '%s' match the file mix\n", gRoot);
+        return 0;
+    }
+    qsort(gTargets, gNumTargets, sizeof(target_t), compare_targets);
+
+    for (int i = 0; i < gNumTargets; i++) {
+        int len = snprintf(gTargets[i].request, MAX_REQUEST_LEN,
+            "GET %s HTTP/1.1\r\nHost: %s:%d\r\nUser-Agent: loadgen\r\nConnection: %s\r\n\r\n",
+            gTargets[i].path, gHost, gPort, gKeepAlive ? "keep-alive" : "close");
+        gTargets[i].request_len = len;
+    }
+    return 1;
+}
+
+/**
+ * CLIENT CONNECTIONS
+ */
+void loader_record(loader_t* l, uint64_t latency, int status, uint64_t bytes, uint64_t now) {
+    if (now < gMeasureStart || now >= gMeasureEnd) return;
+    l->stats.requests++;
+    l->stats.bytes += bytes;
+    if (status < 200 || status >= 300) l->stats.non_2xx++;
+    hist_record(&l->stats.latency, latency);
+}
+
+void loader_error(loader_t* l, uint64_t now) {
+    if (now >= gMeasureStart && now < gMeasureEnd) l->stats.errors++;
+}
+
+int client_open(loader_t* l, client_t* c) {
+    c->fd = socket(gAddr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0) return 0;
+
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    c->connecting = 1;
+    c->head = c->inflight = 0;
+    c->out_off = c->out_len = 0;
+    c->in_len = 0;
+    c->in_body = 0;
+    c->server_close = 0;
+
+    if (connect(c->fd, (struct sockaddr*) &gAddr, gAddrLen) < 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        return 0;
+    }
+
+    // edge triggered: reads and writes always run until EAGAIN
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = c };
+    if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        close(c->fd);
+        c->fd = -1;
+        return 0;
+    }
+    return 1;
+}
+
+void client_close(client_t* c) {
+    if (c->fd >= 0) close(c->fd);
+    c->fd = -1;
+}
+
+/// @brief top the pipeline up to `gDepth` requests (one without keep-alive)
+void client_fill(loader_t* l, client_t* c, uint64_t now) {
+    int depth = gKeepAlive ? gDepth : 1;
+    if (!gKeepAlive && c->inflight + c->in_body > 0) return;
+
+    while (c->inflight < depth) {
+        const target_t* t = &gTargets[xorshift64(&l->rng) % gNumTargets];
+        if (c->out_len + t->request_len > sizeof(c->out)) break;
+        memcpy(c->out + c->out_len, t->request, t->request_len);
+        c->out_len += t->request_len;
+        c->sent_at[(c->head + c->inflight) % MAX_DEPTH] = now;
+        c->inflight++;
+        if (!gKeepAlive) break;
+    }
+}
+
+/// @return 0 when the connection must be reopened
+int client_write(client_t* c) {
+    while (c->out_off < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+        if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+        c->out_off += n;
+    }
+    c->out_off = c->out_len = 0;
+    return 1;
+}
+
+/// @brief status code, Content-Length and Connection: close of a response head
+void parse_head(const char* head, size_t len, int* status, uint64_t* content_length, int* close) {
+    *status = 0;
+    *content_length = 0;
+    *close = 0;
+    if (len >= 12) *status = (head[9] - '0') * 100 + (head[10] - '0') * 10 + (head[11] - '0');
+
+    const char* line = memchr(head, '\n', len);
+    while (line && (size_t) (line - head) + 1 < len) {
+        line++;
+        if ((size_t) (head + len - line) > 15 && strncasecmp(line, "Content-Length:", 15) == 0) {
+            *content_length = strtoull(line + 15, NULL, 10);
+        }
+        if ((size_t) (head + len - line) > 17 && strncasecmp(line, "Connection: close", 17) == 0) {
+            *close = 1;
+        }
+        line = memchr(line, '\n', head + len - line);
+    }
+}
+
+/// @return 0 when the connection must be reopened
+int client_read(loader_t* l, client_t* c) {
+    for (;;) {
+        ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+        if (n == 0) return 0;
+        if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+        c->in_len += n;
+
+        uint64_t now = monotonic_ns();
+        size_t pos = 0;
+        while (pos < c->in_len) {
+            if (!c->in_body) {
+                const char* eoh = memmem(c->in + pos, c->in_len - pos, "\r\n\r\n", 4);
+                if (!eoh) break;
+                size_t head_len = eoh + 4 - (c->in + pos);
+                parse_head(c->in + pos, head_len, &c->status, &c->body_left, &c->server_close);
+                c->response_bytes = head_len;
+                c->in_body = 1;
+                pos += head_len;
+            }
+
+            size_t take = c->in_len - pos < c->body_left ? c->in_len - pos : c->body_left;
+            c->body_left -= take;
+            c->response_bytes += take;
+            pos += take;
+            if (c->body_left > 0) break;
+
+            // response complete
+            c->in_body = 0;
+            if (c->inflight == 0) return 0;
+            loader_record(l, now - c->sent_at[c->head], c->status, c->response_bytes, now);
+            c->head = (c->head + 1) % MAX_DEPTH;
+            c->inflight--;
+            if (!gKeepAlive || c->server_close) {
+                c->in_len = 0;
+                return 0;
+            }
+        }
+
+        // keep an incomplete head at the front of the buffer
+        memmove(c->in, c->in + pos, c->in_len - pos);
+        c->in_len -= pos;
+        if (c->in_len == sizeof(c->in)) return 0;
+    }
+}
+
+void* loader_func(void* arg) {
+    loader_t* l = arg;
+    struct epoll_event events[EPOLL_EVENTS];
+
+    for (int i = 0; i < l->num_clients; i++) {
+        if (!client_open(l, &l->clients[i])) loader_error(l, monotonic_ns());
+    }
+
+    for (;;) {
+        uint64_t now = monotonic_ns();
+        if (now >= gMeasureEnd) break;
+
+        int num_events = epoll_wait(l->epfd, events, EPOLL_EVENTS, 100);
+        for (int i = 0; i < num_events; i++) {
+            client_t* c = events[i].data.ptr;
+            now = monotonic_ns();
+            int ok = !(events[i].events & EPOLLERR);
+
+            if (ok && c->connecting && (events[i].events & EPOLLOUT)) c->connecting = 0;
+            if (ok && !c->connecting && (events[i].events & EPOLLIN)) {
+                int was_close = !gKeepAlive && c->inflight == 1;
+                ok = client_read(l, c);
+                // without keep-alive, or once the server said so, it closing
+                // after the response is the normal end
+                if (!ok && (was_close || c->server_close) && c->inflight == 0) {
+                    client_close(c);
+                    if (!client_open(l, c)) loader_error(l, now);
+                    continue;
+                }
+            }
+            if (ok && !c->connecting) {
+                client_fill(l, c, now);
+                ok = client_write(c);
+            }
+
+            if (!ok) {
+                loader_error(l, now);
+                client_close(c);
+                if (!client_open(l, c)) loader_error(l, now);
+            }
+        }
+
+        // clients whose reconnect failed retry on the next pass
+        for (int i = 0; i < l->num_clients; i++) {
+            if (l->clients[i].fd < 0 && !client_open(l, &l->clients[i])) loader_error(l, monotonic_ns());
+        }
+    }
+
+    for (int i = 0; i < l->num_clients; i++) client_close(&l->clients[i]);
+    return NULL;
+}
+
+/**
+ * ENTRY
+ */
+void print_usage(const char* prog) {
+    printf("usage: %s [-c conns] [-t threads] [-d seconds] [-W warmup] [-p depth] [-k]\n"
+           "          [-m small|large|mixed] [-r root] [-s seed] [host] <port>\n", prog);
+    printf("  -c N  open connections (default: 64)\n");
+    printf("  -t N  client threads (default: 4)\n");
+    printf("  -d S  measured seconds (default: 10)\n");
+    printf("  -W S  warmup seconds excluded from the results (default: 1)\n");
+    printf("  -p N  pipelined requests in flight per connection (default: 1)\n");
+    printf("  -k    no keep-alive: one request per connection, pipelining off\n");
+    printf("  -m M  files requested: small (<= 16 KB), large or mixed (default: mixed)\n");
+    printf("  -r D  document root to draw paths from (default: ./www)\n");
+    printf("  -s N  random seed (default: 1)\n");
+}
+
+int resolve(void) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo* res;
+    char port[16];
+    snprintf(port, sizeof(port), "%d", gPort);
+    if (getaddrinfo(gHost, port, &hints, &res) != 0) return 0;
+    memcpy(&gAddr, res->ai_addr, res->ai_addrlen);
+    gAddrLen = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 1;
+}
+
+int main(int argc, char* argv[]) {
+    int opt, seed, duration = 10, warmup = 1;
+    while ((opt = getopt(argc, argv, "c:t:d:W:p:km:r:s:")) != -1) {
+        int ok = 1;
+        switch (opt) {
+            case 'c': ok = parse_int(optarg, 1, MAX_CONNS, &gConns); break;
+            case 't': ok = parse_int(optarg, 1, MAX_THREADS, &gThreads); break;
+            case 'd': ok = parse_int(optarg, 1, 86400, &duration); break;
+            case 'W': ok = parse_int(optarg, 0, 86400, &warmup); break;
+            case 'p': ok = parse_int(optarg, 1, MAX_DEPTH, &gDepth); break;
+            case 'k': gKeepAlive = 0; break;
+            case 'm':
+                if (strcmp(optarg, "small") == 0) gMix = MIX_SMALL;
+                else if (strcmp(optarg, "large") == 0) gMix = MIX_LARGE;
+                else if (strcmp(optarg, "mixed") == 0) gMix = MIX_MIXED;
+                else ok = 0;
+                break;
+            case 'r': gRoot = optarg; break;
+            case 's':
+                ok = parse_int(optarg, 0, INT32_MAX, &seed);
+                gSeed = seed;
+                break;
+            default: ok = 0;
+        }
+        if (!ok) {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    gDuration = duration;
+    gWarmup = warmup;
+
+    if (argc - optind == 2) snprintf(gHost, sizeof(gHost), "%s", argv[optind++]);
+    if (argc - optind != 1 || !parse_int(argv[optind], 1, 65535, &gPort)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (!resolve()) {
+        fprintf(stderr, "can't resolve '%s'\n", gHost);
+        return 1;
+    }
+    if (!build_targets()) return 1;
+    if (gThreads > gConns) gThreads = gConns;
+
+    loader_t* loaders = calloc(gThreads, sizeof(loader_t));
+    client_t* clients = calloc(gConns, sizeof(client_t));
+    if (!loaders || !clients) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    uint64_t start = monotonic_ns();
+    gMeasureStart = start + (uint64_t) (gWarmup * 1e9);
+    gMeasureEnd = gMeasureStart + (uint64_t) (gDuration * 1e9);
+
+    for (int i = 0, assigned = 0; i < gThreads; i++) {
+        loader_t* l = &loaders[i];
+        l->id = i;
+        l->num_clients = gConns / gThreads + (i < gConns % gThreads);
+        l->clients = clients + assigned;
+        assigned += l->num_clients;
+        l->rng = (gSeed + 1) * 0x9E3779B97F4A7C15ULL + i;
+        l->epfd = epoll_create1(0);
+        for (int j = 0; j < l->num_clients; j++) l->clients[j].fd = -1;
+        if (l->epfd < 0 || pthread_create(&l->thread, NULL, loader_func, l) != 0) {
+            fprintf(stderr, "failed to start thread %d\n", i);
+            return 1;
+        }
+    }
+
+    stats_t total = {0};
+    for (int i = 0; i < gThreads; i++) {
+        pthread_join(loaders[i].thread, NULL);
+        close(loaders[i].epfd);
+
+        const stats_t* s = &loaders[i].stats;
+        total.requests += s->requests;
+        total.bytes += s->bytes;
+        total.non_2xx += s->non_2xx;
+        total.errors += s->errors;
+        for (size_t b = 0; b < HIST_BUCKETS; b++) total.latency.buckets[b] += s->latency.buckets[b];
+        total.latency.count += s->latency.count;
+        total.latency.sum += s->latency.sum;
+        if (s->latency.max > total.latency.max) total.latency.max = s->latency.max;
+    }
+
+    off_t corpus_bytes = 0;
+    for (int i = 0; i < gNumTargets; i++) corpus_bytes += gTargets[i].size;
+
+    static const char* mixes[] = { "mixed", "small", "large" };
+    const histogram_t* lat = &total.latency;
+    printf("{\"benchmark\":\"load\",\"host\":\"%s\",\"port\":%d,\"connections\":%d,\"threads\":%d,"
+           "\"keep_alive\":%s,\"pipeline\":%d,\"mix\":\"%s\",\"files\":%d,\"mean_file_bytes\":%.0f,"
+           "\"seed\":%llu,\"duration_s\":%.1f,\"requests\":%llu,\"rps\":%.1f,\"mb_per_s\":%.2f,"
+           "\"latency_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f},"
+           "\"non_2xx\":%llu,\"errors\":%llu}\n",
+           gHost, gPort, gConns, gThreads, gKeepAlive ? "true" : "false", gKeepAlive ? gDepth : 1,
+           mixes[gMix], gNumTargets, (double) corpus_bytes / gNumTargets, (unsigned long long) gSeed, gDuration,
+           (unsigned long long) total.requests, total.requests / gDuration, total.bytes / gDuration / 1e6,
+           lat->count ? (double) lat->sum / lat->count / 1e3 : 0.0,
+           hist_quantile(lat, 0.50) / 1e3, hist_quantile(lat, 0.99) / 1e3, hist_quantile(lat, 0.999) / 1e3,
+           lat->max / 1e3, (unsigned long long) total.non_2xx, (unsigned long long) total.errors);
+
+    free(clients);
+    free(loaders);
+    return total.requests > 0 && total.errors == 0 ? 0 : 1;
+}
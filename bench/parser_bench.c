@@ -0,0 +1,191 @@
+/**
+ * Request parser microbenchmark: the incremental SIMD parser against the
+ * previous framing loop + find_substr header lookups, on browser-like heads.
+ *
+ * build: make bench-parser
+ * run:   ./bench/parser_bench [iterations]
+ */
+#define SERVER_NO_MAIN
+#include "../server.c"
+
+/**
+ * PREVIOUS IMPLEMENTATION
+ */
+
+// request fields used to be copied into fixed arrays
+typedef struct {
+    char path[512];
+    char connection[32];
+    char method[16];
+    char version[16];
+} legacy_request_t;
+
+void legacy_copy(char* dest, size_t dest_len, const char* src, size_t src_len) {
+    if (src_len >= dest_len) src_len = dest_len - 1;
+    memcpy(dest, src, src_len);
+    dest[src_len] = '\0';
+}
+
+// scalar "\r\n\r\n" search, restarted from offset 0 after every recv
+ssize_t legacy_find_eoh(const char* buffer, size_t buffer_len) {
+    for (size_t i = 0; i + 3 < buffer_len; i++) {
+        if (buffer[i+0] == '\r' && buffer[i+1] == '\n' &&
+            buffer[i+2] == '\r' && buffer[i+3] == '\n') {
+            return i + 4;
+        }
+    }
+    return -1;
+}
+
+void legacy_find_header_value(const char* buffer, const char* header_end, const char* header_name, char* dest, size_t dest_len) {
+    const char* header = find_substr(buffer, header_end - buffer, header_name, strlen(header_name));
+    if (header && header < header_end) {
+        char* colon = strchr(header, ':');
+        if (colon && colon < header_end) {
+            char* field_start = colon;
+            do {
+                field_start++;
+            } while (isspace(*field_start) && field_start < header_end);
+
+            const char* line_end = find_substr(field_start, header_end - field_start, "\r\n", 2);
+            if (line_end && line_end < header_end) {
+                size_t field_len = line_end - field_start;
+                if (field_len >= dest_len) field_len = dest_len - 1;
+                memcpy(dest, field_start, field_len);
+                dest[field_len] = '\0';
+            }
+        }
+    }
+}
+
+// what the old client_func did per complete request
+int legacy_parse(const char* buffer, size_t len, legacy_request_t* request) {
+    ssize_t eoh = legacy_find_eoh(buffer, len);
+    if (eoh < 0) return 0;
+    const char* header_end = buffer + eoh;
+
+    char cl[32] = {0};
+    legacy_find_header_value(buffer, header_end, "Content-Length", cl, sizeof(cl));
+
+    const char* first_space = memchr(buffer, ' ', header_end - buffer);
+    const char* second_space = memchr(first_space + 1, ' ', header_end - (first_space + 1));
+    const char* crlf = find_substr(second_space + 1, header_end - (second_space + 1), "\r\n", 2);
+    legacy_copy(request->method, sizeof(request->method), buffer, first_space - buffer);
+    legacy_copy(request->path, sizeof(request->path), first_space + 1, second_space - (first_space + 1));
+    legacy_copy(request->version, sizeof(request->version), second_space + 1, crlf - (second_space + 1));
+    legacy_find_header_value(buffer, header_end, "Connection", request->connection, sizeof(request->connection));
+    return 1;
+}
+
+// what conn_process_one does now: tokenize, then look up the two headers
+int current_parse(const char* buffer, size_t len, size_t* scan_pos, http_request_t* request) {
+    if (http_parse_request(buffer, len, scan_pos, request) <= 0) return 0;
+
+    const http_header_t* cl = http_get_header(request, HDR_CONTENT_LENGTH);
+    long content_length;
+    if (cl) parse_content_length(cl->value, cl->value_len, &content_length);
+
+    const http_header_t* connection = http_get_header(request, HDR_CONNECTION);
+    return connection ? 1 : 2;
+}
+
+/**
+ * WORKLOAD
+ */
+static const char* kRequests[] = {
+    // Chrome, first page load
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: localhost:8000\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cookie: _ga=GA1.1.1234567890.1700000000; session=4f1c2a9b8e7d6c5b4a39281706f5e4d3; theme=dark\r\n"
+    "\r\n",
+
+    // Firefox, sub-resource
+    "GET /fancybox/jquery.fancybox-1.3.4.css HTTP/1.1\r\n"
+    "Host: localhost:8000\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:125.0) Gecko/20100101 Firefox/125.0\r\n"
+    "Accept: text/css,*/*;q=0.1\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "Referer: http://localhost:8000/index.html\r\n"
+    "Sec-Fetch-Dest: style\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "\r\n",
+
+    // curl
+    "GET /images/wine3.jpg HTTP/1.1\r\n"
+    "Host: 127.0.0.1:8000\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n",
+};
+#define NUM_REQUESTS (sizeof(kRequests) / sizeof(kRequests[0]))
+
+double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/// @brief parse every request, delivered `chunk` bytes per simulated recv
+double run(int legacy, size_t chunk, long iterations) {
+    legacy_request_t legacy_request;
+    http_request_t request;
+    volatile size_t sink = 0;
+
+    double start = now_ns();
+    for (long it = 0; it < iterations; it++) {
+        const char* req = kRequests[it % NUM_REQUESTS];
+        size_t total = strlen(req);
+        size_t scan_pos = 0;
+
+        for (size_t avail = chunk < total ? chunk : total; ; avail = avail + chunk < total ? avail + chunk : total) {
+            int done = legacy ? legacy_parse(req, avail, &legacy_request) : current_parse(req, avail, &scan_pos, &request);
+            if (done || avail == total) break;
+        }
+        sink += legacy ? legacy_request.path[1] : request.path[1];
+    }
+    (void) sink;
+    return (now_ns() - start) / iterations;
+}
+
+int main(int argc, char* argv[]) {
+    long iterations = 1000000;
+    if (argc > 1 && (!IS_OK_APP(try_conv_long(argv[1], &iterations)) || iterations < 1)) {
+        printf("usage: %s [iterations]\n", argv[0]);
+        return APP_ERR;
+    }
+
+#if defined(__AVX2__)
+    const char* isa = "avx2";
+#elif defined(__SSE2__)
+    const char* isa = "sse2";
+#else
+    const char* isa = "scalar";
+#endif
+
+    static const size_t chunks[] = { SIZE_MAX, 64, 16 };
+    printf("{\"benchmark\":\"parser\",\"isa\":\"%s\",\"iterations\":%ld,\"results\":[", isa, iterations);
+    for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+        double legacy = run(1, chunks[i], iterations);
+        double current = run(0, chunks[i], iterations);
+        printf("%s{\"chunk\":%ld,\"legacy_ns\":%.1f,\"current_ns\":%.1f,\"speedup\":%.2f}",
+            i ? "," : "", chunks[i] == SIZE_MAX ? -1L : (long) chunks[i], legacy, current, legacy / current);
+    }
+    printf("]}\n");
+    return APP_OK;
+}
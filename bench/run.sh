@@ -0,0 +1,69 @@
+#!/bin/sh
+# Runs the microbenchmarks, then a fixed set of load scenarios against a
+# freshly started server. Every result is one JSON line on stdout, so runs
+# can be saved and diffed commit to commit:
+#
+#   make bench > bench-$(git rev-parse --short HEAD).jsonl
+#
+# BENCH_PORT, BENCH_DURATION (seconds per scenario), BENCH_CONNS and
+# BENCH_THREADS override the defaults; BENCH_SERVER_ARGS is passed to the
+# server (the proxy and its backend alike), BENCH_BUSY_POLL to -P in the
+# busy poll scenario.
+set -e
+cd "$(dirname "$0")/.."
+
+PORT=${BENCH_PORT:-8199}
+DURATION=${BENCH_DURATION:-5}
+CONNS=${BENCH_CONNS:-64}
+THREADS=${BENCH_THREADS:-4}
+
+./bench/parser_bench
+./bench/builder_bench
+
+# start_server <port> [args...]: a fresh server, once it accepts
+start_server() {
+    port=$1
+    shift
+    ./server $BENCH_SERVER_ARGS "$@" "$port" > /dev/null 2>&1 &
+    SERVER=$!
+    for _ in 1 2 3 4 5 6 7 8 9 10; do
+        ./bench/loadgen -c 1 -t 1 -d 1 -W 0 "$port" > /dev/null 2>&1 && break
+        sleep 0.2
+    done
+}
+
+# also stops the proxy scenario's backend, if one is running
+stop_server() {
+    kill -INT $SERVER $BACKEND 2>/dev/null
+    wait $SERVER $BACKEND 2>/dev/null || true
+    BACKEND=
+}
+
+trap stop_server EXIT INT TERM
+start_server "$PORT"
+
+LOAD="./bench/loadgen -d $DURATION -t $THREADS -s 1"
+$LOAD -c "$CONNS" -m mixed "$PORT"
+$LOAD -c "$CONNS" -m small "$PORT"
+$LOAD -c "$CONNS" -m small -p 16 "$PORT"
+$LOAD -c "$CONNS" -m large "$PORT"
+$LOAD -c "$CONNS" -m mixed -k "$PORT"
+
+# latency tier: one request in flight at a time, so p99 is dominated by
+# wakeups; repeated on PORT+1 with pinned, busy-polling workers
+# (BENCH_BUSY_POLL microseconds, default 50)
+LATENCY="./bench/loadgen -d $DURATION -t 1 -c 1 -s 1 -m small"
+$LATENCY "$PORT"
+stop_server
+start_server $((PORT + 1)) -A -P "${BENCH_BUSY_POLL:-50}"
+$LATENCY $((PORT + 1))
+
+# reverse proxy tier: a proxy on PORT+2 in front of a second server on
+# PORT+3, pooled upstream connections and bodies spliced through
+stop_server
+start_server $((PORT + 3))
+BACKEND=$SERVER
+start_server $((PORT + 2)) -R "/=127.0.0.1:$((PORT + 3))"
+$LOAD -c "$CONNS" -m small $((PORT + 2))
+$LOAD -c "$CONNS" -m large $((PORT + 2))
+$LOAD -c "$CONNS" -m mixed -k $((PORT + 2))
@@ -12,6 +12,8 @@ import hashlib
 from concurrent.futures import ThreadPoolExecutor, as_completed
 import urllib.request
 import socket
+import threading
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
 from typing import Optional
 
 # ---------- utilities ----------
@@ -148,6 +150,238 @@ def send_raw_request(host: str, port: int, req_bytes: bytes, timeout: float = 2.
                 pass
             sock.close()
 
+# ---------- reverse proxy stand-in ----------
+
+# the chunked stand-in response, and the body it decodes to
+_CHUNKS = [b"chunk %d " % i * (i * 37 + 1) for i in range(40)]
+_CHUNKED_BODY = b"".join(_CHUNKS)
+
+
+class StandInBackend:
+    """A local HTTP/1.1 backend for the proxy checks.
+
+    Serves files under www/ with the target's first path segment (the route
+    prefix) stripped, plus /<prefix>/chunked as a chunked response. Counts
+    the connections it accepts, and stop() also cuts its keep-alive ones,
+    so the proxy sees it die like a real backend.
+    """
+
+    def __init__(self, www: str):
+        backend = self
+        self.www = Path(www)
+        self.accepted = 0
+        self.conns = set()
+        self.lock = threading.Lock()
+
+        class Handler(BaseHTTPRequestHandler):
+            protocol_version = "HTTP/1.1"
+
+            def setup(self):
+                super().setup()
+                with backend.lock:
+                    backend.accepted += 1
+                    backend.conns.add(self.connection)
+
+            def finish(self):
+                with backend.lock:
+                    backend.conns.discard(self.connection)
+                super().finish()
+
+            def _respond(self, head_only: bool):
+                rest = self.path.split("?", 1)[0].split("/", 2)[2:]
+                rest = rest[0] if rest else ""
+                if rest == "chunked":
+                    self.send_response(200)
+                    self.send_header("Content-Type", "text/plain")
+                    self.send_header("Transfer-Encoding", "chunked")
+                    self.end_headers()
+                    if not head_only:
+                        for c in _CHUNKS:
+                            self.wfile.write(b"%x\r\n%s\r\n" % (len(c), c))
+                        self.wfile.write(b"0\r\n\r\n")
+                    return
+                f = backend.www / (rest or "index.html")
+                if not f.is_file():
+                    self.send_error(404)
+                    return
+                data = f.read_bytes()
+                self.send_response(200)
+                self.send_header("Content-Length", str(len(data)))
+                self.end_headers()
+                if not head_only:
+                    self.wfile.write(data)
+
+            def do_GET(self):
+                self._respond(False)
+
+            def do_HEAD(self):
+                self._respond(True)
+
+            def log_message(self, *a):
+                pass
+
+        self.httpd = ThreadingHTTPServer(("127.0.0.1", 0), Handler)
+        self.httpd.daemon_threads = True
+        self.port = self.httpd.server_address[1]
+        self.thread = threading.Thread(target=self.httpd.serve_forever, daemon=True)
+        self.thread.start()
+
+    def stop(self):
+        self.httpd.shutdown()
+        self.httpd.server_close()
+        with self.lock:
+            for c in list(self.conns):
+                try:
+                    c.shutdown(socket.SHUT_RDWR)
+                except OSError:
+                    pass
+
+
+def _http_exchange(port: int, req: bytes, timeout: float = 5.0) -> Tuple[bytes, bytes]:
+    """One request on a fresh connection, read to the close; (head, body)."""
+    with socket.create_connection(("127.0.0.1", port), timeout=timeout) as sock:
+        sock.settimeout(timeout)
+        sock.sendall(req)
+        data = bytearray()
+        while True:
+            chunk = sock.recv(65536)
+            if not chunk:
+                break
+            data.extend(chunk)
+    head, _, body = bytes(data).partition(b"\r\n\r\n")
+    return head, body
+
+
+def _dechunk(body: bytes) -> bytes:
+    out = bytearray()
+    while True:
+        line, _, body = body.partition(b"\r\n")
+        size = int(line.split(b";")[0], 16)
+        if size == 0:
+            return bytes(out)
+        out.extend(body[:size])
+        if body[size:size + 2] != b"\r\n":
+            raise ValueError("chunk not followed by CRLF")
+        body = body[size + 2:]
+
+
+def _metric(port: int, name: str) -> int:
+    code, out, _ = curl_get(f"http://127.0.0.1:{port}/metrics")
+    if code != 0:
+        return -1
+    total = 0
+    for line in out.decode().splitlines():
+        if line.startswith(name + " ") or line.startswith(name + "{"):
+            total += int(float(line.rsplit(" ", 1)[1]))
+    return total
+
+
+def check_reverse_proxy(args) -> bool:
+    """Run the server as a reverse proxy in front of stand-in backends."""
+    workers = 2
+    main_be = StandInBackend(args.www)
+    pair = [StandInBackend(args.www), StandInBackend(args.www)]
+    port = args.port + 1
+    proxy = subprocess.Popen(
+        [args.exe, "-w", str(workers), "-M", "/metrics",
+         "-R", f"/proxied=127.0.0.1:{main_be.port}",
+         "-R", f"/pair=127.0.0.1:{pair[0].port},127.0.0.1:{pair[1].port}", str(port)],
+        stdout=subprocess.DEVNULL,
+        stderr=subprocess.DEVNULL,
+        preexec_fn=os.setsid,
+    )
+    passed = 0
+    checks = 5
+    try:
+        ok, _ = wait_for_server(proxy, f"http://127.0.0.1:{port}/proxied/index.html",
+                                curl_timeout_s=args.curl_timeout, ready_timeout_s=args.server_ready_timeout)
+        if not ok:
+            print("[FAIL] Proxy did not become ready.")
+            return False
+
+        # 1) bodies come through byte for byte
+        same = True
+        for path in ["index.html", "images/wine3.jpg"]:
+            _, direct, _ = curl_get(f"http://127.0.0.1:{main_be.port}/proxied/{path}")
+            _, proxied, _ = curl_get(f"http://127.0.0.1:{port}/proxied/{path}")
+            if not direct or sha256(direct) != sha256(proxied):
+                print(f"[FAIL] Proxied /{path} differs from the backend's ({len(proxied)} vs {len(direct)} bytes)")
+                same = False
+        if same:
+            print("[OK] Proxied bodies match the backend's byte for byte.")
+            passed += 1
+
+        # 2) chunked and HEAD framing: HTTP/1.1 keeps the chunks, HTTP/1.0
+        # gets them decoded and a close; HEAD has no body on a reused connection
+        try:
+            head11, body11 = _http_exchange(port, b"GET /proxied/chunked HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n")
+            head10, body10 = _http_exchange(port, b"GET /proxied/chunked HTTP/1.0\r\n\r\n")
+            if b"transfer-encoding: chunked" not in head11.lower() or _dechunk(body11) != _CHUNKED_BODY:
+                raise AssertionError("HTTP/1.1 chunked body mismatch")
+            if b"transfer-encoding" in head10.lower() or body10 != _CHUNKED_BODY:
+                raise AssertionError("HTTP/1.0 body not decoded from chunks")
+            expected = (Path(args.www) / "index.html").read_bytes()
+            with socket.create_connection(("127.0.0.1", port), timeout=5.0) as sock:
+                sock.sendall(b"HEAD /proxied/index.html HTTP/1.1\r\nHost: x\r\nConnection: keep-alive\r\n\r\n")
+                code, cl, rest = _read_headers_and_len(sock)
+                if code != 200 or cl != len(expected) or rest:
+                    raise AssertionError(f"HEAD answered {code}, Content-Length {cl}, {len(rest)} body bytes")
+                sock.sendall(b"GET /proxied/index.html HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n")
+                code, cl, rest = _read_headers_and_len(sock)
+                body, _ = _drain_body(sock, cl or 0, rest)
+                if code != 200 or body != expected:
+                    raise AssertionError("GET after HEAD on the same connection mismatched")
+            print("[OK] Chunked (HTTP/1.1 and 1.0) and HEAD responses are framed correctly.")
+            passed += 1
+        except (AssertionError, ValueError, EOFError, OSError) as e:
+            print(f"[FAIL] Proxy framing: {e}")
+
+        # 3) pooled upstream connections: N requests, each on a new client
+        # connection, open at most one upstream connection per worker
+        before = main_be.accepted
+        codes = [curl_http_code(f"http://127.0.0.1:{port}/proxied/index.html") for _ in range(args.proxy_requests)]
+        opened = main_be.accepted - before
+        if all(c == 200 for c in codes) and opened <= workers:
+            print(f"[OK] {args.proxy_requests} proxied requests opened {opened} new upstream connections.")
+            passed += 1
+        else:
+            print(f"[FAIL] {args.proxy_requests} proxied requests opened {opened} upstream connections "
+                  f"(at most {workers} expected), statuses {sorted(set(codes))}")
+
+        # 4) a stopped backend of a pair: its requests are retried on the other
+        for _ in range(4):
+            curl_http_code(f"http://127.0.0.1:{port}/pair/index.html")
+        failures = _metric(port, "server_upstream_failures_total")
+        pair[0].stop()
+        codes = [curl_http_code(f"http://127.0.0.1:{port}/pair/index.html") for _ in range(6)]
+        retried = _metric(port, "server_upstream_failures_total") - failures
+        if all(c == 200 for c in codes) and retried > 0:
+            print(f"[OK] With one backend stopped, requests were retried on the other ({retried} failures, all 200).")
+            passed += 1
+        else:
+            print(f"[FAIL] With one backend stopped: statuses {codes}, {retried} failures recorded")
+
+        # 5) ... and with both stopped the client gets 502
+        pair[1].stop()
+        codes = [curl_http_code(f"http://127.0.0.1:{port}/pair/index.html") for _ in range(3)]
+        if all(c == 502 for c in codes):
+            print("[OK] With every backend stopped, the proxy answers 502.")
+            passed += 1
+        else:
+            print(f"[FAIL] With every backend stopped: statuses {codes}, expected 502")
+    finally:
+        kill_process_group(proxy)
+        main_be.stop()
+        for be in pair:
+            try:
+                be.stop()
+            except Exception:
+                pass
+
+    print(f"[RESULT] Reverse proxy checks passed: {passed} / {checks}")
+    return passed == checks
+
+
 # ---------- grading logic ----------
 
 def wait_for_server(proc, url, curl_timeout_s=2, ready_timeout_s=10):
@@ -255,6 +489,10 @@ def main():
     parser.add_argument("--multi-total", type=int, default=15, help="Total requests in multi-conn test")
     parser.add_argument("--multi-concurrency", type=int, default=15, help="Concurrent workers in multi-conn test")
     parser.add_argument("--multi-timeout", type=float, default=2.0, help="Per-request timeout (seconds) in multi-conn test")
+
+    # Step 9 parameters
+    parser.add_argument("--skip-proxy", action="store_true", help="Skip the reverse proxy checks")
+    parser.add_argument("--proxy-requests", type=int, default=50, help="Requests in the upstream connection reuse check")
     args = parser.parse_args()
 
     ensure_tool("make")
@@ -542,10 +780,75 @@ def main():
                     print("Score for persistent connections: 0 / 10")
 
 
+        # 8) Request path normalization (pass/fail, no points)
+        print("== Step 8: Request path normalization (checks, no points) ==")
+        norm_passed = 0
+        norm_checks = 5
+        if not server_running(server):
+            print(f"[FAIL] Server not running at Step 8 (exit={server.returncode}).")
+        else:
+            host, port = "127.0.0.1", args.port
+
+            def raw_get(target: str) -> Tuple[int, bytes]:
+                req = (f"GET {target} HTTP/1.1\r\nHost: {host}:{port}\r\nConnection: close\r\n\r\n").encode()
+                status, buf = send_raw_request(host, port, req, timeout=5.0)
+                return status, buf.split(b"\r\n\r\n", 1)[-1]
+
+            # 8a/8b) dot segments, encoded or not, stay under the document root
+            outside = Path(args.www).resolve().parent / "server.c"
+            marker = outside.read_bytes()[:256] if outside.is_file() else None
+            for target in ("/%2e%2e/server.c", "/images/../../server.c"):
+                status, body = raw_get(target)
+                if status != 200 and (marker is None or marker not in body):
+                    norm_passed += 1
+                    print(f"[OK] {target} stays under the document root: got {status}")
+                else:
+                    print(f"[FAIL] {target} escaped the document root: got {status}")
+
+            # 8c) the query string is not part of the file name
+            expected = (Path(args.www) / "index.html").read_bytes()
+            status, body = raw_get("/index.html?v=2")
+            if status == 200 and body == expected:
+                norm_passed += 1
+                print("[OK] /index.html?v=2 serves index.html: got 200")
+            else:
+                print(f"[FAIL] /index.html?v=2: expected 200 with index.html, got {status} ({len(body)} bytes)")
+
+            # 8d) an encoded NUL can't cut the path short
+            status, _ = raw_get("/a%00b")
+            if status == 400:
+                norm_passed += 1
+                print("[OK] /a%00b rejected: got 400")
+            else:
+                print(f"[FAIL] /a%00b: expected 400, got {status}")
+
+            # 8e) ".." inside a segment is an ordinary file name
+            dotted = Path(args.www) / "grade..check.txt"
+            content = b"dots inside a name\n"
+            try:
+                dotted.write_bytes(content)
+                status, body = raw_get("/grade..check.txt")
+            finally:
+                dotted.unlink(missing_ok=True)
+            if status == 200 and body == content:
+                norm_passed += 1
+                print("[OK] /grade..check.txt served as a file: got 200")
+            else:
+                print(f"[FAIL] /grade..check.txt: expected 200 with its contents, got {status}")
+
+        print(f"[RESULT] Path normalization checks passed: {norm_passed} / {norm_checks}")
+        norm_ok = norm_passed == norm_checks
+
+        # 9) Reverse proxy (pass/fail, no points), on port + 1 against stand-in backends
+        proxy_ok = True
+        if not args.skip_proxy:
+            print("== Step 9: Reverse proxy (checks, no points) ==")
+            proxy_ok = check_reverse_proxy(args)
+
         # Final
         print("== Final Score ==")
         print(f"Total points: {total_points} / {max_points}")
-        sys.exit(0 if total_points == max_points else 1)
+        sys.exit(0 if total_points == max_points and norm_ok and proxy_ok else 1)
 
     finally:
         kill_process_group(server)
@@ -0,0 +1,178 @@
+// generated by tools/gen_tables.py (make tables), do not edit
+#ifndef HTTP_TABLES_H
+#define HTTP_TABLES_H
+
+/// @brief header fields interned while parsing
+typedef enum {
+    HDR_CONNECTION,
+    HDR_CONTENT_LENGTH,
+    HDR_TRANSFER_ENCODING,
+    HDR_ACCEPT_ENCODING,
+    HDR_IF_NONE_MATCH,
+    HDR_IF_MODIFIED_SINCE,
+    HDR_RANGE,
+    HDR_IF_RANGE,
+    HDR_REFERER,
+    HDR_USER_AGENT,
+    HDR_HOST,
+    HDR_X_FORWARDED_FOR,
+    HDR_KEEP_ALIVE,
+    HDR_PROXY_CONNECTION,
+    HDR_TE,
+    HDR_TRAILER,
+    HDR_UPGRADE,
+    HDR_KINDS,
+    HDR_UNKNOWN = HDR_KINDS,
+} header_id_t;
+
+#define HEADER_HASH_SEED 0x0000000du
+#define HEADER_HASH_SLOTS 64
+
+static const struct {
+    const char* name;
+    size_t len;
+} gHeaderNames[HDR_KINDS] = {
+    { "Connection", 10 },
+    { "Content-Length", 14 },
+    { "Transfer-Encoding", 17 },
+    { "Accept-Encoding", 15 },
+    { "If-None-Match", 13 },
+    { "If-Modified-Since", 17 },
+    { "Range", 5 },
+    { "If-Range", 8 },
+    { "Referer", 7 },
+    { "User-Agent", 10 },
+    { "Host", 4 },
+    { "X-Forwarded-For", 15 },
+    { "Keep-Alive", 10 },
+    { "Proxy-Connection", 16 },
+    { "TE", 2 },
+    { "Trailer", 7 },
+    { "Upgrade", 7 },
+};
+
+// header_id_t by hash slot, HDR_UNKNOWN where no name lands
+static const unsigned char gHeaderSlots[HEADER_HASH_SLOTS] = {
+    HDR_HOST,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_CONNECTION,
+    HDR_X_FORWARDED_FOR,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_ACCEPT_ENCODING,
+    HDR_UNKNOWN,
+    HDR_REFERER,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_UPGRADE,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_RANGE,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_PROXY_CONNECTION,
+    HDR_KEEP_ALIVE,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_IF_MODIFIED_SINCE,
+    HDR_IF_RANGE,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_TRANSFER_ENCODING,
+    HDR_UNKNOWN,
+    HDR_TE,
+    HDR_UNKNOWN,
+    HDR_TRAILER,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_CONTENT_LENGTH,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_UNKNOWN,
+    HDR_IF_NONE_MATCH,
+    HDR_UNKNOWN,
+    HDR_USER_AGENT,
+};
+
+#define MIME_HASH_SEED 0x00000071u
+#define MIME_HASH_SLOTS 256
+
+// built-in extension -> media type, by hash slot
+static const struct {
+    const char* ext;
+    size_t ext_len;
+    const char* type;
+} gMimeSlots[MIME_HASH_SLOTS] = {
+    [1] = { "vtt", 3, "text/vtt" },
+    [8] = { "mjs", 3, "application/javascript" },
+    [19] = { "m4v", 3, "video/mp4" },
+    [34] = { "m4a", 3, "audio/mp4" },
+    [37] = { "eot", 3, "application/vnd.ms-fontobject" },
+    [58] = { "flac", 4, "audio/flac" },
+    [68] = { "xml", 3, "application/xml" },
+    [72] = { "ico", 3, "image/x-icon" },
+    [84] = { "ics", 3, "text/calendar" },
+    [91] = { "woff2", 5, "font/woff2" },
+    [101] = { "gz", 2, "application/gzip" },
+    [107] = { "jpeg", 4, "image/jpeg" },
+    [110] = { "html", 4, "text/html" },
+    [113] = { "js", 2, "application/javascript" },
+    [117] = { "pdf", 3, "application/pdf" },
+    [125] = { "ogv", 3, "video/ogg" },
+    [131] = { "htm", 3, "text/html" },
+    [135] = { "tiff", 4, "image/tiff" },
+    [139] = { "mp4", 3, "video/mp4" },
+    [142] = { "mp3", 3, "audio/mpeg" },
+    [143] = { "woff", 4, "font/woff" },
+    [149] = { "csv", 3, "text/csv" },
+    [156] = { "avif", 4, "image/avif" },
+    [159] = { "jpg", 3, "image/jpeg" },
+    [166] = { "gif", 3, "image/gif" },
+    [175] = { "txt", 3, "text/plain" },
+    [176] = { "otf", 3, "font/otf" },
+    [181] = { "wav", 3, "audio/wav" },
+    [184] = { "webmanifest", 11, "application/manifest+json" },
+    [186] = { "png", 3, "image/png" },
+    [189] = { "bmp", 3, "image/bmp" },
+    [190] = { "ogg", 3, "audio/ogg" },
+    [204] = { "oga", 3, "audio/ogg" },
+    [208] = { "zip", 3, "application/zip" },
+    [212] = { "tif", 3, "image/tiff" },
+    [213] = { "map", 3, "application/json" },
+    [216] = { "tar", 3, "application/x-tar" },
+    [218] = { "css", 3, "text/css" },
+    [219] = { "md", 2, "text/markdown" },
+    [220] = { "svg", 3, "image/svg+xml" },
+    [221] = { "json", 4, "application/json" },
+    [232] = { "wasm", 4, "application/wasm" },
+    [233] = { "webp", 4, "image/webp" },
+    [244] = { "ttf", 3, "font/ttf" },
+    [254] = { "webm", 4, "video/webm" },
+};
+
+#endif
@@ -1,29 +1,82 @@
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <ctype.h>
 #include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
 #include <limits.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/openat2.h>
+#include <linux/filter.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <netdb.h>
+#include <arpa/inet.h>
 #include <unistd.h>
 #include <string.h>
 #include <strings.h>
 #include <stdint.h>
+#include <stdatomic.h>
 #include <time.h>
 #include <sys/sendfile.h>
 #include <signal.h>
 #include <pthread.h>
+#include <sched.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "http_tables.h"
+
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// maximum number of header fields tokenized per request
+#define MAX_HEADERS 32
 
 /**
  * TYPES
  */
+// header field, slices of the receive buffer (not NUL-terminated)
 typedef struct {
-    char path[512];
-    char connection[32];
-    char method[16];
-    char version[16];
+    const char* name;
+    size_t name_len;
+    const char* value;
+    size_t value_len;
+    header_id_t id;
+} http_header_t;
+
+/// @brief tokenized request head, all fields point into the receive buffer
+/// and stay valid until the request is consumed
+typedef struct {
+    const char* method;
+    size_t method_len;
+    const char* path;
+    size_t path_len;
+    const char* version;
+    size_t version_len;
+
+    http_header_t headers[MAX_HEADERS];
+    size_t num_headers;
+
+    // first field of each known name, index into headers + 1, 0 if absent
+    unsigned char header_index[HDR_KINDS];
 } http_request_t;
 
 typedef enum {
@@ -31,10 +84,82 @@ typedef enum {
     APP_ERR = 1
 } result_t;
 
-typedef struct {
-    int keep_alive;
-    time_t last_activity;
-} connection_t;
+// outcome of a non-blocking socket operation
+typedef enum {
+    IO_DONE = 0,    // operation ran to completion
+    IO_PENDING = 1, // socket would block, wait for the next readiness event
+    IO_CLOSED = 2,  // peer went away or a fatal error occurred
+    IO_YIELD = 3    // turn's send budget used up, the socket may take more
+} io_result_t;
+
+// receive buffer sizes, see RECV_SMALL_SIZE
+typedef enum {
+    RECV_SMALL,
+    RECV_LARGE,
+    RECV_TIERS,
+} recv_tier_t;
+
+// Content-Encoding of a response body, in increasing order of preference
+typedef enum {
+    ENC_IDENTITY = 0,
+    ENC_GZIP = 1,
+    ENC_BR = 2,
+    ENC_KINDS = 3
+} content_encoding_t;
+
+// diagnostic verbosity, messages above the configured level are skipped
+typedef enum {
+    LOG_LEVEL_ERROR = 0,
+    LOG_LEVEL_WARN = 1,
+    LOG_LEVEL_INFO = 2,
+    LOG_LEVEL_DEBUG = 3
+} log_level_t;
+
+// access log line format
+typedef enum {
+    LOG_FORMAT_COMBINED = 0, // Apache/nginx "combined"
+    LOG_FORMAT_JSON = 1      // one JSON object per line, includes latency
+} log_format_t;
+
+// how workers wait for socket I/O
+typedef enum {
+    BACKEND_EPOLL = 0, // readiness events, then non-blocking system calls
+    BACKEND_URING = 1  // io_uring submissions and completions
+} io_backend_t;
+
+// what an io_uring completion belongs to, kept in the low bits of its
+// user_data; the rest is the owning connection or worker
+typedef enum {
+    URING_OP_IGNORE = 0,
+    URING_OP_ACCEPT = 1,
+    URING_OP_RECV = 2,
+    URING_OP_SEND = 3,
+    URING_OP_POLL = 4,
+    URING_OP_SPLICE_IN = 5,
+    URING_OP_SPLICE_OUT = 6,
+    URING_OP_MASK = 7
+} uring_op_t;
+
+// which deadline a connection's timer currently enforces
+typedef enum {
+    TIMER_IDLE = 0,   // keep-alive, waiting for the next request
+    TIMER_HEADER = 1, // part of a request has arrived, waiting for the rest
+    TIMER_WRITE = 2,  // response queued, waiting for the peer to read it
+    TIMER_KINDS = 3
+} timer_kind_t;
+
+// where a proxied exchange stands on its upstream connection
+typedef enum {
+    UP_IDLE = 0,       // pooled, waiting for the next request
+    UP_SENDING = 1,    // writing the request
+    UP_HEAD = 2,       // reading the response head
+    UP_BODY = 3,       // Content-Length body, or one that ends with the connection
+    UP_CHUNK_SIZE = 4, // chunked body: size line
+    UP_CHUNK_DATA = 5, // chunked body: chunk data
+    UP_CHUNK_END = 6,  // chunked body: CRLF after the data
+    UP_TRAILER = 7,    // trailer fields up to the blank line
+    UP_DONE = 8        // response read, complete once the client has it all
+} upstream_state_t;
 
 /**
  * CONSTANTS
@@ -51,20 +176,555 @@ typedef struct {
 #define LISTEN_QUEUE_SIZE 1024
 
 // HTTP configuration
-#define BUFFER_SIZE 8192
 #define DOCUMENT_ROOT "./www"
 #define PATH_MAX_LEN 1024
+#define ARENA_SIZE 4096
+
+// receive buffers: a connection reads into a RECV_SMALL_SIZE buffer from
+// its worker's pool, a request head that outgrows it moves to one of
+// gMaxHeaderSize bytes (431 beyond that); idle connections hold neither.
+// Each worker keeps up to RECV_POOL_KEEP free buffers per tier
+#define RECV_SMALL_SIZE 4096
+#define DEFAULT_MAX_HEADER_SIZE (32 * 1024)
+#define MAX_HEADER_SIZE_LIMIT (1024 * 1024)
+#define RECV_POOL_KEEP 256
+
+// request bodies are never used, up to this many bytes are read and
+// dropped so the connection stays usable; larger ones get 413
+#define DEFAULT_MAX_BODY_SIZE (1024 * 1024)
+#define CONN_SEG_MAX 64
+
+// arena bytes / segments that must be free before another request is
+// parsed, enough for the largest response (e.g. two error pages)
+#define ARENA_RESERVE 1024
+#define SEG_RESERVE 4
+
+// file cache configuration
+#define CACHE_DEFAULT_CAPACITY (32 * 1024 * 1024)
+#define CACHE_MAX_ENTRY_SIZE (256 * 1024)
+#define CACHE_MAX_ENTRIES 4096
+#define CACHE_BUCKETS 8192
+#define CACHE_DEFAULT_TTL 2
+#define FD_CACHE_DEFAULT_MAX 256
+
+// longest extension a mime.types file (-T) may list
+#define MIME_EXT_MAX 16
+
+// document root index (-I): paths indexed at most, directories nftw()
+// keeps open while walking, and how often the main thread checks whether a
+// replaced index can be freed
+#define DOC_INDEX_MAX_ENTRIES (1 << 20)
+#define DOC_INDEX_WALK_FDS 32
+#define DOC_INDEX_RELOAD_POLL_MS 10
+
+// compression configuration, bodies are compressed once and cached so
+// favour ratio over speed; smaller bodies are not worth the extra header
+#define GZIP_LEVEL 9
+#define BROTLI_QUALITY 9
+#define COMPRESS_MIN_SIZE 256
+
+// byte ranges: more parts than this are answered with the whole body
+#define MAX_RANGES 16
+#define MULTIPART_BOUNDARY "3d6b6a416f9b5c2e"
+
+// event loop configuration
+#define MAX_EVENTS 256
+#define EPOLL_TIMEOUT_MS 1000
+
+// timer wheel: TIMER_SLOTS buckets of TIMER_TICK_MS each, deadlines further
+// out than one lap stay in their bucket and are skipped until due
+#define TIMER_TICK_MS 100
+#define TIMER_SLOTS 512
+#define DEFAULT_IDLE_TIMEOUT 10
+#define DEFAULT_HEADER_TIMEOUT 10
+#define DEFAULT_WRITE_TIMEOUT 30
+
+// bytes one connection may write per event loop turn before the worker's
+// other connections get theirs, so a large download can't starve them
+#define DEFAULT_SEND_BUDGET (512 * 1024)
+
+// busy polling (-P): packets the kernel may pull off a NIC queue per busy
+// poll, the most allowed without CAP_NET_ADMIN. Headers before Linux 6.9
+// lack the epoll ioctl, the kernel then rejects it and only the userspace
+// spin remains
+#define BUSY_POLL_BUDGET 64
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+// hot restart (-U): seconds a replaced process keeps serving the requests
+// it has before closing what is left, descriptors per SCM_RIGHTS message
+// (the kernel takes at most 253), size of the records carrying warm cache
+// keys and how long either side waits for the other
+#define DEFAULT_DRAIN_TIMEOUT 30
+#define HANDOFF_MAGIC 0x48535256
+#define HANDOFF_FDS_PER_MSG 250
+#define HANDOFF_RECORD_SIZE (16 * 1024)
+#define HANDOFF_IO_TIMEOUT 10
+
+// reverse proxy (-R): routes and backends configured at most, pooled idle
+// connections a worker keeps per backend, the size of an upstream
+// connection's request and response buffers, and bytes pulled per
+// upstream -> pipe splice. A backend failing PROXY_MAX_FAILS times in a
+// row is skipped for PROXY_RETRY_MS; a request that hasn't had a response
+// after PROXY_MAX_ATTEMPTS connections is answered 502
+#define PROXY_MAX_ROUTES 16
+#define PROXY_MAX_BACKENDS 64
+#define PROXY_PREFIX_MAX 128
+#define PROXY_NAME_MAX 128
+#define PROXY_IDLE_MAX 32
+#define UPSTREAM_BUFFER_SIZE (16 * 1024)
+#define PROXY_SPLICE_CHUNK (64 * 1024)
+#define PROXY_MAX_FAILS 3
+#define PROXY_RETRY_MS 5000
+#define PROXY_MAX_ATTEMPTS 3
+
+// idle connections closed per accept while descriptors run short
+#define SHED_BATCH 16
+#define MAX_WORKERS 256
+#define ACCEPT_BATCH 64
+#define CACHE_LINE_SIZE 64
+#define DEFAULT_MAX_CONNS 4096
+
+// io_uring backend: submission queue depth, receive buffers provided to
+// the kernel per worker, and bytes moved per file -> pipe -> socket splice.
+// A multishot receive keeps completing until its cancellation lands, so a
+// connection whose receive buffer is full parks up to URING_PARKED_MAX
+// buffers (256 KB of pipelined requests) before it is dropped
+#define URING_ENTRIES 1024
+#define URING_BUF_COUNT 1024
+#define URING_BUF_SIZE 4096
+#define URING_BUF_GROUP 0
+#define URING_PARKED_MAX 64
+#define URING_SPLICE_CHUNK (64 * 1024)
+
+// HTTPS: plaintext encrypted per record when the kernel can't do it (one
+// full TLS record), and the server-side cache of TLS 1.2 sessions
+#define TLS_CHUNK_SIZE (16 * 1024)
+#define TLS_SESSION_CACHE_SIZE 20480
+#define TLS_SESSION_TIMEOUT 7200
+
+// access log: records per worker ring, how long the drain thread sleeps
+// once the rings are empty, and the size of its write batches
+#define LOG_RING_SIZE 2048
+#define LOG_DRAIN_INTERVAL_MS 20
+#define LOG_WRITE_BUFFER (256 * 1024)
+#define LOG_PATH_MAX 256
+#define LOG_FIELD_MAX 128
+
+// latency histograms: HIST_SUB_BUCKETS linear buckets per power of two
+// (12.5% precision), nanosecond values up to 2^HIST_OCTAVES
+#define HIST_SUB_BITS 3
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_OCTAVES 40
+#define HIST_BUCKETS ((HIST_OCTAVES - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+#define METRICS_BUFFER_SIZE (32 * 1024)
+
+/**
+ * CONNECTION STATE
+ */
+typedef struct worker worker_t;
+typedef struct cache_entry cache_entry_t;
+typedef struct fd_entry fd_entry_t;
+typedef struct log_ring log_ring_t;
+typedef struct upstream upstream_t;
+
+// epoll data of an upstream socket: its upstream_t with the low bit set,
+// client connections and listeners are registered by plain pointer
+#define UPSTREAM_TAG 1
+
+// peer address of a client connection
+typedef union {
+    struct sockaddr sa;
+    struct sockaddr_in in;
+    struct sockaddr_in6 in6;
+} peer_addr_t;
+
+/// @brief one piece of queued response output
+typedef struct {
+    // memory segment, used when file is NULL
+    struct iovec iov;
+
+    // file region sent with sendfile
+    fd_entry_t* file;
+    off_t file_off;
+    off_t file_end;
+
+    // cache entry pinned until this segment has been written
+    cache_entry_t* entry;
+
+    // when the request this segment answers started (0 if not marked), on
+    // a response's first segment for time-to-first-byte, on its last one
+    // for total response time
+    uint64_t ttfb_start;
+    uint64_t done_start;
+} out_seg_t;
+
+/// @brief per-connection state machine, replaces the old per-thread
+/// client_func loop so that an idle connection is just this struct.
+/// Connections come from a per-worker pool; the fields touched on every
+/// event sit in the first cache line, the buffers follow
+typedef struct connection {
+    int fd;
+    int keep_alive;
+    int close_after_write;
+    int seg_idx;
+    int seg_cnt;
+    size_t buffer_start;
+    size_t buffer_len;
+    size_t scan_pos;
+    size_t arena_used;
+    worker_t* worker;
+
+    // timer wheel bucket membership, timer_next doubles as the free-list
+    // link while pooled; timer_slot is -1 while not in the wheel
+    timer_kind_t timer_kind;
+    int timer_slot;
+    uint64_t deadline;
+    struct connection* timer_prev;
+    struct connection* timer_next;
+
+    // queued on the worker's ready list after using up its send budget
+    // with the socket still writable, edge-triggered epoll won't report it;
+    // also when its upstream socket becomes ready
+    int ready;
+    struct connection* ready_prev;
+    struct connection* ready_next;
+
+    // access log bookkeeping: when the current request's first bytes were
+    // read, and the status / body length of the last response queued
+    uint64_t request_start;
+    uint64_t last_fill;
+    int resp_status;
+    off_t resp_bytes;
+    peer_addr_t peer;
+    unsigned requests;
+
+    // HTTPS connections only: the OpenSSL session, whether the handshake is
+    // done, and whether the kernel encrypts writes (kTLS) so plain
+    // sendmsg / sendfile still work
+    SSL* tls;
+    int tls_ready;
+    int ktls_send;
+
+    // io_uring backend: submissions still pointing at this connection (it
+    // can't be pooled again before they complete), the sends among them,
+    // and the state of its multishot receive
+    int ring_ops;
+    int send_ops;
+    int recv_armed;
+    int recv_cancelled;
+    int send_poll;
+    int peer_eof;
+    int closing;
+
+    // provided buffers received while `buffer` had no room, oldest first
+    struct {
+        unsigned short bid;
+        unsigned short off;
+        unsigned short len;
+    } parked[URING_PARKED_MAX];
+    int parked_head;
+    int parked_cnt;
+
+    // pipe file regions (io_uring) and proxied bodies are spliced
+    // through, and bytes still sitting in it
+    int pipe_fds[2];
+    size_t pipe_pending;
+
+    // reverse proxy exchange the current response comes from, NULL when
+    // served locally; requests behind it wait until it is complete
+    upstream_t* proxy;
+
+    // the sendmsg in flight covers segments [seg_idx, send_seg_end)
+    struct msghdr send_msg;
+    struct iovec send_iov[CONN_SEG_MAX];
+    int send_seg_end;
+
+    // responses queued in request order; memory segments are gathered into
+    // one writev, file segments go out with sendfile
+    out_seg_t segs[CONN_SEG_MAX];
+
+    // receive buffer from the worker's pool, NULL while idle; unparsed bytes
+    // are [buffer_start, buffer_len), consumed requests just advance
+    // buffer_start. scan_pos (relative to buffer_start) is where the search
+    // for the end of the request head resumes
+    char* buffer;
+    size_t buffer_cap;
+    recv_tier_t buffer_tier;
+
+    // body bytes of an answered request still to be read and dropped
+    size_t discard;
+
+    // per-connection bump arena for formatted headers and error pages,
+    // reset once all queued output has been written
+    char arena[ARENA_SIZE];
+} __attribute__((aligned(CACHE_LINE_SIZE))) connection_t;
+
+// counter written by a single worker with plain relaxed loads and stores,
+// read (summed) by whoever serves the metrics endpoint
+typedef _Atomic uint64_t metric_t;
+
+/// @brief HDR-style log-linear histogram of nanosecond durations
+typedef struct {
+    metric_t buckets[HIST_BUCKETS];
+    metric_t count;
+    metric_t sum;
+} histogram_t;
+
+// status codes counted individually, anything else is "other"
+#define METRIC_STATUS_CODES 14
+static const int gMetricStatusCodes[METRIC_STATUS_CODES] = {
+    200, 206, 304, 400, 403, 404, 405, 413, 416, 431, 500, 502, 505, 0
+};
+
+/// @brief everything one worker counts; it owns the cache lines, so
+/// recording never contends with another core
+typedef struct {
+    metric_t connections_accepted;
+    metric_t connections_closed;
+    metric_t requests;
+    metric_t requests_reused;
+    metric_t requests_by_status[METRIC_STATUS_CODES];
+    metric_t bytes_sendfile;
+    metric_t bytes_buffered;
+    metric_t bytes_spliced;
+    metric_t file_cache_hits;
+    metric_t file_cache_misses;
+    metric_t fd_cache_hits;
+    metric_t fd_cache_misses;
+    metric_t upstream_requests;
+    metric_t upstream_requests_reused;
+    metric_t upstream_failures;
+
+    histogram_t parse_ns;
+    histogram_t ttfb_ns;
+    histogram_t total_ns;
+} __attribute__((aligned(CACHE_LINE_SIZE))) worker_metrics_t;
+
+/// @brief one io_uring instance, driven through raw system calls
+typedef struct {
+    int fd;
+    unsigned features;
+
+    // created disabled so the worker thread, its only submitter, can enable it
+    int disabled;
+
+    // descriptor or registered ring index handed to io_uring_enter
+    int enter_fd;
+    unsigned enter_flags;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    struct io_uring_sqe* sqes;
+
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* sq_map;
+    size_t sq_map_len;
+    void* cq_map;
+    size_t cq_map_len;
+    size_t sqes_len;
+
+    // receive buffers the kernel picks from, returned through buf_ring
+    struct io_uring_buf_ring* buf_ring;
+    char* bufs;
+    unsigned short buf_tail;
+} uring_t;
+
+/// @brief one event loop, driven by its own epoll instance or io_uring
+struct worker {
+    int id;
+    pthread_t thread;
+    int epoll_fd;
+    uring_t ring;
+    int accept_armed;
+
+    // listening sockets this loop accepts from, either shared by all
+    // workers or private to this one (SO_REUSEPORT); tls_listen_fd is -1
+    // without an HTTPS port
+    int listen_fd;
+    int tls_listen_fd;
+    int owns_listener;
+
+    // CPU the loop is pinned to (-A), -1 when it floats; with busy polling
+    // the loop doesn't sleep before spin_until (monotonic ns)
+    int cpu;
+    uint64_t spin_until;
+
+    // set once the process started draining and stopped accepting
+    int draining;
+
+    // reverse proxy: idle upstream connections per backend (gBackends
+    // index), unused upstream objects, and the round robin tie-break
+    upstream_t* up_idle[PROXY_MAX_BACKENDS];
+    unsigned up_idle_cnt[PROXY_MAX_BACKENDS];
+    upstream_t* up_free;
+    unsigned up_turn;
+
+    // free receive buffers per recv_tier_t, linked through their first bytes
+    void* recv_free[RECV_TIERS];
+    size_t recv_free_cnt[RECV_TIERS];
+
+    // connections that yielded with output left, or whose upstream
+    // reported readiness, resumed in FIFO order after the next batch of events
+    connection_t* ready_head;
+    connection_t* ready_tail;
+    size_t num_ready;
+
+    // every live connection sits in exactly one bucket
+    connection_t* wheel[TIMER_SLOTS];
+    uint64_t wheel_tick;
+    uint64_t now_tick;
+    int accept_paused;
+    size_t num_conns;
+
+    // preallocated connection objects: slots below pool_next have been
+    // handed out before and are recycled through free_conns, slots above
+    // it have never been touched
+    connection_t* pool;
+    size_t pool_size;
+    size_t pool_next;
+    connection_t* free_conns;
+
+    // closed since the loop last waited, an event of theirs may still be
+    // further down the batch; they join free_conns before the next wait
+    connection_t* closed_conns;
+
+    // access log records handed to the drain thread, NULL when disabled
+    log_ring_t* log_ring;
+
+    // last gDocIndexEpoch this loop saw between events, UINT64_MAX once it
+    // stopped; an index replaced before that epoch is no longer read here
+    _Atomic uint64_t index_epoch;
+
+    worker_metrics_t metrics;
+};
+
+/// @brief a backend HTTP server shared by all workers, so its load and
+/// health are atomics
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    char name[PROXY_NAME_MAX];   // "host:port" as configured, the Host of requests that had none
+    atomic_int outstanding;      // requests in flight on it, across workers
+    atomic_int fails;            // failures since its last response
+    _Atomic uint64_t down_until; // monotonic ns it is skipped until, 0 while healthy
+} backend_t;
+
+/// @brief requests under prefix go to gBackends [first_backend, first_backend + num_backends)
+typedef struct {
+    char prefix[PROXY_PREFIX_MAX];
+    size_t prefix_len;
+    int first_backend;
+    int num_backends;
+} proxy_route_t;
+
+static backend_t gBackends[PROXY_MAX_BACKENDS];
+static int gNumBackends = 0;
+static proxy_route_t gRoutes[PROXY_MAX_ROUTES];
+static int gNumRoutes = 0;
+
+/**
+ * LOGGING
+ */
+static log_level_t gLogLevel = LOG_LEVEL_INFO;
+
+// diagnostics above gLogLevel are skipped at runtime; debug messages are
+// not compiled into release (NDEBUG) builds at all
+#define LOG_AT(level, ...) do { if ((level) <= gLogLevel) printf(__VA_ARGS__); } while (0)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#ifdef NDEBUG
+#define LOG_DEBUG(...) ((void) 0)
+#else
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#endif
+
+/**
+ * METRICS
+ */
+
+// counters of the worker running on this thread; threads that aren't
+// workers record into a sink nobody reads
+static worker_metrics_t gSinkMetrics;
+static _Thread_local worker_metrics_t* tMetrics = &gSinkMetrics;
+
+// every worker's counters, summed when the endpoint is scraped
+static worker_metrics_t* gMetrics[MAX_WORKERS];
+static int gNumMetrics = 0;
+
+// request path the metrics are served on, NULL disables the endpoint
+static const char* gMetricsPath = NULL;
+
+/// @brief add to a counter only the calling worker writes, no locked instruction
+static inline void metric_add(metric_t* counter, uint64_t value) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+#define METRIC_ADD(field, value) metric_add(&tMetrics->field, (value))
+
+static inline size_t hist_index(uint64_t value) {
+    if (value < HIST_SUB_BUCKETS) return value;
+    unsigned octave = 63 - __builtin_clzll(value);
+    if (octave >= HIST_OCTAVES) return HIST_BUCKETS - 1;
+    return (size_t) (octave - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS +
+        ((value >> (octave - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+}
+
+static inline void hist_record(histogram_t* hist, uint64_t value) {
+    metric_add(&hist->buckets[hist_index(value)], 1);
+    metric_add(&hist->count, 1);
+    metric_add(&hist->sum, value);
+}
+
+/// @brief index into requests_by_status, the last slot is "other"
+size_t metric_status_index(int code) {
+    for (size_t i = 0; i < METRIC_STATUS_CODES - 1; i++) {
+        if (gMetricStatusCodes[i] == code) return i;
+    }
+    return METRIC_STATUS_CODES - 1;
+}
 
 /**
  * SIGNAL HANDLERS
  */
 static volatile sig_atomic_t gShouldStop = 0;
+static volatile sig_atomic_t gShouldReload = 0;
+static volatile sig_atomic_t gShouldDrain = 0;
+
+// monotonic ns after which a draining process gives up on the connections
+// it still has, 0 while it isn't draining
+static _Atomic uint64_t gDrainDeadline = 0;
 
 void cleanup_handler(int status) {
     // communicate that the server should stop now
     gShouldStop = 1;
 }
 
+void drain_handler(int status) {
+    // the main thread starts draining, workers finish what they have
+    gShouldDrain = 1;
+}
+
+void reload_handler(int status) {
+    // the main thread rebuilds the document root index
+    gShouldReload = 1;
+}
+
 /// @brief try to convert string to long integer
 /// @param str string representing integer
 /// @param result output pointer to write result to
@@ -102,456 +762,5665 @@ int try_conv_long(const char* str, long* result) {
     return APP_OK;
 }
 
-const char* find_substr(const char* str, size_t str_len, const char* substr, size_t substr_len) {
-    if (substr_len == 0 || str_len < substr_len) return NULL;
-    for (size_t i = 0; i <= str_len - substr_len; i++) {
-        if (memcmp(str + i, substr, substr_len) == 0) {
-            return (char*)(str + i);
-        }
-    }
-    return NULL;
+/// @brief put a descriptor into non-blocking mode
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return APP_ERR;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0 ? APP_ERR : APP_OK;
 }
 
-void send_error(int client_fd, int code, const char* version, const connection_t* conn) {
-    const char* name;
-    switch (code) {
-        case 400: name = "Bad Request"; break;
-        case 403: name = "Forbidden"; break;
-        case 404: name = "Not Found"; break;
-        case 405: name = "Method Not Allowed"; break;
-        case 505: name = "HTTP Version Not Supported"; break;
-        default: name = "Internal Server Error"; break;
-    }
-
-    char body[1024];
-    int content_length = snprintf(body, sizeof(body),
-        "<html><head><title>%d %s</title></head>"
-        "<body><h1>%d %s</h1></body></html>",
-        code, name, code, name
-    );
-
-    dprintf(client_fd, 
-        "%s %d %s\r\n"
-        "Content-Length: %d\r\n"
-        "Content-Type: text/html\r\n"
-        "Connection: %s\r\n"
-        "\r\n"
-        "%s", 
-        version, 
-        code, 
-        name, 
-        content_length, 
-        conn->keep_alive ? "keep-alive" : "close",
-        body);
+/// @brief append an in-memory segment to the pending output
+/// @param entry cache entry backing the memory, released once written (may be NULL)
+/// @return APP_ERR if the segment queue is full
+result_t conn_queue(connection_t* conn, const void* data, size_t len, cache_entry_t* entry) {
+    if (conn->seg_cnt >= CONN_SEG_MAX) return APP_ERR;
+    out_seg_t* seg = &conn->segs[conn->seg_cnt++];
+    seg->iov.iov_base = (void*) data;
+    seg->iov.iov_len = len;
+    seg->file = NULL;
+    seg->entry = entry;
+    seg->ttfb_start = seg->done_start = 0;
+    return APP_OK;
 }
 
-const char* get_mime_type(const char* path) {
-    const char* ext = strrchr(path, '.');
-    if (!ext) return NULL;
-
-    if (strcasecmp(ext, ".html") == 0 || strcasecmp(ext, ".htm") == 0) return "text/html";
-    if (strcasecmp(ext, ".css") == 0) return "text/css";
-    if (strcasecmp(ext, ".js") == 0) return "application/javascript";
-    if (strcasecmp(ext, ".png") == 0) return "image/png";
-    if (strcasecmp(ext, ".jpg") == 0 || strcasecmp(ext, ".jpeg") == 0) return "image/jpeg";
-    if (strcasecmp(ext, ".gif") == 0) return "image/gif";
-    if (strcasecmp(ext, ".txt") == 0) return "text/plain";
-    if (strcasecmp(ext, ".ico") == 0) return "image/x-icon";
+/// @brief append a file region to the pending output, the segment takes
+/// over the reference to the file
+/// @return APP_ERR if the segment queue is full
+result_t conn_queue_file(connection_t* conn, fd_entry_t* file, off_t offset, off_t end) {
+    if (conn->seg_cnt >= CONN_SEG_MAX) return APP_ERR;
+    out_seg_t* seg = &conn->segs[conn->seg_cnt++];
+    seg->iov.iov_base = NULL;
+    seg->iov.iov_len = 0;
+    seg->file = file;
+    seg->file_off = offset;
+    seg->file_end = end;
+    seg->entry = NULL;
+    seg->ttfb_start = seg->done_start = 0;
+    return APP_OK;
+}
 
-    return NULL;
+/// @brief whether another request's response is guaranteed to fit
+int conn_has_room(const connection_t* conn) {
+    return CONN_SEG_MAX - conn->seg_cnt >= SEG_RESERVE &&
+        sizeof(conn->arena) - conn->arena_used >= ARENA_RESERVE;
 }
 
-result_t serve_file(int client_fd, const char* full_path, const http_request_t* request, const connection_t* conn) {
-    struct stat st;
-    if (stat(full_path, &st) != 0 || !S_ISREG(st.st_mode)) {
-        printf("entry at '%s' doesn't exist\n", full_path);
-        return APP_ERR;
-    }
-    
-    const char* mime_type = get_mime_type(full_path);
-    if (!mime_type) {
-        // not a supported MIME type
-        printf("MIME-type of '%s' is not supported\n", full_path);
-        send_error(client_fd, 400, request->version, conn);
-        return APP_ERR;
-    }
+/**
+ * RESPONSE BUILDER
+ */
 
-    // if regular file, create response
-    int fd = open(full_path, O_RDONLY);
-    if (fd < 0) {
-        printf("could not open file '%s'\n", full_path);
-        const int err_code = errno == EACCES ? 403 : 400;
-        send_error(client_fd, err_code, request->version, conn);
-        return APP_ERR;
-    }
+/// @brief bounded append-only string builder, formats without stdio
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+    int overflow;
+} strbuf_t;
 
-    // send headers
-    ssize_t ret = dprintf(
-        client_fd,
-        // strings will append across lines
-        "%s 200 OK\r\n"
-        "Content-Length: %jd\r\n"
-        "Content-Type: %s\r\n"
-        "Connection: %s\r\n"
-        "\r\n",
-        request->version,
-        (intmax_t) st.st_size,
-        mime_type,
-        conn->keep_alive ? "keep-alive" : "close"
-    );
-
-    if (ret < 0) {
-        close(fd);
-        return APP_ERR;
-    }
+void sb_init(strbuf_t* sb, char* data, size_t cap) {
+    sb->data = data;
+    sb->len = 0;
+    sb->cap = cap;
+    sb->overflow = 0;
+}
 
-    // send body
-    off_t send_offset = 0;
-    while (send_offset < st.st_size) {
-        ssize_t bytes_sent = sendfile(client_fd, fd, &send_offset, st.st_size - send_offset);
-        if (bytes_sent <= 0) {
-            if (errno == EINTR || errno == EAGAIN) continue;
-            break; // error probably occurred
-        }
+void sb_append(strbuf_t* sb, const char* str, size_t len) {
+    if (sb->overflow || len > sb->cap - sb->len) {
+        sb->overflow = 1;
+        return;
     }
+    memcpy(sb->data + sb->len, str, len);
+    sb->len += len;
+}
 
-    close(fd);
-    return APP_OK;
+void sb_puts(strbuf_t* sb, const char* str) {
+    sb_append(sb, str, strlen(str));
 }
 
-void find_header_value(
-    const char* buffer, 
-    const char* header_end, 
-    const char* header_name,
-    char* dest,
-    size_t dest_len
-) {
-    const char* header = find_substr(buffer, header_end - buffer, header_name, strlen(header_name));
-    if (header && header < header_end) {
-        char* colon = strchr(header, ':');
-
-        if (colon && colon < header_end) {
-            char* field_start = colon;
-
-            do {
-                field_start++;
-            } while (isspace(*field_start) && field_start < header_end);
-            
-            if (field_start && field_start < header_end) {
-                const char* line_end = find_substr(field_start, header_end - field_start, "\r\n", strlen("\r\n"));
-                
-                if (line_end && line_end < header_end) {
-                    size_t field_len = line_end - field_start;
-                    if (field_len >= dest_len) field_len = dest_len - 1;
-
-                    if (field_len > 0) {
-                        memcpy(dest, field_start, field_len);
-                        dest[field_len] = '\0';
-                    }
-                }
-            }
-        }
-    }
+void sb_putu(strbuf_t* sb, uintmax_t value) {
+    char digits[24];
+    char* cursor = digits + sizeof(digits);
+    do {
+        *--cursor = '0' + (value % 10);
+        value /= 10;
+    } while (value > 0);
+    sb_append(sb, cursor, digits + sizeof(digits) - cursor);
 }
 
-void* client_func(void* arg) {
-    const int client_fd = *(int*) arg;
-    free(arg);
+/// @brief "<version> <code> <reason>\r\n"
+void sb_status_line(strbuf_t* sb, const char* version, size_t version_len, int code, const char* reason) {
+    sb_append(sb, version, version_len);
+    sb_append(sb, " ", 1);
+    sb_putu(sb, code);
+    sb_append(sb, " ", 1);
+    sb_puts(sb, reason);
+    sb_append(sb, "\r\n", 2);
+}
 
-    connection_t conn;
-    conn.keep_alive = 0;
-    conn.last_activity = time(NULL);
+void sb_header(strbuf_t* sb, const char* name, const char* value) {
+    sb_puts(sb, name);
+    sb_append(sb, ": ", 2);
+    sb_puts(sb, value);
+    sb_append(sb, "\r\n", 2);
+}
 
-    printf("initiating new connection with client (new thread)...\n");
+void sb_header_u(strbuf_t* sb, const char* name, uintmax_t value) {
+    sb_puts(sb, name);
+    sb_append(sb, ": ", 2);
+    sb_putu(sb, value);
+    sb_append(sb, "\r\n", 2);
+}
 
-    // create buffers for receiving HTTP requests
-    char buffer[BUFFER_SIZE];
-    size_t buffer_len = 0;
-    memset(buffer, 0, sizeof(buffer));
+void sb_puthex(strbuf_t* sb, uintmax_t value) {
+    static const char hex[16] = "0123456789abcdef";
+    char digits[24];
+    char* cursor = digits + sizeof(digits);
+    do {
+        *--cursor = hex[value & 0xf];
+        value >>= 4;
+    } while (value > 0);
+    sb_append(sb, cursor, digits + sizeof(digits) - cursor);
+}
 
-    while (!gShouldStop) {
-        // timeout
-        if (conn.keep_alive) {
-            fd_set fds;
-            FD_ZERO(&fds);
-            FD_SET(client_fd, &fds);
-
-            struct timeval tv;
-            time_t now = time(NULL);
-            int elapsed = now - conn.last_activity;
-            int remaining = 10 - elapsed;
-
-            if (remaining <= 0) {
-                // timeout
-                break;
-            }
+/// @brief "Content-Range: bytes <first>-<last>/<size>\r\n" for [start, end)
+void sb_content_range(strbuf_t* sb, off_t start, off_t end, off_t size) {
+    sb_puts(sb, "Content-Range: bytes ");
+    sb_putu(sb, start);
+    sb_append(sb, "-", 1);
+    sb_putu(sb, end - 1);
+    sb_append(sb, "/", 1);
+    sb_putu(sb, size);
+    sb_append(sb, "\r\n", 2);
+}
 
-            tv.tv_sec = remaining;
-            tv.tv_usec = 0;
+/// @brief start building into the unused tail of the connection's arena
+void conn_builder(connection_t* conn, strbuf_t* sb) {
+    sb_init(sb, conn->arena + conn->arena_used, sizeof(conn->arena) - conn->arena_used);
+}
 
-            int ret = select(client_fd + 1, &fds, NULL, NULL, &tv);
-            if (ret == 0) {
-                // timed out
-                break;
-            } else if (ret < 0) {
-                if (errno == EINTR) continue;
-                break;
-            }
+/// @brief queue what was built with conn_builder()
+/// @return APP_ERR if the builder overflowed or the segment queue is full
+result_t conn_commit(connection_t* conn, strbuf_t* sb) {
+    if (sb->overflow) return APP_ERR;
+    conn->arena_used += sb->len;
+    return conn_queue(conn, sb->data, sb->len, NULL);
+}
 
-            // receive new data after this
+const char* find_substr(const char* str, size_t str_len, const char* substr, size_t substr_len) {
+    if (substr_len == 0 || str_len < substr_len) return NULL;
+    for (size_t i = 0; i <= str_len - substr_len; i++) {
+        if (memcmp(str + i, substr, substr_len) == 0) {
+            return (char*)(str + i);
         }
+    }
+    return NULL;
+}
 
-        // -1 to accomodate null terminator
-        ssize_t bytes_recv = recv(client_fd, buffer + buffer_len, sizeof(buffer) - buffer_len - 1, 0);
-        if (bytes_recv < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                // non-blocking, no data available
-                continue;
-            }
-            // otherwise, an error must have occurred
-            break;
-        }
+/**
+ * HTTP PARSER
+ */
 
-        if (bytes_recv == 0) {
-            // connection closed
-            break;
-        }
-        
-        // null terminate the buffer for safety and parsing
-        buffer_len += bytes_recv;
-        buffer[buffer_len] = '\0';
-
-        // look for requests
-        while (buffer_len > 0) {
-            ssize_t eoh = -1;
-            for (size_t i = 0; i < buffer_len - 3; i++) {
-                if (buffer[i+0] == '\r' && buffer[i+1] == '\n' &&
-                    buffer[i+2] == '\r' && buffer[i+3] == '\n') {
-                    eoh = i + 4;
-                    break;
-                }
-            }
+/// @brief find the first '\r' in [p, end), 16/32 bytes at a time
+/// @return pointer to the '\r', or end if there is none
+static inline const char* find_cr(const char* p, const char* end) {
+#if defined(__AVX2__)
+    const __m256i cr32 = _mm256_set1_epi8('\r');
+    while (end - p >= 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*) p);
+        unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, cr32));
+        if (mask) return p + __builtin_ctz(mask);
+        p += 32;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i cr16 = _mm_set1_epi8('\r');
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*) p);
+        unsigned mask = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, cr16));
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    while (p < end && *p != '\r') p++;
+    return p;
+}
 
-            // no complete headers, need more bytes
-            if (eoh == -1) break;
-            char* header_end = buffer + eoh;
+/// @brief case-folding FNV-1a, the hash the tables in http_tables.h were
+/// laid out with
+static inline uint32_t fold_hash(const char* str, size_t len, uint32_t seed) {
+    uint32_t hash = seed;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) str[i] | 0x20;
+        hash *= 16777619u;
+    }
+    return hash ^ (hash >> 15);
+}
 
-            // extract Content-Length if possible
-            int content_length = 0;
-            const char* cl_header = find_substr(buffer, header_end - buffer, "Content-Length", strlen("Content-Length"));
-            if (cl_header && (cl_header - buffer) < eoh) {
-                char* colon = strchr(cl_header, ':');
+/// @brief intern a header field name, one hash and at most one compare
+static inline header_id_t http_header_id(const char* name, size_t len) {
+    header_id_t id = gHeaderSlots[fold_hash(name, len, HEADER_HASH_SEED) & (HEADER_HASH_SLOTS - 1)];
+    if (id == HDR_UNKNOWN || gHeaderNames[id].len != len || strncasecmp(gHeaderNames[id].name, name, len) != 0) {
+        return HDR_UNKNOWN;
+    }
+    return id;
+}
 
-                if (colon && colon < header_end) {
-                    long value;
-                    if (try_conv_long(colon + 1, &value) == APP_OK) {
-                        content_length = value;
+/// @brief parse a request head incrementally
+/// @param buffer received bytes
+/// @param len number of received bytes
+/// @param scan_pos where the previous call stopped looking for the blank
+/// line, updated so trickling headers are never rescanned (start at 0)
+/// @param parsed output, slices into buffer
+/// @return length of the head including the blank line, 0 if more bytes
+/// are needed, -1 if the head is malformed
+ssize_t http_parse_request(const char* buffer, size_t len, size_t* scan_pos, http_request_t* parsed) {
+    const char* end = buffer + len;
+    const char* p = buffer + *scan_pos;
 
-                        // clamp for safety
-                        if (content_length < 0) content_length = 0; 
-                        // if (content_length > sizeof(buffer) - eoh);
-                    }
-                }
-            }
+    // find "\r\n\r\n", only ever looking at each '\r' candidate once
+    for (;;) {
+        p = find_cr(p, end);
+        if (end - p < 4) {
+            // not decidable yet, resume from this '\r' (or the end)
+            *scan_pos = p - buffer;
+            return 0;
+        }
+        if (p[1] == '\n' && p[2] == '\r' && p[3] == '\n') break;
+        p++;
+    }
 
-            size_t total_size = eoh + content_length;
-            if (buffer_len < total_size) {
-                // wait for complete request
-                break;
-            }
+    // the terminator stays found if we are called again waiting for a body
+    *scan_pos = p - buffer;
+    const char* head_end = p + 4;
+    const char* lines_end = p + 2;
 
-            /**
-             * PARSING
-             */
-            http_request_t request;
-            size_t attrib_len;
-
-            memset(&request, 0, sizeof(request));
-            
-            // method
-            char* first_space = memchr(buffer, ' ', header_end - buffer);
-            if (!first_space) goto cleanup;
-            attrib_len = first_space - buffer;
-            if (attrib_len >= sizeof(request.method)) attrib_len = sizeof(request.method) - 1;
-            memcpy(request.method, buffer, attrib_len);
-            request.method[attrib_len] = '\0';
-
-            // path
-            char* second_space = memchr(first_space + 1, ' ', header_end - (first_space + 1));
-            if (!second_space) goto cleanup;;
-            attrib_len = second_space - (first_space + 1);
-            if (attrib_len >= sizeof(request.path)) attrib_len = sizeof(request.path) - 1;
-            memcpy(request.path, first_space + 1, attrib_len);
-            request.path[attrib_len] = '\0';
-            
-            // version
-            const char* crlf = find_substr(second_space + 1, header_end - (second_space + 1), "\r\n", strlen("\r\n"));
-            if (!crlf || crlf >= header_end) goto cleanup;
-            attrib_len = crlf - (second_space + 1);
-            if (attrib_len >= sizeof(request.version)) attrib_len = sizeof(request.version) - 1;
-            memcpy(request.version, second_space + 1, attrib_len);
-            request.version[attrib_len] = '\0';
-
-            // connection timeout handling
-            find_header_value(buffer, header_end, "Connection", request.connection, sizeof(request.connection));
-            if (strcasecmp(request.connection, "keep-alive") == 0) {
-                conn.keep_alive = 1;
-            } else {
-                conn.keep_alive = 0;
-            }
-            conn.last_activity = time(NULL);
-
-            /**
-             * HANDLE REQUEST
-             */
-            if (strcmp(request.method, "GET") != 0) {
-                // method other than GET was requested
-                printf("incompatible HTTP method: %s\n", request.method);
-                send_error(client_fd, 405, request.version, &conn);
-                goto cleanup;
-            } else if (strcmp(request.version, "HTTP/1.0") != 0 && 
-                        strcmp(request.version, "HTTP/1.1") != 0) {
-                printf("incompatible HTTP version: %s\n", request.version);
-                send_error(client_fd, 505, request.version, &conn);
-                goto cleanup;
-            } else {
-                // handle proper GET
-                char full_path[PATH_MAX_LEN];
+    // request line: METHOD SP TARGET SP VERSION CRLF
+    const char* line_end = find_cr(buffer, lines_end);
+    const char* first_space = memchr(buffer, ' ', line_end - buffer);
+    if (!first_space) return -1;
+    const char* second_space = memchr(first_space + 1, ' ', line_end - (first_space + 1));
+    if (!second_space) return -1;
 
-                // clean up paths to avoid overflow
-                if (strlen(request.path) >= PATH_MAX_LEN - strlen(DOCUMENT_ROOT) - 1) {
-                    send_error(client_fd, 400, request.version, &conn);
-                    goto cleanup;
-                }
+    parsed->method = buffer;
+    parsed->method_len = first_space - buffer;
+    parsed->path = first_space + 1;
+    parsed->path_len = second_space - (first_space + 1);
+    parsed->version = second_space + 1;
+    parsed->version_len = line_end - (second_space + 1);
 
-                if (find_substr(request.path, strlen(request.path), "..", strlen(".."))) {
-                    send_error(client_fd, 403, request.version, &conn);
-                    goto cleanup;
-                }
+    // header fields, one pass over the remaining lines
+    parsed->num_headers = 0;
+    memset(parsed->header_index, 0, sizeof(parsed->header_index));
+    const char* line = line_end + 2;
+    while (line < lines_end) {
+        line_end = find_cr(line, lines_end);
 
-                ssize_t bytes_written = snprintf(full_path, sizeof(full_path), "%s%s", DOCUMENT_ROOT, request.path);
-                if (bytes_written < 0 || bytes_written >= sizeof(full_path)) {
-                    send_error(client_fd, 400, request.version, &conn);
-                    goto cleanup;
-                }
+        const char* colon = memchr(line, ':', line_end - line);
+        if (colon && colon > line) {
+            if (parsed->num_headers == MAX_HEADERS) return -1;
 
-                // look for path
-                struct stat path_st;
-                if (stat(full_path, &path_st) != 0) {
-                    if (errno == ENOENT) {
-                        // doesn't exist
-                        printf("entry at '%s' doesn't exist\n", full_path);
-                        send_error(client_fd, 404, request.version, &conn);
-                    } else if (errno == EACCES) {
-                        // no permissions
-                        printf("insufficient permissions to access entry at '%s'\n", full_path);
-                        send_error(client_fd, 403, request.version, &conn);
-                    } else {
-                        // generic error
-                        printf("could not handle entry at '%s'\n", full_path);
-                        send_error(client_fd, 400, request.version, &conn);
-                    }
-
-                    goto cleanup;
-                }
+            const char* value = colon + 1;
+            const char* value_end = line_end;
+            while (value < value_end && (*value == ' ' || *value == '\t')) value++;
+            while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
 
-                if (S_ISDIR(path_st.st_mode)) {
-                    // directory, add a slash in case there is none
-                    if (full_path[strlen(full_path) - 1] != '/') {
-                        // strlcat(full_path, "/", sizeof(full_path));
-                        if (strlen(full_path) + 1 < sizeof(full_path)) {
-                            strcat(full_path, "/");
-                        }
-                    }
-
-                    // if the path is a directory, look for index.html
-                    char try_path[PATH_MAX_LEN];
-                    strncpy(try_path, full_path, sizeof(try_path));
-                    size_t remaining = sizeof(try_path) - strlen(try_path) - 1;
-                    if (remaining > strlen("index.html")) {
-                        strncat(try_path, "index.html", remaining);
-                    }
-
-                    printf("client asked for '%s' (directory), trying '%s'\n", full_path, try_path);
-
-                    if (!IS_OK_APP(serve_file(client_fd, try_path, &request, &conn))) {
-                        // try index.htm
-                        strncpy(try_path, full_path, sizeof(try_path));
-                        size_t remaining = sizeof(try_path) - strlen(try_path) - 1;
-                        if (remaining > strlen("index.htm")) {
-                            strncat(try_path, "index.htm", remaining);
-                        }
-
-                        printf("client asked for '%s' (directory), trying '%s'\n", full_path, try_path);
-
-                        if (!IS_OK_APP(serve_file(client_fd, try_path, &request, &conn))) {
-                            send_error(client_fd, 404, request.version, &conn);
-                            goto cleanup;
-                        }
-                    }
-                } else if (S_ISREG(path_st.st_mode)) {
-                    if (!IS_OK_APP(serve_file(client_fd, full_path, &request, &conn))) {
-                        goto cleanup;
-                    }
-                }
-            }
-            
-        cleanup:
-            // remove complete request from buffer
-            size_t remaining = buffer_len - total_size;
-            if (remaining > 0) {
-                memmove(buffer, buffer + total_size, remaining);
+            http_header_t* header = &parsed->headers[parsed->num_headers++];
+            header->name = line;
+            header->name_len = colon - line;
+            header->value = value;
+            header->value_len = value_end - value;
+            header->id = http_header_id(header->name, header->name_len);
+            if (header->id != HDR_UNKNOWN && !parsed->header_index[header->id]) {
+                parsed->header_index[header->id] = (unsigned char) parsed->num_headers;
             }
-            buffer_len = remaining;
-            buffer[buffer_len] = '\0';
         }
 
-        // discard if request is too large
-        if (buffer_len > sizeof(buffer) - 1) {
-            buffer_len = 0;
-        }
+        // lines without a colon (obsolete folding, junk) are ignored
+        line = line_end + 2;
+    }
 
-        if (!conn.keep_alive) {
-            printf("no keep-alive, closing connection...\n");
+    return head_end - buffer;
+}
 
-            // close connection
-            break;
-        }
-    }
-    
-    printf("closing client connection...\n");
-    close(client_fd);
-    return NULL;
+/// @brief first field of a known name, interned while parsing
+/// @return the field, or NULL if the request doesn't carry it
+static inline const http_header_t* http_get_header(const http_request_t* parsed, header_id_t id) {
+    unsigned char index = parsed->header_index[id];
+    return index ? &parsed->headers[index - 1] : NULL;
 }
 
-/// @brief program entrypoint 
-int main(int argc, char* argv[]) {
-    signal(SIGINT, cleanup_handler);
+/// @return value of a hex digit, -1 for anything else
+static inline int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') return (c | 0x20) - 'a' + 10;
+    return -1;
+}
 
-    // port number should be provided in CLI arguments 
-    if (argc < 2) {
-        printf("usage: ./server <port>\n");
-        return APP_ERR;
+/// @brief close the segment at dst[seg, out): "." is dropped, ".." drops
+/// itself and its parent (never the root), anything else is kept and
+/// followed by a slash if one was seen; empty segments ("//") vanish
+/// @return new output length, or 0 if the slash doesn't fit
+static size_t path_end_segment(char* dst, size_t out, size_t seg, size_t cap, int slash) {
+    size_t seg_len = out - seg;
+    if (seg_len == 0) return out;
+    if (seg_len == 1 && dst[seg] == '.') return seg;
+    if (seg_len == 2 && dst[seg] == '.' && dst[seg + 1] == '.') {
+        if (seg == 1) return 1;
+        size_t parent = seg - 1;
+        while (dst[parent - 1] != '/') parent--;
+        return parent;
     }
 
-    // get port number
-    long port;
-    if (!IS_OK_APP(try_conv_long(argv[1], &port)) || port < 0) {
-        printf("invalid port number provided: '%s'\n", argv[1]);
-        return APP_ERR;
+    if (!slash) return out;
+    if (out + 1 >= cap) return 0;
+    dst[out++] = '/';
+    return out;
+}
+
+/// @brief turn a request target into its canonical URL path in one pass:
+/// drop the query and fragment, percent-decode, collapse "//" and "/./"
+/// and resolve "/../" without climbing above the root. Dot segments are
+/// resolved after decoding, so "%2e%2e%2f" can't escape either. Equivalent
+/// targets give the same bytes, which is what the caches are keyed by.
+/// @param dst may be target itself, the output is never longer than the input
+/// @param cap size of dst, leaving room for a terminating NUL
+/// @return length of the path written to dst (not NUL-terminated), -1 if
+/// the target isn't a path, is badly encoded, decodes to a NUL or doesn't fit
+ssize_t http_normalize_path(const char* target, size_t len, char* dst, size_t cap) {
+    const char* p = target;
+    const char* end = target + len;
+
+    // absolute-form, as sent to proxies: skip scheme and authority
+    size_t scheme_len = len >= 7 && strncasecmp(p, "http://", 7) == 0 ? 7 :
+        len >= 8 && strncasecmp(p, "https://", 8) == 0 ? 8 : 0;
+    if (scheme_len) {
+        p = memchr(p + scheme_len, '/', len - scheme_len);
+        if (!p) p = end;
+    } else if (p == end || *p != '/') {
+        return -1;
     }
+    if (cap < 2) return -1;
 
-    printf("starting server on port %ld\n", port);
-    
-    // use host IP
+    // the leading slash is already written
+    if (p < end) p++;
+    dst[0] = '/';
+    size_t out = 1;
+    size_t seg = 1;
+    for (; p < end; p++) {
+        char c = *p;
+        if (c == '?' || c == '#') break;
+
+        if (c == '%') {
+            int hi, lo;
+            if (end - p < 3 || (hi = hex_digit(p[1])) < 0 || (lo = hex_digit(p[2])) < 0) return -1;
+            c = (char) (hi << 4 | lo);
+            if (c == '\0') return -1;
+            p += 2;
+        }
+
+        if (c == '/') {
+            out = path_end_segment(dst, out, seg, cap, 1);
+            if (!out) return -1;
+            seg = out;
+        } else {
+            if (out + 1 >= cap) return -1;
+            dst[out++] = c;
+        }
+    }
+
+    return path_end_segment(dst, out, seg, cap, 0);
+}
+
+/// @brief parse a Content-Length value, digits only
+/// @return APP_ERR on junk or overflow
+result_t parse_content_length(const char* str, size_t len, long* result) {
+    if (len == 0) return APP_ERR;
+
+    long value = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (str[i] < '0' || str[i] > '9') return APP_ERR;
+        if (value > (LONG_MAX - (str[i] - '0')) / 10) return APP_ERR;
+        value = value * 10 + (str[i] - '0');
+    }
+
+    *result = value;
+    return APP_OK;
+}
+
+/// @brief compare a slice against a literal
+int slice_equals(const char* str, size_t len, const char* literal) {
+    return len == strlen(literal) && memcmp(str, literal, len) == 0;
+}
+
+/// @brief queue an error page
+/// @param request echoes its HTTP version, NULL if the head couldn't be parsed
+void send_error(connection_t* conn, int code, const http_request_t* request) {
+    const char* name;
+    switch (code) {
+        case 400: name = "Bad Request"; break;
+        case 403: name = "Forbidden"; break;
+        case 404: name = "Not Found"; break;
+        case 405: name = "Method Not Allowed"; break;
+        case 413: name = "Content Too Large"; break;
+        case 431: name = "Request Header Fields Too Large"; break;
+        case 502: name = "Bad Gateway"; break;
+        case 505: name = "HTTP Version Not Supported"; break;
+        default: name = "Internal Server Error"; break;
+    }
+
+    char body_data[256];
+    strbuf_t body;
+    sb_init(&body, body_data, sizeof(body_data));
+    sb_puts(&body, "<html><head><title>");
+    sb_putu(&body, code);
+    sb_append(&body, " ", 1);
+    sb_puts(&body, name);
+    sb_puts(&body, "</title></head><body><h1>");
+    sb_putu(&body, code);
+    sb_append(&body, " ", 1);
+    sb_puts(&body, name);
+    sb_puts(&body, "</h1></body></html>");
+
+    // headers and body go into one segment, flushed by the event loop
+    strbuf_t sb;
+    conn_builder(conn, &sb);
+    if (request) {
+        sb_status_line(&sb, request->version, request->version_len, code, name);
+    } else {
+        sb_status_line(&sb, "HTTP/1.1", strlen("HTTP/1.1"), code, name);
+    }
+    sb_header_u(&sb, "Content-Length", body.len);
+    sb_header(&sb, "Content-Type", "text/html");
+    sb_header(&sb, "Connection", conn->keep_alive ? "keep-alive" : "close");
+    sb_append(&sb, "\r\n", 2);
+    sb_append(&sb, body.data, body.overflow ? 0 : body.len);
+
+    if (body.overflow || !IS_OK_APP(conn_commit(conn, &sb))) {
+        // response does not fit, nothing sensible can be sent
+        conn->close_after_write = 1;
+    }
+    conn->resp_status = code;
+    conn->resp_bytes = body.overflow ? 0 : body.len;
+}
+
+/// @brief extension -> media type loaded from a mime.types file (-T),
+/// consulted before the built-in table; open addressing, at most half full
+typedef struct {
+    char ext[MIME_EXT_MAX];
+    size_t ext_len;
+    const char* type;
+} mime_slot_t;
+
+static mime_slot_t* gMimeLoaded = NULL;
+static size_t gMimeLoadedMask = 0;
+
+/// @brief insert or replace an extension in the loaded table
+void mime_loaded_put(const char* ext, size_t ext_len, const char* type) {
+    size_t slot = fold_hash(ext, ext_len, MIME_HASH_SEED) & gMimeLoadedMask;
+    while (gMimeLoaded[slot].type &&
+           (gMimeLoaded[slot].ext_len != ext_len || strncasecmp(gMimeLoaded[slot].ext, ext, ext_len) != 0)) {
+        slot = (slot + 1) & gMimeLoadedMask;
+    }
+    memcpy(gMimeLoaded[slot].ext, ext, ext_len);
+    gMimeLoaded[slot].ext_len = ext_len;
+    gMimeLoaded[slot].type = type;
+}
+
+/// @brief load "type ext ext ..." lines, the format of /etc/mime.types;
+/// listed extensions take precedence over the built-in table
+/// @return APP_ERR if the file can't be read
+result_t mime_types_load(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) return APP_ERR;
+
+    // count extensions first, so the table is sized once and never rehashed
+    size_t num_exts = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), file)) {
+        if (line[0] == '#') continue;
+        char* save;
+        for (char* token = strtok_r(line, " \t\r\n", &save); token; token = strtok_r(NULL, " \t\r\n", &save)) {
+            num_exts++;
+        }
+    }
+
+    size_t num_slots = 16;
+    while (num_slots < num_exts * 2) num_slots *= 2;
+    gMimeLoaded = calloc(num_slots, sizeof(mime_slot_t));
+    if (!gMimeLoaded) {
+        fclose(file);
+        return APP_ERR;
+    }
+    gMimeLoadedMask = num_slots - 1;
+
+    // types live as long as the process, entries point at them
+    size_t loaded = 0;
+    rewind(file);
+    while (fgets(line, sizeof(line), file)) {
+        if (line[0] == '#') continue;
+        char* save;
+        char* type = strtok_r(line, " \t\r\n", &save);
+        if (!type) continue;
+
+        char* ext = strtok_r(NULL, " \t\r\n", &save);
+        if (!ext || !(type = strdup(type))) continue;
+        for (; ext; ext = strtok_r(NULL, " \t\r\n", &save)) {
+            size_t ext_len = strlen(ext);
+            if (ext_len >= MIME_EXT_MAX) continue;
+            mime_loaded_put(ext, ext_len, type);
+            loaded++;
+        }
+    }
+
+    fclose(file);
+    LOG_INFO("loaded %zu extensions from '%s'\n", loaded, path);
+    return APP_OK;
+}
+
+/// @brief media type by extension, case-insensitive, one hash per table
+/// @return NULL for types the server doesn't serve
+const char* get_mime_type(const char* path) {
+    const char* ext = strrchr(path, '.');
+    if (!ext || strchr(ext, '/')) return NULL;
+    ext++;
+    size_t ext_len = strlen(ext);
+
+    if (gMimeLoaded) {
+        size_t slot = fold_hash(ext, ext_len, MIME_HASH_SEED) & gMimeLoadedMask;
+        for (; gMimeLoaded[slot].type; slot = (slot + 1) & gMimeLoadedMask) {
+            if (gMimeLoaded[slot].ext_len == ext_len && strncasecmp(gMimeLoaded[slot].ext, ext, ext_len) == 0) {
+                return gMimeLoaded[slot].type;
+            }
+        }
+    }
+
+    size_t slot = fold_hash(ext, ext_len, MIME_HASH_SEED) & (MIME_HASH_SLOTS - 1);
+    if (gMimeSlots[slot].ext && gMimeSlots[slot].ext_len == ext_len &&
+        strncasecmp(gMimeSlots[slot].ext, ext, ext_len) == 0) {
+        return gMimeSlots[slot].type;
+    }
+    return NULL;
+}
+
+/**
+ * CONTENT ENCODING
+ */
+
+// Accept-Encoding token and precompressed sibling suffix, by content_encoding_t
+static const struct {
+    const char* token;
+    const char* suffix;
+} gEncodings[ENC_KINDS] = {
+    { "identity", "" },
+    { "gzip", ".gz" },
+    { "br", ".br" },
+};
+
+/// @brief whether a body of this type shrinks enough to be worth encoding
+/// (already compressed images, fonts, audio and video are left alone)
+int mime_is_compressible(const char* mime_type) {
+    if (!mime_type) return 0;
+    size_t len = strlen(mime_type);
+    return strncmp(mime_type, "text/", strlen("text/")) == 0 ||
+        strcmp(mime_type, "application/javascript") == 0 ||
+        strcmp(mime_type, "application/json") == 0 ||
+        strcmp(mime_type, "application/xml") == 0 ||
+        strcmp(mime_type, "application/wasm") == 0 ||
+        strcmp(mime_type, "image/x-icon") == 0 ||
+        strcmp(mime_type, "image/bmp") == 0 ||
+        strcmp(mime_type, "font/ttf") == 0 ||
+        strcmp(mime_type, "font/otf") == 0 ||
+        (len > 5 && strcmp(mime_type + len - 5, "+json") == 0) ||
+        (len > 4 && strcmp(mime_type + len - 4, "+xml") == 0);
+}
+
+/// @brief collect the encodings a request accepts
+/// @return bitmask of (1 << content_encoding_t), identity is implied
+int http_accept_encodings(const http_request_t* request) {
+    const http_header_t* header = http_get_header(request, HDR_ACCEPT_ENCODING);
+    if (!header) return 0;
+
+    int accepted = 0;
+    const char* p = header->value;
+    const char* end = header->value + header->value_len;
+    while (p < end) {
+        // one element: token *( ";" param ), elements separated by commas
+        const char* elem_end = memchr(p, ',', end - p);
+        if (!elem_end) elem_end = end;
+
+        while (p < elem_end && (*p == ' ' || *p == '\t')) p++;
+        const char* token = p;
+        while (p < elem_end && *p != ';' && *p != ' ' && *p != '\t') p++;
+        size_t token_len = p - token;
+
+        // "q=0" (with any number of zero decimals) means not acceptable
+        int refused = 0;
+        const char* q = find_substr(p, elem_end - p, "q=", strlen("q="));
+        if (q) {
+            q += strlen("q=");
+            refused = q < elem_end && *q == '0';
+            for (q++; refused && q < elem_end && *q != ' ' && *q != ';'; q++) {
+                if (*q != '.' && *q != '0') refused = 0;
+            }
+        }
+
+        if (!refused) {
+            for (int enc = ENC_GZIP; enc < ENC_KINDS; enc++) {
+                if ((token_len == 1 && *token == '*') ||
+                    (token_len == strlen(gEncodings[enc].token) &&
+                     strncasecmp(token, gEncodings[enc].token, token_len) == 0)) {
+                    accepted |= 1 << enc;
+                }
+            }
+        }
+
+        p = elem_end + 1;
+    }
+    return accepted;
+}
+
+/// @brief compress a buffer in one shot
+/// @param out_len set to the compressed length
+/// @return malloc'd compressed bytes, NULL on failure
+char* compress_buffer(const char* data, size_t len, content_encoding_t encoding, size_t* out_len) {
+    if (encoding == ENC_GZIP) {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        // window bits + 16 selects the gzip wrapper
+        if (deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return NULL;
+
+        size_t cap = deflateBound(&zs, len);
+        char* out = malloc(cap);
+        if (!out) {
+            deflateEnd(&zs);
+            return NULL;
+        }
+
+        zs.next_in = (Bytef*) data;
+        zs.avail_in = len;
+        zs.next_out = (Bytef*) out;
+        zs.avail_out = cap;
+        int status = deflate(&zs, Z_FINISH);
+        *out_len = zs.total_out;
+        deflateEnd(&zs);
+
+        if (status != Z_STREAM_END) {
+            free(out);
+            return NULL;
+        }
+        return out;
+    }
+
+    if (encoding == ENC_BR) {
+        size_t cap = BrotliEncoderMaxCompressedSize(len);
+        if (cap == 0) return NULL;
+        char* out = malloc(cap);
+        if (!out) return NULL;
+
+        *out_len = cap;
+        if (!BrotliEncoderCompress(BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_DEFAULT_MODE,
+                                   len, (const uint8_t*) data, out_len, (uint8_t*) out)) {
+            free(out);
+            return NULL;
+        }
+        return out;
+    }
+
+    return NULL;
+}
+
+/**
+ * CONDITIONAL REQUESTS
+ */
+
+/// @brief cache validators of one representation of a file
+typedef struct {
+    // quoted strong entity tag, from inode, size, mtime and encoding
+    char etag[96];
+    size_t etag_len;
+    char last_modified[32];
+    time_t mtime;
+} validators_t;
+
+// half-open byte range [start, end) of a body
+typedef struct {
+    off_t start;
+    off_t end;
+} byte_range_t;
+
+void make_validators(const struct stat* st, content_encoding_t encoding, validators_t* validators) {
+    strbuf_t sb;
+    sb_init(&sb, validators->etag, sizeof(validators->etag) - 1);
+    sb_append(&sb, "\"", 1);
+    sb_puthex(&sb, st->st_ino);
+    sb_append(&sb, "-", 1);
+    sb_puthex(&sb, st->st_size);
+    sb_append(&sb, "-", 1);
+    sb_puthex(&sb, st->st_mtim.tv_sec);
+    sb_append(&sb, ".", 1);
+    sb_puthex(&sb, st->st_mtim.tv_nsec);
+    if (encoding != ENC_IDENTITY) {
+        sb_append(&sb, "-", 1);
+        sb_puts(&sb, gEncodings[encoding].token);
+    }
+    sb_append(&sb, "\"", 1);
+    validators->etag[sb.len] = '\0';
+    validators->etag_len = sb.len;
+
+    struct tm tm;
+    validators->mtime = st->st_mtim.tv_sec;
+    gmtime_r(&validators->mtime, &tm);
+    strftime(validators->last_modified, sizeof(validators->last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/// @brief parse an IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT")
+result_t parse_http_date(const char* str, size_t len, time_t* result) {
+    char date[64];
+    if (len >= sizeof(date)) return APP_ERR;
+    memcpy(date, str, len);
+    date[len] = '\0';
+
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char* end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end || *end != '\0') return APP_ERR;
+
+    *result = timegm(&tm);
+    return APP_OK;
+}
+
+/// @brief whether a comma-separated entity tag list names a representation
+/// @param weak weak comparison (W/ prefixes ignored, If-None-Match),
+/// otherwise strong comparison where weak tags never match (If-Range)
+int etag_list_matches(const char* list, size_t len, const validators_t* validators, int weak) {
+    const char* p = list;
+    const char* end = list + len;
+    while (p < end) {
+        const char* tag_end = memchr(p, ',', end - p);
+        if (!tag_end) tag_end = end;
+
+        const char* tag = p;
+        while (tag < tag_end && (*tag == ' ' || *tag == '\t')) tag++;
+        const char* tag_stop = tag_end;
+        while (tag_stop > tag && (tag_stop[-1] == ' ' || tag_stop[-1] == '\t')) tag_stop--;
+
+        if (tag_stop - tag == 1 && *tag == '*') return 1;
+        int is_weak = tag_stop - tag >= 2 && tag[0] == 'W' && tag[1] == '/';
+        if (is_weak) tag += 2;
+
+        if ((weak || !is_weak) && (size_t) (tag_stop - tag) == validators->etag_len &&
+            memcmp(tag, validators->etag, validators->etag_len) == 0) {
+            return 1;
+        }
+        p = tag_end + 1;
+    }
+    return 0;
+}
+
+/// @brief whether a request carries headers that can turn a 200 into
+/// something else, checked before taking a prebuilt response
+int http_has_preconditions(const http_request_t* request) {
+    return http_get_header(request, HDR_IF_NONE_MATCH) ||
+        http_get_header(request, HDR_IF_MODIFIED_SINCE) ||
+        http_get_header(request, HDR_RANGE);
+}
+
+/// @brief evaluate If-None-Match, or failing that If-Modified-Since
+/// @return 1 if the client's copy is current (304)
+int http_not_modified(const http_request_t* request, const validators_t* validators) {
+    const http_header_t* none_match = http_get_header(request, HDR_IF_NONE_MATCH);
+    if (none_match) return etag_list_matches(none_match->value, none_match->value_len, validators, 1);
+
+    const http_header_t* modified_since = http_get_header(request, HDR_IF_MODIFIED_SINCE);
+    if (!modified_since) return 0;
+
+    // clients normally echo our Last-Modified back verbatim
+    if (slice_equals(modified_since->value, modified_since->value_len, validators->last_modified)) return 1;
+
+    time_t since;
+    return IS_OK_APP(parse_http_date(modified_since->value, modified_since->value_len, &since)) &&
+        validators->mtime <= since;
+}
+
+/// @brief parse a Range header against a body, honouring If-Range
+/// @param ranges output, up to MAX_RANGES satisfiable ranges in request order
+/// @return number of ranges, 0 to send the whole body (no, stale or
+/// unusable Range), -1 if no range can be satisfied (416)
+int http_parse_ranges(const http_request_t* request, const validators_t* validators, off_t size, byte_range_t* ranges) {
+    const http_header_t* range = http_get_header(request, HDR_RANGE);
+    if (!range) return 0;
+
+    // the client's partial copy is outdated, it needs everything
+    const http_header_t* if_range = http_get_header(request, HDR_IF_RANGE);
+    if (if_range) {
+        time_t date;
+        int is_tag = if_range->value_len > 0 && (if_range->value[0] == '"' || if_range->value[0] == 'W');
+        int current = is_tag ?
+            etag_list_matches(if_range->value, if_range->value_len, validators, 0) :
+            IS_OK_APP(parse_http_date(if_range->value, if_range->value_len, &date)) && date == validators->mtime;
+        if (!current) return 0;
+    }
+
+    const char* p = range->value;
+    const char* end = range->value + range->value_len;
+    if (end - p < 6 || strncasecmp(p, "bytes=", 6) != 0) return 0;
+    p += 6;
+
+    int num_ranges = 0;
+    while (p < end) {
+        const char* spec_end = memchr(p, ',', end - p);
+        if (!spec_end) spec_end = end;
+
+        const char* spec = p;
+        while (spec < spec_end && (*spec == ' ' || *spec == '\t')) spec++;
+        const char* spec_stop = spec_end;
+        while (spec_stop > spec && (spec_stop[-1] == ' ' || spec_stop[-1] == '\t')) spec_stop--;
+        p = spec_end + 1;
+
+        // empty list elements are allowed
+        if (spec == spec_stop) continue;
+
+        const char* dash = memchr(spec, '-', spec_stop - spec);
+        if (!dash) return 0;
+
+        long first, last;
+        if (dash == spec) {
+            // "-N", the last N bytes
+            long suffix;
+            if (!IS_OK_APP(parse_content_length(dash + 1, spec_stop - dash - 1, &suffix))) return 0;
+            if (suffix == 0 || size == 0) continue;
+            first = suffix >= size ? 0 : size - suffix;
+            last = size - 1;
+        } else {
+            // "A-" or "A-B", B is clamped to the body
+            if (!IS_OK_APP(parse_content_length(spec, dash - spec, &first))) return 0;
+            last = size - 1;
+            if (dash + 1 < spec_stop) {
+                if (!IS_OK_APP(parse_content_length(dash + 1, spec_stop - dash - 1, &last))) return 0;
+                if (last < first) return 0;
+                if (last >= size) last = size - 1;
+            }
+            if (first >= size) continue;
+        }
+
+        // that many parts cost more than the whole body
+        if (num_ranges == MAX_RANGES) return 0;
+        ranges[num_ranges].start = first;
+        ranges[num_ranges].end = last + 1;
+        num_ranges++;
+    }
+
+    return num_ranges > 0 ? num_ranges : -1;
+}
+
+/// @brief Content-Encoding, Vary and validator fields of a response
+/// @param vary whether the body depends on Accept-Encoding
+void sb_representation_headers(strbuf_t* sb, content_encoding_t encoding, int vary, const validators_t* validators) {
+    if (encoding != ENC_IDENTITY) sb_header(sb, "Content-Encoding", gEncodings[encoding].token);
+    if (vary) sb_header(sb, "Vary", "Accept-Encoding");
+    sb_header(sb, "ETag", validators->etag);
+    sb_header(sb, "Last-Modified", validators->last_modified);
+}
+
+/// @brief status line and header block of a 200 response
+void sb_ok_head(strbuf_t* sb, const char* version, size_t version_len, off_t size, const char* mime_type,
+                content_encoding_t encoding, int vary, const validators_t* validators, int keep_alive) {
+    sb_status_line(sb, version, version_len, 200, "OK");
+    sb_header_u(sb, "Content-Length", size);
+    sb_header(sb, "Content-Type", mime_type);
+    sb_representation_headers(sb, encoding, vary, validators);
+    sb_header(sb, "Accept-Ranges", "bytes");
+    sb_header(sb, "Connection", keep_alive ? "keep-alive" : "close");
+    sb_append(sb, "\r\n", 2);
+}
+
+/**
+ * DOCUMENT ROOT INDEX
+ */
+
+/// @brief what a URL path of an indexed document root resolves to
+typedef struct {
+    uint64_t hash;
+    uint32_t key_off;
+    uint32_t key_len;
+    // filesystem path to serve, the file itself or a directory's index
+    // file; 0 for a directory without one
+    uint32_t serve_off;
+    uint32_t is_dir;
+    const char* mime_type;
+} doc_entry_t;
+
+/// @brief read-only map from URL path to doc_entry_t, built by walking the
+/// document root once and replaced as a whole on reload
+typedef struct doc_index {
+    doc_entry_t* entries;
+    size_t num_entries;
+    size_t entries_cap;
+
+    // open addressing with linear probing, entry index + 1 per slot and 0
+    // when empty; a power of two, at most half full
+    uint32_t* slots;
+    size_t mask;
+
+    // keys and filesystem paths, NUL-terminated; offset 0 is never handed out
+    char* strings;
+    size_t strings_len;
+    size_t strings_cap;
+
+    // once replaced: the epoch that replaced it, and the next older index
+    // still waiting to be freed
+    uint64_t retired_epoch;
+    struct doc_index* retired_next;
+} doc_index_t;
+
+// NULL unless -I; workers read it per request, the main thread swaps it on
+// SIGHUP and frees the old one once every worker has seen the new epoch
+static _Atomic(doc_index_t*) gDocIndex = NULL;
+static _Atomic uint64_t gDocIndexEpoch = 0;
+
+// replaced indexes some worker may still read, newest first; main thread only
+static doc_index_t* gDocIndexRetired = NULL;
+
+// nftw() takes no context, indexes are only built on the main thread
+static doc_index_t* gDocIndexBuild = NULL;
+
+/// @brief FNV-1a hash of a byte slice
+uint64_t hash_slice(const char* data, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+void doc_index_free(doc_index_t* index) {
+    if (!index) return;
+    free(index->entries);
+    free(index->slots);
+    free(index->strings);
+    free(index);
+}
+
+/// @brief copy a string into the index
+/// @return its offset, 0 when out of memory
+uint32_t doc_index_string(doc_index_t* index, const char* str, size_t len) {
+    if (index->strings_len + len + 1 > index->strings_cap) {
+        size_t cap = index->strings_cap ? index->strings_cap : 64 * 1024;
+        while (index->strings_len + len + 1 > cap) cap *= 2;
+        if (cap > UINT32_MAX) return 0;
+
+        char* strings = realloc(index->strings, cap);
+        if (!strings) return 0;
+        index->strings = strings;
+        index->strings_cap = cap;
+    }
+
+    uint32_t off = (uint32_t) index->strings_len;
+    memcpy(index->strings + off, str, len);
+    index->strings[off + len] = '\0';
+    index->strings_len += len + 1;
+    return off;
+}
+
+result_t doc_index_add(doc_index_t* index, const char* key, size_t key_len, uint32_t serve_off,
+                       int is_dir, const char* mime_type) {
+    if (index->num_entries >= DOC_INDEX_MAX_ENTRIES) return APP_ERR;
+    if (index->num_entries == index->entries_cap) {
+        size_t cap = index->entries_cap ? index->entries_cap * 2 : 1024;
+        doc_entry_t* entries = realloc(index->entries, cap * sizeof(doc_entry_t));
+        if (!entries) return APP_ERR;
+        index->entries = entries;
+        index->entries_cap = cap;
+    }
+
+    uint32_t key_off = doc_index_string(index, key, key_len);
+    if (!key_off) return APP_ERR;
+
+    doc_entry_t* entry = &index->entries[index->num_entries++];
+    entry->hash = hash_slice(key, key_len);
+    entry->key_off = key_off;
+    entry->key_len = (uint32_t) key_len;
+    entry->serve_off = serve_off;
+    entry->is_dir = is_dir;
+    entry->mime_type = mime_type;
+    return APP_OK;
+}
+
+/// @brief nftw() callback: regular files map to themselves, directories
+/// (with and without a trailing slash) to their index.html / index.htm
+int doc_index_visit(const char* fpath, const struct stat* st, int type, struct FTW* ftw) {
+    doc_index_t* index = gDocIndexBuild;
+    const char* key = fpath + strlen(DOCUMENT_ROOT);
+    size_t key_len = strlen(key);
+
+    // longer paths are rejected before any lookup
+    if (strlen(fpath) >= PATH_MAX_LEN - 1) return FTW_CONTINUE;
+
+    // AppleDouble metadata ("._name") isn't content, nor is what it holds
+    if (ftw->level > 0 && strncmp(fpath + ftw->base, "._", 2) == 0) {
+        return type == FTW_D ? FTW_SKIP_SUBTREE : FTW_CONTINUE;
+    }
+
+    if (type == FTW_F && S_ISREG(st->st_mode)) {
+        uint32_t serve_off = doc_index_string(index, fpath, strlen(fpath));
+        if (!serve_off || !IS_OK_APP(doc_index_add(index, key, key_len, serve_off, 0, get_mime_type(fpath)))) {
+            return FTW_STOP;
+        }
+    } else if (type == FTW_D) {
+        // same resolution as fd_cache_acquire(), done once up front
+        static const char* index_names[2] = { "index.html", "index.htm" };
+        uint32_t serve_off = 0;
+        const char* mime_type = NULL;
+        for (int i = 0; i < 2 && !serve_off; i++) {
+            char try_path[PATH_MAX_LEN];
+            int len = snprintf(try_path, sizeof(try_path), "%s/%s", fpath, index_names[i]);
+            if (len < 0 || (size_t) len >= sizeof(try_path)) continue;
+
+            // lstat: a linked index could point outside the document root
+            struct stat index_st;
+            if (lstat(try_path, &index_st) == 0 && S_ISREG(index_st.st_mode)) {
+                serve_off = doc_index_string(index, try_path, len);
+                if (!serve_off) return FTW_STOP;
+                mime_type = get_mime_type(try_path);
+            }
+        }
+
+        char slashed[PATH_MAX_LEN];
+        memcpy(slashed, key, key_len);
+        slashed[key_len] = '/';
+        if (!IS_OK_APP(doc_index_add(index, slashed, key_len + 1, serve_off, 1, mime_type))) return FTW_STOP;
+        if (key_len > 0 && !IS_OK_APP(doc_index_add(index, key, key_len, serve_off, 1, mime_type))) return FTW_STOP;
+    }
+
+    // unreadable directories, symlinks (FTW_SL, the walk doesn't follow them,
+    // they could lead outside the document root) and special files are left
+    // out, they answer 404
+    return FTW_CONTINUE;
+}
+
+/// @brief walk the document root and build a fresh index
+/// @return NULL on failure
+doc_index_t* doc_index_build(void) {
+    doc_index_t* index = calloc(1, sizeof(doc_index_t));
+    if (!index) return NULL;
+
+    // reserve offset 0 so it can mean "none"
+    index->strings_len = 1;
+    if (!doc_index_string(index, "", 0)) {
+        doc_index_free(index);
+        return NULL;
+    }
+
+    gDocIndexBuild = index;
+    int walked = nftw(DOCUMENT_ROOT, doc_index_visit, DOC_INDEX_WALK_FDS, FTW_ACTIONRETVAL | FTW_PHYS);
+    gDocIndexBuild = NULL;
+    if (walked != 0) {
+        doc_index_free(index);
+        return NULL;
+    }
+
+    size_t num_slots = 16;
+    while (num_slots < index->num_entries * 2) num_slots *= 2;
+    index->slots = calloc(num_slots, sizeof(uint32_t));
+    if (!index->slots) {
+        doc_index_free(index);
+        return NULL;
+    }
+    index->mask = num_slots - 1;
+
+    for (size_t i = 0; i < index->num_entries; i++) {
+        size_t slot = index->entries[i].hash & index->mask;
+        while (index->slots[slot]) slot = (slot + 1) & index->mask;
+        index->slots[slot] = (uint32_t) i + 1;
+    }
+
+    LOG_INFO("indexed %zu paths under %s (%zu KB)\n", index->num_entries, DOCUMENT_ROOT,
+             (index->num_entries * sizeof(doc_entry_t) + num_slots * sizeof(uint32_t) + index->strings_len) / 1024);
+    return index;
+}
+
+/// @return NULL if the path isn't in the document root
+const doc_entry_t* doc_index_lookup(const doc_index_t* index, const char* path, size_t len) {
+    uint64_t hash = hash_slice(path, len);
+    for (size_t slot = hash & index->mask;; slot = (slot + 1) & index->mask) {
+        uint32_t i = index->slots[slot];
+        if (!i) return NULL;
+
+        const doc_entry_t* entry = &index->entries[i - 1];
+        if (entry->hash == hash && entry->key_len == len && memcmp(index->strings + entry->key_off, path, len) == 0) {
+            return entry;
+        }
+    }
+}
+
+/// @brief rebuild the index and swap it in; the old one is retired until
+/// doc_index_collect() sees that no worker can still read it. A failed
+/// rebuild keeps the old index
+void doc_index_reload(void) {
+    doc_index_t* fresh = doc_index_build();
+    if (!fresh) {
+        LOG_WARN("could not reindex %s, keeping the previous index\n", DOCUMENT_ROOT);
+        return;
+    }
+
+    doc_index_t* old = atomic_exchange(&gDocIndex, fresh);
+    old->retired_epoch = atomic_fetch_add(&gDocIndexEpoch, 1) + 1;
+    old->retired_next = gDocIndexRetired;
+    gDocIndexRetired = old;
+}
+
+/// @brief free the retired indexes every worker went back to its event loop
+/// since; idle loops get there at least every EPOLL_TIMEOUT_MS
+/// @return whether some are still waiting
+int doc_index_collect(worker_t* workers, long num_workers) {
+    uint64_t seen = UINT64_MAX;
+    for (long i = 0; i < num_workers; i++) {
+        uint64_t epoch = atomic_load(&workers[i].index_epoch);
+        if (epoch < seen) seen = epoch;
+    }
+
+    // newest first, so everything after the first one freed goes as well
+    doc_index_t** link = &gDocIndexRetired;
+    while (*link && (*link)->retired_epoch > seen) link = &(*link)->retired_next;
+    while (*link) {
+        doc_index_t* index = *link;
+        *link = index->retired_next;
+        doc_index_free(index);
+    }
+    return gDocIndexRetired != NULL;
+}
+
+/**
+ * CACHES
+ */
+
+/// @brief common header of everything stored in a clock_table_t, keyed
+/// by (path, encoding)
+typedef struct cache_node {
+    char path[PATH_MAX_LEN];
+    content_encoding_t encoding;
+    uint64_t hash;
+    struct cache_node* next;
+    void (*destroy)(struct cache_node*);
+
+    // identity of the file when it was loaded, checked on revalidation;
+    // the file is path + source_suffix (a precompressed sibling) or path
+    struct stat st;
+    const char* source_suffix;
+    _Atomic time_t validated_at;
+
+    // share of the table capacity this node uses
+    size_t cost;
+    size_t slot;
+
+    // one reference held by the table, one per user (e.g. response in flight)
+    atomic_int refs;
+    // CLOCK reference bit, set on every hit
+    atomic_int referenced;
+} cache_node_t;
+
+/// @brief concurrent path-keyed table bounded by total cost, evicted with CLOCK
+typedef struct {
+    pthread_rwlock_t lock;
+    cache_node_t* buckets[CACHE_BUCKETS];
+
+    // dense array of nodes swept by the CLOCK hand
+    cache_node_t* ring[CACHE_MAX_ENTRIES];
+    size_t num_entries;
+    size_t hand;
+
+    size_t used;
+    size_t capacity;
+} clock_table_t;
+
+/// @brief a small file, or one encoding of it, held in memory together
+/// with its serialized headers
+struct cache_entry {
+    cache_node_t node;
+
+    // status line + header block for each (HTTP version, keep-alive) pair,
+    // see cache_variant(); data is the file body
+    char* blob;
+    char* headers[4];
+    size_t headers_len[4];
+    char* data;
+    size_t size;
+
+    // what conditional and range requests are answered from
+    const char* mime_type;
+    content_encoding_t encoding;
+    validators_t validators;
+};
+
+/// @brief an open descriptor and its stat result, or for directories the
+/// resolved index file
+struct fd_entry {
+    cache_node_t node;
+    int fd;
+    const char* mime_type;
+    char index_path[PATH_MAX_LEN];
+
+    // precompressed siblings (path.gz, path.br) seen when the entry was
+    // created, bitmask of (1 << content_encoding_t)
+    int siblings;
+};
+
+// in-memory bodies, capacity in bytes
+static clock_table_t gFileCache = {
+    .lock = PTHREAD_RWLOCK_INITIALIZER,
+    .capacity = CACHE_DEFAULT_CAPACITY,
+};
+
+// open descriptors and stat results, capacity in entries
+static clock_table_t gFdCache = {
+    .lock = PTHREAD_RWLOCK_INITIALIZER,
+    .capacity = FD_CACHE_DEFAULT_MAX,
+};
+
+// seconds a cached node is trusted before its stat is rechecked
+static time_t gCacheTtl = CACHE_DEFAULT_TTL;
+
+/// @brief FNV-1a hash of a NUL-terminated path and an encoding
+uint64_t hash_key(const char* path, content_encoding_t encoding) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const unsigned char* p = (const unsigned char*) path; *p; p++) {
+        hash ^= *p;
+        hash *= 0x100000001b3ULL;
+    }
+    hash ^= encoding;
+    hash *= 0x100000001b3ULL;
+    return hash;
+}
+
+/// @brief whether two stat results describe the same, unmodified file
+int stat_matches(const struct stat* a, const struct stat* b) {
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+        a->st_size == b->st_size && a->st_mode == b->st_mode &&
+        a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/// @brief prepare a node for insertion, the caller holds the only reference
+/// @param source_suffix appended to path to find the file st describes
+void cache_node_init(cache_node_t* node, const char* path, content_encoding_t encoding, const struct stat* st,
+                     const char* source_suffix, size_t cost, void (*destroy)(cache_node_t*)) {
+    strcpy(node->path, path);
+    node->encoding = encoding;
+    node->hash = hash_key(path, encoding);
+    node->next = NULL;
+    node->destroy = destroy;
+    node->st = *st;
+    node->source_suffix = source_suffix;
+    node->validated_at = time(NULL);
+    node->cost = cost;
+    node->refs = 1;
+    node->referenced = 0;
+}
+
+void cache_node_release(cache_node_t* node) {
+    if (atomic_fetch_sub(&node->refs, 1) == 1) {
+        node->destroy(node);
+    }
+}
+
+/// @brief remove a node from the table, caller holds the write lock
+void table_unlink_locked(clock_table_t* table, cache_node_t* node) {
+    cache_node_t** link = &table->buckets[node->hash % CACHE_BUCKETS];
+    while (*link && *link != node) link = &(*link)->next;
+    if (!*link) return;
+    *link = node->next;
+
+    // keep the ring dense by moving the last node into the hole
+    cache_node_t* last = table->ring[--table->num_entries];
+    table->ring[node->slot] = last;
+    last->slot = node->slot;
+    table->ring[table->num_entries] = NULL;
+    if (table->hand >= table->num_entries) table->hand = 0;
+
+    table->used -= node->cost;
+    cache_node_release(node);
+}
+
+void table_remove(clock_table_t* table, cache_node_t* node) {
+    pthread_rwlock_wrlock(&table->lock);
+    table_unlink_locked(table, node);
+    pthread_rwlock_unlock(&table->lock);
+}
+
+/// @brief evict with CLOCK until `cost` more and one more node fit
+void table_make_room_locked(clock_table_t* table, size_t cost) {
+    while (table->num_entries > 0 &&
+           (table->used + cost > table->capacity || table->num_entries >= CACHE_MAX_ENTRIES)) {
+        cache_node_t* node = table->ring[table->hand];
+        if (atomic_exchange(&node->referenced, 0)) {
+            // recently used, give it another lap
+            table->hand = (table->hand + 1) % table->num_entries;
+            continue;
+        }
+        table_unlink_locked(table, node);
+    }
+}
+
+/// @brief find a node by key, revalidating it against the filesystem
+/// once gCacheTtl has passed
+/// @return referenced node (release with cache_node_release) or NULL
+cache_node_t* table_lookup(clock_table_t* table, const char* path, content_encoding_t encoding) {
+    if (table->capacity == 0) return NULL;
+
+    uint64_t hash = hash_key(path, encoding);
+    cache_node_t* node;
+
+    pthread_rwlock_rdlock(&table->lock);
+    for (node = table->buckets[hash % CACHE_BUCKETS]; node; node = node->next) {
+        if (node->hash == hash && node->encoding == encoding && strcmp(node->path, path) == 0) {
+            atomic_fetch_add(&node->refs, 1);
+            atomic_store(&node->referenced, 1);
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&table->lock);
+
+    if (!node) return NULL;
+
+    time_t now = time(NULL);
+    if (now - atomic_load(&node->validated_at) < gCacheTtl) return node;
+
+    // stale, make sure the file on disk is still the one we hold
+    char source[PATH_MAX_LEN + 4];
+    snprintf(source, sizeof(source), "%s%s", path, node->source_suffix);
+
+    struct stat st;
+    if (stat(source, &st) == 0 && stat_matches(&st, &node->st)) {
+        atomic_store(&node->validated_at, now);
+        return node;
+    }
+
+    table_remove(table, node);
+    cache_node_release(node);
+    return NULL;
+}
+
+/// @brief publish a node, replacing any node with the same path; the
+/// caller keeps its reference whether or not the node fit
+void table_insert(clock_table_t* table, cache_node_t* node) {
+    if (table->capacity == 0) return;
+
+    pthread_rwlock_wrlock(&table->lock);
+
+    // another worker may have loaded the same path meanwhile, replace it
+    for (cache_node_t* other = table->buckets[node->hash % CACHE_BUCKETS]; other; other = other->next) {
+        if (other->hash == node->hash && other->encoding == node->encoding && strcmp(other->path, node->path) == 0) {
+            table_unlink_locked(table, other);
+            break;
+        }
+    }
+
+    table_make_room_locked(table, node->cost);
+    if (table->used + node->cost <= table->capacity) {
+        atomic_fetch_add(&node->refs, 1);
+        node->next = table->buckets[node->hash % CACHE_BUCKETS];
+        table->buckets[node->hash % CACHE_BUCKETS] = node;
+        node->slot = table->num_entries;
+        table->ring[table->num_entries++] = node;
+        table->used += node->cost;
+    }
+
+    pthread_rwlock_unlock(&table->lock);
+}
+
+/// @brief pick the prebuilt header block matching a request
+int cache_variant(const http_request_t* request, int keep_alive) {
+    return slice_equals(request->version, request->version_len, "HTTP/1.1") << 1 | (keep_alive != 0);
+}
+
+void cache_entry_destroy(cache_node_t* node) {
+    cache_entry_t* entry = (cache_entry_t*) node;
+    free(entry->blob);
+    free(entry);
+}
+
+void cache_entry_release(cache_entry_t* entry) {
+    cache_node_release(&entry->node);
+}
+
+/// @return referenced in-memory entry or NULL
+cache_entry_t* cache_lookup(const char* path, content_encoding_t encoding) {
+    return (cache_entry_t*) table_lookup(&gFileCache, path, encoding);
+}
+
+/// @brief read a whole file region into memory
+/// @return APP_ERR on error or a short read (the file changed underneath us)
+result_t read_fully(int fd, char* data, off_t size) {
+    off_t read_offset = 0;
+    while (read_offset < size) {
+        ssize_t bytes_read = pread(fd, data + read_offset, size - read_offset, read_offset);
+        if (bytes_read < 0 && errno == EINTR) continue;
+        if (bytes_read <= 0) return APP_ERR;
+        read_offset += bytes_read;
+    }
+    return APP_OK;
+}
+
+/// @brief allocate an entry and serialize all its header variants, the
+/// caller fills in the body
+/// @param encoding Content-Encoding the body carries
+/// @param st the file the body was made from, for the validators
+cache_entry_t* cache_entry_create(size_t size, const char* mime_type, content_encoding_t encoding, const struct stat* st) {
+    static const char* versions[2] = { "HTTP/1.0", "HTTP/1.1" };
+    int vary = mime_is_compressible(mime_type);
+
+    validators_t validators;
+    make_validators(st, encoding, &validators);
+
+    char headers[4][512];
+    size_t headers_len[4];
+    size_t headers_total = 0;
+    for (int v = 0; v < 4; v++) {
+        strbuf_t sb;
+        sb_init(&sb, headers[v], sizeof(headers[v]));
+        sb_ok_head(&sb, versions[v >> 1], strlen(versions[v >> 1]), size, mime_type, encoding, vary, &validators, v & 1);
+        if (sb.overflow) return NULL;
+
+        headers_len[v] = sb.len;
+        headers_total += sb.len;
+    }
+
+    cache_entry_t* entry = calloc(1, sizeof(cache_entry_t));
+    if (!entry) return NULL;
+    entry->blob = malloc(headers_total + size);
+    if (!entry->blob) {
+        free(entry);
+        return NULL;
+    }
+
+    char* cursor = entry->blob;
+    for (int v = 0; v < 4; v++) {
+        memcpy(cursor, headers[v], headers_len[v]);
+        entry->headers[v] = cursor;
+        entry->headers_len[v] = headers_len[v];
+        cursor += headers_len[v];
+    }
+    entry->data = cursor;
+    entry->size = size;
+    entry->node.cost = headers_total + size;
+    entry->mime_type = mime_type;
+    entry->encoding = encoding;
+    entry->validators = validators;
+    return entry;
+}
+
+/// @brief publish a filled entry under (path, encoding)
+void cache_entry_publish(cache_entry_t* entry, const char* path, content_encoding_t encoding,
+                         const struct stat* st, const char* source_suffix) {
+    cache_node_init(&entry->node, path, encoding, st, source_suffix, entry->node.cost, cache_entry_destroy);
+    table_insert(&gFileCache, &entry->node);
+}
+
+/// @brief load an open regular file into the in-memory cache as is
+/// @param path key the entry is published under
+/// @param encoding what the file's bytes already are, ENC_IDENTITY or the
+/// encoding of the precompressed sibling path + gEncodings[encoding].suffix
+/// @return referenced entry (release with cache_entry_release) or NULL
+cache_entry_t* cache_insert(const char* path, content_encoding_t encoding, int fd, const struct stat* st, const char* mime_type) {
+    if (gFileCache.capacity == 0 || st->st_size > CACHE_MAX_ENTRY_SIZE) return NULL;
+
+    cache_entry_t* entry = cache_entry_create(st->st_size, mime_type, encoding, st);
+    if (!entry) return NULL;
+
+    if (!IS_OK_APP(read_fully(fd, entry->data, st->st_size))) {
+        cache_entry_destroy(&entry->node);
+        return NULL;
+    }
+
+    cache_entry_publish(entry, path, encoding, st, gEncodings[encoding].suffix);
+    return entry;
+}
+
+/// @brief compress an open regular file once and keep the result in the
+/// in-memory cache under (path, encoding); bodies that don't shrink are
+/// kept unencoded so the work isn't repeated for every request
+/// @return referenced entry (release with cache_entry_release) or NULL
+cache_entry_t* cache_insert_compressed(const char* path, content_encoding_t encoding, int fd, const struct stat* st, const char* mime_type) {
+    if (gFileCache.capacity == 0 || st->st_size > CACHE_MAX_ENTRY_SIZE) return NULL;
+
+    char* source = malloc(st->st_size > 0 ? st->st_size : 1);
+    if (!source) return NULL;
+    if (!IS_OK_APP(read_fully(fd, source, st->st_size))) {
+        free(source);
+        return NULL;
+    }
+
+    size_t compressed_len = 0;
+    char* compressed = st->st_size >= COMPRESS_MIN_SIZE ?
+        compress_buffer(source, st->st_size, encoding, &compressed_len) : NULL;
+
+    content_encoding_t body_encoding = encoding;
+    const char* body = compressed;
+    size_t body_len = compressed_len;
+    if (!compressed || compressed_len >= (size_t) st->st_size) {
+        body_encoding = ENC_IDENTITY;
+        body = source;
+        body_len = st->st_size;
+    }
+
+    cache_entry_t* entry = cache_entry_create(body_len, mime_type, body_encoding, st);
+    if (entry) {
+        memcpy(entry->data, body, body_len);
+        cache_entry_publish(entry, path, encoding, st, "");
+    }
+
+    free(compressed);
+    free(source);
+    return entry;
+}
+
+void fd_entry_destroy(cache_node_t* node) {
+    fd_entry_t* file = (fd_entry_t*) node;
+    if (file->fd >= 0) close(file->fd);
+    free(file);
+}
+
+void fd_entry_release(fd_entry_t* file) {
+    cache_node_release(&file->node);
+}
+
+/// @brief look up (or stat, open and cache) a path; regular files come
+/// back with an open descriptor, directories with their index file resolved
+/// @return referenced entry, or NULL with errno set
+/// @brief open a path under the document root without following a
+/// symbolic link in any component, so none can lead outside of it; the -I
+/// walk leaves links out the same way. Kernels without openat2() (before
+/// 5.6) get O_NOFOLLOW, which covers only the last component
+int docroot_open(const char* path, int flags) {
+    struct open_how how = { .flags = flags, .resolve = RESOLVE_NO_SYMLINKS };
+    int fd = syscall(SYS_openat2, AT_FDCWD, path, &how, sizeof(how));
+    if (fd >= 0 || errno != ENOSYS) return fd;
+    return open(path, flags | O_NOFOLLOW);
+}
+
+fd_entry_t* fd_cache_acquire(const char* path) {
+    fd_entry_t* file = (fd_entry_t*) table_lookup(&gFdCache, path, ENC_IDENTITY);
+    if (file) {
+        METRIC_ADD(fd_cache_hits, 1);
+        return file;
+    }
+    METRIC_ADD(fd_cache_misses, 1);
+
+    if (strlen(path) >= PATH_MAX_LEN) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+
+    // open first and describe what was opened: a file replaced between a
+    // stat and an open would be sent under the old size and validators.
+    // O_NONBLOCK only keeps a FIFO from blocking the open
+    struct stat st;
+    int fd = docroot_open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (fd >= 0 && fstat(fd, &st) != 0) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return NULL;
+    }
+    if (fd < 0) {
+        // a directory can be searchable without being readable, its index
+        // is still served
+        int saved_errno = errno;
+        int dir_fd = saved_errno == EACCES ? docroot_open(path, O_PATH | O_CLOEXEC) : -1;
+        int is_dir = dir_fd >= 0 && fstat(dir_fd, &st) == 0 && S_ISDIR(st.st_mode);
+        if (dir_fd >= 0) close(dir_fd);
+        if (!is_dir) {
+            errno = saved_errno;
+            return NULL;
+        }
+    }
+
+    // io_uring would fail reads of uncached pages on a non-blocking file
+    // rather than wait for them
+    if (fd >= 0 && (!S_ISREG(st.st_mode) || fcntl(fd, F_SETFL, 0) != 0)) {
+        close(fd);
+        fd = -1;
+    }
+
+    file = calloc(1, sizeof(fd_entry_t));
+    if (!file) {
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    file->fd = fd;
+
+    if (S_ISREG(st.st_mode)) {
+        if (file->fd < 0) {
+            free(file);
+            return NULL;
+        }
+        file->mime_type = get_mime_type(path);
+
+        // note which precompressed siblings exist, so requests that can't
+        // use them don't have to probe for them
+        for (int enc = ENC_GZIP; enc < ENC_KINDS && mime_is_compressible(file->mime_type); enc++) {
+            char try_path[PATH_MAX_LEN];
+            int len = snprintf(try_path, sizeof(try_path), "%s%s", path, gEncodings[enc].suffix);
+            if (len < 0 || (size_t) len >= sizeof(try_path)) continue;
+
+            struct stat sibling_st;
+            if (lstat(try_path, &sibling_st) == 0 && S_ISREG(sibling_st.st_mode)) {
+                file->siblings |= 1 << enc;
+            }
+        }
+    } else if (S_ISDIR(st.st_mode)) {
+        // look for index.html, then index.htm
+        static const char* index_names[2] = { "index.html", "index.htm" };
+        size_t path_len = strlen(path);
+        const char* slash = path_len > 0 && path[path_len - 1] == '/' ? "" : "/";
+
+        for (int i = 0; i < 2; i++) {
+            char try_path[PATH_MAX_LEN];
+            int len = snprintf(try_path, sizeof(try_path), "%s%s%s", path, slash, index_names[i]);
+            if (len < 0 || (size_t) len >= sizeof(try_path)) continue;
+
+            // lstat: a linked index wouldn't open, index.htm is tried instead
+            struct stat index_st;
+            if (lstat(try_path, &index_st) == 0 && S_ISREG(index_st.st_mode)) {
+                strcpy(file->index_path, try_path);
+                break;
+            }
+        }
+    }
+
+    cache_node_init(&file->node, path, ENC_IDENTITY, &st, "", 1, fd_entry_destroy);
+    table_insert(&gFdCache, &file->node);
+    return file;
+}
+
+/// @brief a response body plus what its headers are built from, the bytes
+/// come from exactly one of entry (memory) or file (sendfile)
+typedef struct {
+    const char* mime_type;
+    content_encoding_t encoding;
+    off_t size;
+    const validators_t* validators;
+    cache_entry_t* entry;
+    fd_entry_t* file;
+} representation_t;
+
+/// @brief queue [start, end) of a representation's body, the segment
+/// holds its own reference
+result_t queue_body(connection_t* conn, const representation_t* rep, off_t start, off_t end) {
+    if (rep->entry) {
+        atomic_fetch_add(&rep->entry->node.refs, 1);
+        if (IS_OK_APP(conn_queue(conn, rep->entry->data + start, end - start, rep->entry))) return APP_OK;
+        cache_entry_release(rep->entry);
+        return APP_ERR;
+    }
+
+    atomic_fetch_add(&rep->file->node.refs, 1);
+    if (IS_OK_APP(conn_queue_file(conn, rep->file, start, end))) return APP_OK;
+    fd_entry_release(rep->file);
+    return APP_ERR;
+}
+
+/// @brief queue a 206 with one range, or a multipart/byteranges body
+/// @return APP_ERR without queueing anything if the parts don't fit the
+/// connection's output queue, the caller sends the whole body instead
+result_t queue_partial(connection_t* conn, const http_request_t* request, const representation_t* rep,
+                       const byte_range_t* ranges, int num_ranges) {
+    int vary = mime_is_compressible(rep->mime_type);
+    strbuf_t sb;
+    conn_builder(conn, &sb);
+
+    if (num_ranges == 1) {
+        sb_status_line(&sb, request->version, request->version_len, 206, "Partial Content");
+        sb_header_u(&sb, "Content-Length", ranges[0].end - ranges[0].start);
+        sb_header(&sb, "Content-Type", rep->mime_type);
+        sb_representation_headers(&sb, rep->encoding, vary, rep->validators);
+        sb_content_range(&sb, ranges[0].start, ranges[0].end, rep->size);
+        sb_header(&sb, "Connection", conn->keep_alive ? "keep-alive" : "close");
+        sb_append(&sb, "\r\n", 2);
+        if (sb.overflow || CONN_SEG_MAX - conn->seg_cnt < 2) return APP_ERR;
+
+        conn_commit(conn, &sb);
+        conn->resp_status = 206;
+        conn->resp_bytes = ranges[0].end - ranges[0].start;
+        return queue_body(conn, rep, ranges[0].start, ranges[0].end);
+    }
+
+    // head, a header block and a body per part, closing delimiter
+    if (CONN_SEG_MAX - conn->seg_cnt < 2 * num_ranges + 2) return APP_ERR;
+
+    // part headers go first in the arena so the total length is known
+    // when the head is written after them
+    size_t part_off[MAX_RANGES + 1];
+    off_t total = 0;
+    for (int i = 0; i < num_ranges; i++) {
+        part_off[i] = sb.len;
+        sb_puts(&sb, "\r\n--" MULTIPART_BOUNDARY "\r\n");
+        sb_header(&sb, "Content-Type", rep->mime_type);
+        sb_content_range(&sb, ranges[i].start, ranges[i].end, rep->size);
+        sb_append(&sb, "\r\n", 2);
+        total += ranges[i].end - ranges[i].start;
+    }
+    part_off[num_ranges] = sb.len;
+    sb_puts(&sb, "\r\n--" MULTIPART_BOUNDARY "--\r\n");
+    size_t head_off = sb.len;
+    total += head_off;
+
+    sb_status_line(&sb, request->version, request->version_len, 206, "Partial Content");
+    sb_header_u(&sb, "Content-Length", total);
+    sb_header(&sb, "Content-Type", "multipart/byteranges; boundary=" MULTIPART_BOUNDARY);
+    sb_representation_headers(&sb, rep->encoding, vary, rep->validators);
+    sb_header(&sb, "Connection", conn->keep_alive ? "keep-alive" : "close");
+    sb_append(&sb, "\r\n", 2);
+    if (sb.overflow) return APP_ERR;
+
+    // room was checked above, none of these can fail
+    conn->resp_status = 206;
+    conn->resp_bytes = total;
+    conn->arena_used += sb.len;
+    conn_queue(conn, sb.data + head_off, sb.len - head_off, NULL);
+    for (int i = 0; i < num_ranges; i++) {
+        conn_queue(conn, sb.data + part_off[i], part_off[i + 1] - part_off[i], NULL);
+        queue_body(conn, rep, ranges[i].start, ranges[i].end);
+    }
+    conn_queue(conn, sb.data + part_off[num_ranges], head_off - part_off[num_ranges], NULL);
+    return APP_OK;
+}
+
+/// @brief answer a request for a representation: 304 if the client's copy
+/// is current, 206/416 for byte ranges, 200 otherwise; the caller's
+/// reference on the body is released
+void serve_representation(connection_t* conn, const http_request_t* request, const representation_t* rep) {
+    int vary = mime_is_compressible(rep->mime_type);
+    byte_range_t ranges[MAX_RANGES];
+    int num_ranges;
+
+    strbuf_t sb;
+    conn_builder(conn, &sb);
+    result_t ret = APP_OK;
+
+    if (http_not_modified(request, rep->validators)) {
+        conn->resp_status = 304;
+        conn->resp_bytes = 0;
+        sb_status_line(&sb, request->version, request->version_len, 304, "Not Modified");
+        sb_representation_headers(&sb, ENC_IDENTITY, vary, rep->validators);
+        sb_header(&sb, "Connection", conn->keep_alive ? "keep-alive" : "close");
+        sb_append(&sb, "\r\n", 2);
+        ret = conn_commit(conn, &sb);
+    } else if ((num_ranges = http_parse_ranges(request, rep->validators, rep->size, ranges)) < 0) {
+        conn->resp_status = 416;
+        conn->resp_bytes = 0;
+        sb_status_line(&sb, request->version, request->version_len, 416, "Range Not Satisfiable");
+        sb_header_u(&sb, "Content-Length", 0);
+        sb_puts(&sb, "Content-Range: bytes */");
+        sb_putu(&sb, rep->size);
+        sb_append(&sb, "\r\n", 2);
+        sb_header(&sb, "Connection", conn->keep_alive ? "keep-alive" : "close");
+        sb_append(&sb, "\r\n", 2);
+        ret = conn_commit(conn, &sb);
+    } else if (num_ranges == 0 || !IS_OK_APP(queue_partial(conn, request, rep, ranges, num_ranges))) {
+        conn->resp_status = 200;
+        conn->resp_bytes = rep->size;
+        sb_ok_head(&sb, request->version, request->version_len, rep->size, rep->mime_type,
+                   rep->encoding, vary, rep->validators, conn->keep_alive);
+        ret = conn_commit(conn, &sb);
+        if (IS_OK_APP(ret)) ret = queue_body(conn, rep, 0, rep->size);
+    }
+
+    if (!IS_OK_APP(ret)) conn->close_after_write = 1;
+
+    if (rep->entry) cache_entry_release(rep->entry);
+    else fd_entry_release(rep->file);
+}
+
+/// @brief queue a cached response, the connection takes over the reference
+void serve_cached(connection_t* conn, cache_entry_t* entry, const http_request_t* request) {
+    // 304s and ranges are built per request, from memory only
+    if (http_has_preconditions(request)) {
+        representation_t rep = {
+            entry->mime_type, entry->encoding, entry->size, &entry->validators, entry, NULL
+        };
+        serve_representation(conn, request, &rep);
+        return;
+    }
+
+    conn->resp_status = 200;
+    conn->resp_bytes = entry->size;
+
+    int v = cache_variant(request, conn->keep_alive);
+    if (!IS_OK_APP(conn_queue(conn, entry->headers[v], entry->headers_len[v], NULL)) ||
+        !IS_OK_APP(conn_queue(conn, entry->data, entry->size, entry))) {
+        cache_entry_release(entry);
+        conn->close_after_write = 1;
+    }
+}
+
+/// @brief queue a response for an open regular file whose body goes out
+/// with sendfile, the connection takes over the reference
+/// @param encoding what the file's bytes are encoded with
+result_t serve_sendfile(connection_t* conn, fd_entry_t* file, const http_request_t* request,
+                        const char* mime_type, content_encoding_t encoding) {
+    validators_t validators;
+    make_validators(&file->node.st, encoding, &validators);
+
+    representation_t rep = {
+        mime_type, encoding, file->node.st.st_size, &validators, NULL, file
+    };
+    serve_representation(conn, request, &rep);
+    return APP_OK;
+}
+
+/// @brief queue an encoded response for an open compressible file: a
+/// precompressed sibling if one is acceptable, else a body compressed once
+/// and cached; takes over the reference on success
+/// @param accepted bitmask from http_accept_encodings()
+/// @return APP_ERR if no acceptable encoding could be produced
+result_t serve_encoded(connection_t* conn, fd_entry_t* file, const http_request_t* request, int accepted) {
+    const char* mime_type = file->mime_type;
+
+    // siblings on disk first, large ones still go out with sendfile
+    for (int enc = ENC_KINDS - 1; enc > ENC_IDENTITY; enc--) {
+        if (!(accepted & file->siblings & (1 << enc))) continue;
+
+        char sibling_path[PATH_MAX_LEN];
+        int len = snprintf(sibling_path, sizeof(sibling_path), "%s%s", file->node.path, gEncodings[enc].suffix);
+        if (len < 0 || (size_t) len >= sizeof(sibling_path)) continue;
+
+        // removed since it was probed, try the next encoding
+        fd_entry_t* sibling = fd_cache_acquire(sibling_path);
+        if (!sibling) continue;
+        if (!S_ISREG(sibling->node.st.st_mode)) {
+            fd_entry_release(sibling);
+            continue;
+        }
+
+        cache_entry_t* entry = cache_insert(file->node.path, enc, sibling->fd, &sibling->node.st, mime_type);
+        fd_entry_release(file);
+        if (entry) {
+            table_remove(&gFdCache, &sibling->node);
+            fd_entry_release(sibling);
+            serve_cached(conn, entry, request);
+            return APP_OK;
+        }
+        return serve_sendfile(conn, sibling, request, mime_type, enc);
+    }
+
+    // no sibling, compress it ourselves (small files only), brotli if possible
+    content_encoding_t enc = (accepted & (1 << ENC_BR)) ? ENC_BR : ENC_GZIP;
+    cache_entry_t* entry = cache_insert_compressed(file->node.path, enc, file->fd, &file->node.st, mime_type);
+    if (!entry) return APP_ERR;
+
+    table_remove(&gFdCache, &file->node);
+    fd_entry_release(file);
+    serve_cached(conn, entry, request);
+    return APP_OK;
+}
+
+/// @brief queue a response for an open regular file, the connection
+/// takes over the reference
+/// @param accepted bitmask from http_accept_encodings()
+result_t serve_fd_entry(connection_t* conn, fd_entry_t* file, const http_request_t* request, int accepted) {
+    const char* mime_type = file->mime_type;
+    if (!mime_type) {
+        // not a supported MIME type
+        LOG_DEBUG("MIME-type of '%s' is not supported\n", file->node.path);
+        send_error(conn, 400, request);
+        fd_entry_release(file);
+        return APP_ERR;
+    }
+
+    if (accepted && mime_is_compressible(mime_type) && IS_OK_APP(serve_encoded(conn, file, request, accepted))) {
+        return APP_OK;
+    }
+
+    // small files are kept in memory instead, no need to pin a descriptor
+    cache_entry_t* entry = cache_insert(file->node.path, ENC_IDENTITY, file->fd, &file->node.st, mime_type);
+    if (entry) {
+        table_remove(&gFdCache, &file->node);
+        fd_entry_release(file);
+        serve_cached(conn, entry, request);
+        return APP_OK;
+    }
+
+    // queue headers, the body follows with sendfile
+    return serve_sendfile(conn, file, request, mime_type, ENC_IDENTITY);
+}
+
+/// @brief answer from the in-memory cache, preferring an encoded variant
+/// @param accepted bitmask from http_accept_encodings()
+/// @return APP_ERR on a miss
+result_t serve_from_cache(connection_t* conn, const char* path, const http_request_t* request, int accepted) {
+    if (accepted && !mime_is_compressible(get_mime_type(path))) accepted = 0;
+
+    cache_entry_t* entry = NULL;
+    for (int enc = ENC_KINDS - 1; enc > ENC_IDENTITY && !entry; enc--) {
+        if (accepted & (1 << enc)) entry = cache_lookup(path, enc);
+    }
+
+    // a client that takes an encoding no variant exists for yet misses,
+    // so the variant gets built instead of serving identity forever
+    if (!entry && !accepted) entry = cache_lookup(path, ENC_IDENTITY);
+    if (!entry) {
+        METRIC_ADD(file_cache_misses, 1);
+        return APP_ERR;
+    }
+    METRIC_ADD(file_cache_hits, 1);
+
+    serve_cached(conn, entry, request);
+    return APP_OK;
+}
+
+result_t serve_file(connection_t* conn, const char* full_path, const http_request_t* request, int accepted) {
+    // hot path: a hit costs no filesystem syscalls at all
+    if (IS_OK_APP(serve_from_cache(conn, full_path, request, accepted))) return APP_OK;
+
+    fd_entry_t* file = fd_cache_acquire(full_path);
+    if (!file || !S_ISREG(file->node.st.st_mode)) {
+        if (file) fd_entry_release(file);
+        LOG_DEBUG("entry at '%s' doesn't exist\n", full_path);
+        return APP_ERR;
+    }
+
+    return serve_fd_entry(conn, file, request, accepted);
+}
+
+/// @brief sum a counter over all workers
+/// @param offset offsetof() the counter in worker_metrics_t
+uint64_t metrics_total(size_t offset) {
+    uint64_t total = 0;
+    for (int i = 0; i < gNumMetrics; i++) {
+        total += atomic_load_explicit((metric_t*) ((char*) gMetrics[i] + offset), memory_order_relaxed);
+    }
+    return total;
+}
+
+#define METRICS_TOTAL(field) metrics_total(offsetof(worker_metrics_t, field))
+
+void sb_putf(strbuf_t* sb, double value) {
+    char digits[32];
+    int len = snprintf(digits, sizeof(digits), "%.9g", value);
+    sb_append(sb, digits, len > 0 ? (size_t) len : 0);
+}
+
+void sb_metric_help(strbuf_t* sb, const char* name, const char* type, const char* help) {
+    sb_puts(sb, "# HELP ");
+    sb_puts(sb, name);
+    sb_append(sb, " ", 1);
+    sb_puts(sb, help);
+    sb_puts(sb, "\n# TYPE ");
+    sb_puts(sb, name);
+    sb_append(sb, " ", 1);
+    sb_puts(sb, type);
+    sb_append(sb, "\n", 1);
+}
+
+/// @brief "<name>{<labels>} <value>\n", labels may be NULL
+void sb_metric(strbuf_t* sb, const char* name, const char* labels, uint64_t value) {
+    sb_puts(sb, name);
+    if (labels) {
+        sb_append(sb, "{", 1);
+        sb_puts(sb, labels);
+        sb_append(sb, "}", 1);
+    }
+    sb_append(sb, " ", 1);
+    sb_putu(sb, value);
+    sb_append(sb, "\n", 1);
+}
+
+void sb_metric_ratio(strbuf_t* sb, const char* name, const char* labels, uint64_t part, uint64_t whole) {
+    sb_puts(sb, name);
+    if (labels) {
+        sb_append(sb, "{", 1);
+        sb_puts(sb, labels);
+        sb_append(sb, "}", 1);
+    }
+    sb_append(sb, " ", 1);
+    sb_putf(sb, whole > 0 ? (double) part / whole : 0.0);
+    sb_append(sb, "\n", 1);
+}
+
+/// @brief export a nanosecond histogram in seconds, with one cumulative
+/// bucket per power of two from 128ns to 34s (both are HDR bucket edges)
+void sb_metric_histogram(strbuf_t* sb, const char* name, const char* help, size_t offset) {
+    uint64_t buckets[HIST_BUCKETS];
+    uint64_t sum = metrics_total(offset + offsetof(histogram_t, sum));
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        buckets[i] = metrics_total(offset + offsetof(histogram_t, buckets) + i * sizeof(metric_t));
+    }
+
+    sb_metric_help(sb, name, "histogram", help);
+
+    uint64_t cumulative = 0;
+    size_t idx = 0;
+    for (int octave = 7; octave <= 35; octave++) {
+        size_t limit = (size_t) (octave - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS;
+        while (idx < limit) cumulative += buckets[idx++];
+
+        sb_puts(sb, name);
+        sb_puts(sb, "_bucket{le=\"");
+        sb_putf(sb, (double) (1ULL << octave) / 1e9);
+        sb_puts(sb, "\"} ");
+        sb_putu(sb, cumulative);
+        sb_append(sb, "\n", 1);
+    }
+    while (idx < HIST_BUCKETS) cumulative += buckets[idx++];
+
+    // the count comes from the same snapshot as the buckets
+    sb_puts(sb, name);
+    sb_puts(sb, "_bucket{le=\"+Inf\"} ");
+    sb_putu(sb, cumulative);
+    sb_append(sb, "\n", 1);
+    sb_puts(sb, name);
+    sb_puts(sb, "_sum ");
+    sb_putf(sb, (double) sum / 1e9);
+    sb_append(sb, "\n", 1);
+    sb_puts(sb, name);
+    sb_puts(sb, "_count ");
+    sb_putu(sb, cumulative);
+    sb_append(sb, "\n", 1);
+}
+
+/// @brief queue the Prometheus text exposition of all workers' counters
+void serve_metrics(connection_t* conn, const http_request_t* request) {
+    // the body outgrows the arena, an unpublished cache entry owns it and
+    // is freed once written
+    cache_entry_t* body = calloc(1, sizeof(cache_entry_t));
+    if (body) body->blob = malloc(METRICS_BUFFER_SIZE);
+    if (!body || !body->blob) {
+        free(body);
+        send_error(conn, 500, request);
+        return;
+    }
+    body->node.destroy = cache_entry_destroy;
+    atomic_init(&body->node.refs, 1);
+
+    strbuf_t sb;
+    sb_init(&sb, body->blob, METRICS_BUFFER_SIZE);
+
+    uint64_t accepted = METRICS_TOTAL(connections_accepted);
+    uint64_t closed = METRICS_TOTAL(connections_closed);
+    sb_metric_help(&sb, "server_connections_accepted_total", "counter", "Client connections accepted.");
+    sb_metric(&sb, "server_connections_accepted_total", NULL, accepted);
+    sb_metric_help(&sb, "server_connections_closed_total", "counter", "Client connections closed.");
+    sb_metric(&sb, "server_connections_closed_total", NULL, closed);
+    sb_metric_help(&sb, "server_connections_active", "gauge", "Client connections currently open.");
+    sb_metric(&sb, "server_connections_active", NULL, accepted >= closed ? accepted - closed : 0);
+
+    sb_metric_help(&sb, "server_requests_total", "counter", "Requests answered, by status code.");
+    for (size_t i = 0; i < METRIC_STATUS_CODES; i++) {
+        char labels[32];
+        strbuf_t label_sb;
+        sb_init(&label_sb, labels, sizeof(labels) - 1);
+        sb_puts(&label_sb, "code=\"");
+        if (gMetricStatusCodes[i]) sb_putu(&label_sb, gMetricStatusCodes[i]);
+        else sb_puts(&label_sb, "other");
+        sb_puts(&label_sb, "\"");
+        labels[label_sb.len] = '\0';
+        sb_metric(&sb, "server_requests_total", labels,
+                  metrics_total(offsetof(worker_metrics_t, requests_by_status) + i * sizeof(metric_t)));
+    }
+
+    uint64_t requests = METRICS_TOTAL(requests);
+    uint64_t reused = METRICS_TOTAL(requests_reused);
+    sb_metric_help(&sb, "server_keepalive_reused_requests_total", "counter", "Requests that arrived on an already used connection.");
+    sb_metric(&sb, "server_keepalive_reused_requests_total", NULL, reused);
+    sb_metric_help(&sb, "server_keepalive_reuse_ratio", "gauge", "Share of requests served on a reused connection.");
+    sb_metric_ratio(&sb, "server_keepalive_reuse_ratio", NULL, reused, requests);
+
+    sb_metric_help(&sb, "server_sent_bytes_total", "counter", "Bytes written to clients, by system call.");
+    sb_metric(&sb, "server_sent_bytes_total", "method=\"sendfile\"", METRICS_TOTAL(bytes_sendfile));
+    sb_metric(&sb, "server_sent_bytes_total", "method=\"buffered\"", METRICS_TOTAL(bytes_buffered));
+    if (gNumRoutes > 0) sb_metric(&sb, "server_sent_bytes_total", "method=\"splice\"", METRICS_TOTAL(bytes_spliced));
+
+    // the reverse proxy, when routes are configured
+    if (gNumRoutes > 0) {
+        uint64_t upstream_requests = METRICS_TOTAL(upstream_requests);
+        uint64_t upstream_reused = METRICS_TOTAL(upstream_requests_reused);
+        sb_metric_help(&sb, "server_upstream_requests_total", "counter", "Requests sent to backends, by whether the connection was pooled.");
+        sb_metric(&sb, "server_upstream_requests_total", "connection=\"new\"", upstream_requests - upstream_reused);
+        sb_metric(&sb, "server_upstream_requests_total", "connection=\"reused\"", upstream_reused);
+        sb_metric_help(&sb, "server_upstream_failures_total", "counter", "Backend connects and responses that failed.");
+        sb_metric(&sb, "server_upstream_failures_total", NULL, METRICS_TOTAL(upstream_failures));
+
+        sb_metric_help(&sb, "server_upstream_backend_healthy", "gauge", "0 once a backend failed repeatedly, until it answers again.");
+        for (int i = 0; i < gNumBackends; i++) {
+            char labels[PROXY_NAME_MAX + 16];
+            strbuf_t label_sb;
+            sb_init(&label_sb, labels, sizeof(labels) - 1);
+            sb_puts(&label_sb, "backend=\"");
+            sb_puts(&label_sb, gBackends[i].name);
+            sb_puts(&label_sb, "\"");
+            labels[label_sb.len] = '\0';
+            sb_metric(&sb, "server_upstream_backend_healthy", labels,
+                      atomic_load_explicit(&gBackends[i].fails, memory_order_relaxed) < PROXY_MAX_FAILS);
+        }
+    }
+
+    // caches that are switched off have nothing to report
+    if (gFileCache.capacity > 0 || gFdCache.capacity > 0) {
+        uint64_t file_hits = METRICS_TOTAL(file_cache_hits);
+        uint64_t file_misses = METRICS_TOTAL(file_cache_misses);
+        uint64_t fd_hits = METRICS_TOTAL(fd_cache_hits);
+        uint64_t fd_misses = METRICS_TOTAL(fd_cache_misses);
+
+        sb_metric_help(&sb, "server_cache_lookups_total", "counter", "Cache lookups, by cache and outcome.");
+        if (gFileCache.capacity > 0) {
+            sb_metric(&sb, "server_cache_lookups_total", "cache=\"file\",result=\"hit\"", file_hits);
+            sb_metric(&sb, "server_cache_lookups_total", "cache=\"file\",result=\"miss\"", file_misses);
+        }
+        if (gFdCache.capacity > 0) {
+            sb_metric(&sb, "server_cache_lookups_total", "cache=\"fd\",result=\"hit\"", fd_hits);
+            sb_metric(&sb, "server_cache_lookups_total", "cache=\"fd\",result=\"miss\"", fd_misses);
+        }
+        sb_metric_help(&sb, "server_cache_hit_ratio", "gauge", "Share of cache lookups that hit.");
+        if (gFileCache.capacity > 0) sb_metric_ratio(&sb, "server_cache_hit_ratio", "cache=\"file\"", file_hits, file_hits + file_misses);
+        if (gFdCache.capacity > 0) sb_metric_ratio(&sb, "server_cache_hit_ratio", "cache=\"fd\"", fd_hits, fd_hits + fd_misses);
+    }
+
+    sb_metric_histogram(&sb, "server_request_parse_seconds", "Time spent parsing a complete request head.",
+                        offsetof(worker_metrics_t, parse_ns));
+    sb_metric_histogram(&sb, "server_time_to_first_byte_seconds", "From a request's first byte read to its response's first byte written.",
+                        offsetof(worker_metrics_t, ttfb_ns));
+    sb_metric_histogram(&sb, "server_response_seconds", "From a request's first byte read to its response's last byte written.",
+                        offsetof(worker_metrics_t, total_ns));
+
+    if (sb.overflow) {
+        cache_entry_release(body);
+        send_error(conn, 500, request);
+        return;
+    }
+
+    strbuf_t head;
+    conn_builder(conn, &head);
+    sb_status_line(&head, request->version, request->version_len, 200, "OK");
+    sb_header_u(&head, "Content-Length", sb.len);
+    sb_header(&head, "Content-Type", "text/plain; version=0.0.4");
+    sb_header(&head, "Cache-Control", "no-store");
+    sb_header(&head, "Connection", conn->keep_alive ? "keep-alive" : "close");
+    sb_append(&head, "\r\n", 2);
+
+    conn->resp_status = 200;
+    conn->resp_bytes = sb.len;
+    if (!IS_OK_APP(conn_commit(conn, &head)) || !IS_OK_APP(conn_queue(conn, sb.data, sb.len, body))) {
+        cache_entry_release(body);
+        conn->close_after_write = 1;
+    }
+}
+
+/// @brief resolve a parsed GET request and queue the response on the connection
+void handle_request(connection_t* conn, http_request_t* request) {
+    if (!slice_equals(request->method, request->method_len, "GET")) {
+        // method other than GET was requested
+        LOG_DEBUG("incompatible HTTP method: %.*s\n", (int) request->method_len, request->method);
+        send_error(conn, 405, request);
+        return;
+    } else if (!slice_equals(request->version, request->version_len, "HTTP/1.0") &&
+                !slice_equals(request->version, request->version_len, "HTTP/1.1")) {
+        LOG_DEBUG("incompatible HTTP version: %.*s\n", (int) request->version_len, request->version);
+        send_error(conn, 505, request);
+        return;
+    }
+
+    // canonical path under the document root, it can't point outside of it
+    // and is the key the index and caches are looked up by; the raw target
+    // stays as received for the access log
+    char full_path[PATH_MAX_LEN];
+    size_t root_len = strlen(DOCUMENT_ROOT);
+    memcpy(full_path, DOCUMENT_ROOT, root_len);
+
+    char* path = full_path + root_len;
+    ssize_t path_len = http_normalize_path(request->path, request->path_len, path, sizeof(full_path) - root_len);
+    if (path_len < 0) {
+        LOG_DEBUG("malformed request target: %.*s\n", (int) request->path_len, request->path);
+        send_error(conn, 400, request);
+        return;
+    }
+    path[path_len] = '\0';
+
+    if (gMetricsPath && strcmp(path, gMetricsPath) == 0) {
+        serve_metrics(conn, request);
+        return;
+    }
+
+    // AppleDouble metadata ("._name", or anything under such a directory)
+    // isn't content; the -I walk leaves it out as well
+    if (strstr(path, "/._")) {
+        LOG_DEBUG("'%s' is AppleDouble metadata\n", full_path);
+        send_error(conn, 404, request);
+        return;
+    }
+
+    // handle proper GET
+    int accepted = http_accept_encodings(request);
+
+    // an indexed document root answers unknown paths, unsupported types and
+    // directories from memory
+    const doc_index_t* index = atomic_load_explicit(&gDocIndex, memory_order_acquire);
+    if (index) {
+        const doc_entry_t* doc = doc_index_lookup(index, path, path_len);
+        if (!doc || (doc->is_dir && !doc->serve_off)) {
+            LOG_DEBUG("'%s' is not in the document root index\n", full_path);
+            send_error(conn, 404, request);
+            return;
+        } else if (!doc->mime_type) {
+            LOG_DEBUG("MIME-type of '%s' is not supported\n", full_path);
+            send_error(conn, 400, request);
+            return;
+        } else if (doc->is_dir) {
+            if (!IS_OK_APP(serve_file(conn, index->strings + doc->serve_off, request, accepted))) {
+                send_error(conn, 404, request);
+            }
+            return;
+        }
+    }
+
+    // cached files are answered before anything touches the filesystem
+    if (IS_OK_APP(serve_from_cache(conn, full_path, request, accepted))) return;
+
+    // look for path
+    fd_entry_t* file = fd_cache_acquire(full_path);
+    if (!file) {
+        if (errno == ENOENT || errno == ELOOP) {
+            // doesn't exist, or only through a symbolic link
+            LOG_DEBUG("entry at '%s' doesn't exist\n", full_path);
+            send_error(conn, 404, request);
+        } else if (errno == EACCES) {
+            // no permissions
+            LOG_DEBUG("insufficient permissions to access entry at '%s'\n", full_path);
+            send_error(conn, 403, request);
+        } else {
+            // generic error
+            LOG_DEBUG("could not handle entry at '%s'\n", full_path);
+            send_error(conn, 400, request);
+        }
+        return;
+    }
+
+    if (S_ISDIR(file->node.st.st_mode)) {
+        // the index.html / index.htm fallback was resolved when the entry was cached
+        LOG_DEBUG("client asked for '%s' (directory), trying '%s'\n", full_path, file->index_path);
+
+        if (file->index_path[0] == '\0' || !IS_OK_APP(serve_file(conn, file->index_path, request, accepted))) {
+            send_error(conn, 404, request);
+        }
+        fd_entry_release(file);
+    } else if (S_ISREG(file->node.st.st_mode)) {
+        serve_fd_entry(conn, file, request, accepted);
+    } else {
+        fd_entry_release(file);
+    }
+}
+
+/**
+ * ACCESS LOG
+ */
+
+/// @brief one request as written by a worker, formatted later by the drain thread
+typedef struct {
+    uint64_t timestamp_ns;  // wall clock when the response was queued
+    uint64_t latency_us;    // first byte of the request read -> response queued
+    uint64_t bytes;         // response body length
+    int status;
+    int worker;
+    int family;             // AF_INET / AF_INET6, 0 if unknown
+    uint8_t addr[16];
+    uint8_t method_len;
+    uint8_t version_len;
+    uint16_t path_len;
+    uint16_t referer_len;
+    uint16_t agent_len;
+    char method[16];
+    char version[16];
+    char path[LOG_PATH_MAX];
+    char referer[LOG_FIELD_MAX];
+    char user_agent[LOG_FIELD_MAX];
+} log_record_t;
+
+// longest line a record can format to (every byte escaped as \u00XX)
+#define LOG_LINE_MAX (6 * (LOG_PATH_MAX + 2 * LOG_FIELD_MAX + 32) + 512)
+
+/// @brief single-producer (worker) single-consumer (drain thread) ring;
+/// the indices only ever grow and each side's sits on its own cache line
+struct log_ring {
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t head;
+    size_t tail_cache;
+    atomic_size_t dropped;
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t tail;
+    _Alignas(CACHE_LINE_SIZE) log_record_t records[LOG_RING_SIZE];
+};
+
+static struct {
+    int fd; // -1 while disabled
+    log_format_t format;
+    log_ring_t* rings[MAX_WORKERS];
+    int num_rings;
+    pthread_t thread;
+    atomic_int stop;
+} gAccessLog = { .fd = -1 };
+
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+log_ring_t* log_ring_create(void) {
+    log_ring_t* ring = aligned_alloc(CACHE_LINE_SIZE, sizeof(log_ring_t));
+    if (!ring) return NULL;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->dropped, 0);
+    ring->tail_cache = 0;
+    return ring;
+}
+
+/// @brief copy a slice into a fixed-size record field, truncating
+size_t log_copy(char* dst, size_t cap, const char* src, size_t len) {
+    if (len > cap) len = cap;
+    memcpy(dst, src, len);
+    return len;
+}
+
+/// @brief claim the next record of a worker's ring, never blocks: when
+/// the drain thread falls behind the record is counted and dropped
+/// @return NULL if the ring is full
+log_record_t* access_log_reserve(log_ring_t* ring) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - ring->tail_cache >= LOG_RING_SIZE) {
+        ring->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head - ring->tail_cache >= LOG_RING_SIZE) {
+            atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+            return NULL;
+        }
+    }
+    return &ring->records[head % LOG_RING_SIZE];
+}
+
+/// @brief who asked for what: peer, worker and the request's fields
+/// @param request NULL if the head couldn't be parsed
+void access_log_fill(log_record_t* record, const connection_t* conn, const http_request_t* request) {
+    record->worker = conn->worker->id;
+
+    record->family = conn->peer.sa.sa_family;
+    if (record->family == AF_INET) {
+        memcpy(record->addr, &conn->peer.in.sin_addr, 4);
+    } else if (record->family == AF_INET6) {
+        memcpy(record->addr, &conn->peer.in6.sin6_addr, 16);
+    }
+
+    record->method_len = record->version_len = 0;
+    record->path_len = record->referer_len = record->agent_len = 0;
+    if (request) {
+        record->method_len = log_copy(record->method, sizeof(record->method), request->method, request->method_len);
+        record->version_len = log_copy(record->version, sizeof(record->version), request->version, request->version_len);
+        record->path_len = log_copy(record->path, sizeof(record->path), request->path, request->path_len);
+
+        const http_header_t* referer = http_get_header(request, HDR_REFERER);
+        if (referer) record->referer_len = log_copy(record->referer, sizeof(record->referer), referer->value, referer->value_len);
+        const http_header_t* agent = http_get_header(request, HDR_USER_AGENT);
+        if (agent) record->agent_len = log_copy(record->user_agent, sizeof(record->user_agent), agent->value, agent->value_len);
+    }
+}
+
+/// @brief stamp the outcome onto the record access_log_reserve() returned
+/// and hand it to the drain thread
+void access_log_commit(log_ring_t* ring, log_record_t* record, uint64_t request_start, int status, uint64_t bytes) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    record->timestamp_ns = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+    record->latency_us = (monotonic_ns() - request_start) / 1000;
+    record->bytes = bytes;
+    record->status = status;
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/// @brief record the response just queued for a request
+/// @param request NULL if the head couldn't be parsed
+void access_log(connection_t* conn, const http_request_t* request) {
+    log_ring_t* ring = conn->worker->log_ring;
+    log_record_t* record = ring ? access_log_reserve(ring) : NULL;
+    if (!record) return;
+
+    access_log_fill(record, conn, request);
+    access_log_commit(ring, record, conn->request_start, conn->resp_status, conn->resp_bytes);
+}
+
+/// @brief append untrusted bytes inside a quoted field; quotes, backslashes
+/// and anything non-printable are escaped (\xHH in combined, \u00HH in JSON)
+void sb_escaped(strbuf_t* sb, const char* str, size_t len, log_format_t format) {
+    static const char hex[16] = "0123456789abcdef";
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char) str[i];
+        if (c == '"' || c == '\\') {
+            char escaped[2] = { '\\', (char) c };
+            sb_append(sb, escaped, 2);
+        } else if (c < 0x20 || c >= 0x7f) {
+            sb_puts(sb, format == LOG_FORMAT_JSON ? "\\u00" : "\\x");
+            char digits[2] = { hex[c >> 4], hex[c & 0xf] };
+            sb_append(sb, digits, 2);
+        } else {
+            sb_append(sb, (const char*) &c, 1);
+        }
+    }
+}
+
+/// @brief format one record as a line, called by the drain thread only
+void log_format_record(strbuf_t* sb, const log_record_t* record, log_format_t format) {
+    // consecutive records mostly share a second, format its time once
+    static time_t cached_sec = -1;
+    static log_format_t cached_format;
+    static char cached_time[64];
+    time_t sec = record->timestamp_ns / 1000000000ULL;
+    if (sec != cached_sec || format != cached_format) {
+        struct tm tm;
+        if (format == LOG_FORMAT_JSON) {
+            gmtime_r(&sec, &tm);
+            strftime(cached_time, sizeof(cached_time), "%Y-%m-%dT%H:%M:%S", &tm);
+        } else {
+            localtime_r(&sec, &tm);
+            strftime(cached_time, sizeof(cached_time), "%d/%b/%Y:%H:%M:%S %z", &tm);
+        }
+        cached_sec = sec;
+        cached_format = format;
+    }
+
+    char remote[INET6_ADDRSTRLEN] = "-";
+    if (record->family == AF_INET || record->family == AF_INET6) {
+        inet_ntop(record->family, record->addr, remote, sizeof(remote));
+    }
+
+    if (format == LOG_FORMAT_JSON) {
+        unsigned millis = (record->timestamp_ns / 1000000ULL) % 1000;
+        char fraction[5] = { '.', '0' + millis / 100, '0' + millis / 10 % 10, '0' + millis % 10, 'Z' };
+
+        sb_puts(sb, "{\"time\":\"");
+        sb_puts(sb, cached_time);
+        sb_append(sb, fraction, sizeof(fraction));
+        sb_puts(sb, "\",\"remote\":\"");
+        sb_puts(sb, remote);
+        sb_puts(sb, "\",\"method\":\"");
+        sb_escaped(sb, record->method, record->method_len, format);
+        sb_puts(sb, "\",\"path\":\"");
+        sb_escaped(sb, record->path, record->path_len, format);
+        sb_puts(sb, "\",\"version\":\"");
+        sb_escaped(sb, record->version, record->version_len, format);
+        sb_puts(sb, "\",\"status\":");
+        sb_putu(sb, record->status);
+        sb_puts(sb, ",\"bytes\":");
+        sb_putu(sb, record->bytes);
+        sb_puts(sb, ",\"latency_us\":");
+        sb_putu(sb, record->latency_us);
+        sb_puts(sb, ",\"worker\":");
+        sb_putu(sb, record->worker);
+        sb_puts(sb, ",\"referer\":\"");
+        sb_escaped(sb, record->referer, record->referer_len, format);
+        sb_puts(sb, "\",\"user_agent\":\"");
+        sb_escaped(sb, record->user_agent, record->agent_len, format);
+        sb_puts(sb, "\"}\n");
+        return;
+    }
+
+    // host ident authuser [date] "request" status bytes "referer" "user-agent"
+    sb_puts(sb, remote);
+    sb_puts(sb, " - - [");
+    sb_puts(sb, cached_time);
+    sb_puts(sb, "] \"");
+    sb_escaped(sb, record->method, record->method_len, format);
+    sb_append(sb, " ", 1);
+    sb_escaped(sb, record->path, record->path_len, format);
+    sb_append(sb, " ", 1);
+    sb_escaped(sb, record->version, record->version_len, format);
+    sb_puts(sb, "\" ");
+    sb_putu(sb, record->status);
+    sb_append(sb, " ", 1);
+    if (record->bytes > 0) sb_putu(sb, record->bytes);
+    else sb_append(sb, "-", 1);
+    sb_puts(sb, " \"");
+    if (record->referer_len > 0) sb_escaped(sb, record->referer, record->referer_len, format);
+    else sb_append(sb, "-", 1);
+    sb_puts(sb, "\" \"");
+    if (record->agent_len > 0) sb_escaped(sb, record->user_agent, record->agent_len, format);
+    else sb_append(sb, "-", 1);
+    sb_puts(sb, "\"\n");
+}
+
+/// @brief write a whole buffer to the access log, giving up on errors
+void log_write(const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(gAccessLog.fd, data, len);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return;
+        data += written;
+        len -= written;
+    }
+}
+
+/// @brief background thread: move records from every worker's ring into
+/// large write() batches, sleeping while there is nothing to do
+void* log_drain_func(void* arg) {
+    char* buffer = malloc(LOG_WRITE_BUFFER);
+    if (!buffer) return NULL;
+
+    strbuf_t sb;
+    sb_init(&sb, buffer, LOG_WRITE_BUFFER);
+
+    for (;;) {
+        // workers have exited once stop is set, so this pass is the last
+        int stopping = atomic_load(&gAccessLog.stop);
+        size_t drained = 0;
+
+        for (int i = 0; i < gAccessLog.num_rings; i++) {
+            log_ring_t* ring = gAccessLog.rings[i];
+            if (!ring) continue;
+
+            size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+            while (tail != head) {
+                if (sb.cap - sb.len < LOG_LINE_MAX) {
+                    log_write(sb.data, sb.len);
+                    sb_init(&sb, buffer, LOG_WRITE_BUFFER);
+
+                    // hand the formatted slots back early
+                    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+                }
+                log_format_record(&sb, &ring->records[tail % LOG_RING_SIZE], gAccessLog.format);
+                tail++;
+                drained++;
+            }
+            atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        }
+
+        if (sb.len > 0) {
+            log_write(sb.data, sb.len);
+            sb_init(&sb, buffer, LOG_WRITE_BUFFER);
+        }
+
+        if (stopping) break;
+        if (drained == 0) {
+            struct timespec interval = { 0, LOG_DRAIN_INTERVAL_MS * 1000000L };
+            nanosleep(&interval, NULL);
+        }
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+/// @brief open the access log, "-" is stdout
+result_t access_log_open(const char* path) {
+    gAccessLog.fd = strcmp(path, "-") == 0 ? STDOUT_FILENO :
+        open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    return gAccessLog.fd < 0 ? APP_ERR : APP_OK;
+}
+
+/// @brief flush whatever the workers left behind and release the rings,
+/// called once every worker has been joined
+void access_log_close(void) {
+    if (gAccessLog.fd < 0) return;
+
+    atomic_store(&gAccessLog.stop, 1);
+    pthread_join(gAccessLog.thread, NULL);
+
+    size_t dropped = 0;
+    for (int i = 0; i < gAccessLog.num_rings; i++) {
+        if (!gAccessLog.rings[i]) continue;
+        dropped += atomic_load(&gAccessLog.rings[i]->dropped);
+        free(gAccessLog.rings[i]);
+    }
+    if (dropped > 0) LOG_WARN("access log dropped %zu records\n", dropped);
+
+    if (gAccessLog.fd != STDOUT_FILENO) close(gAccessLog.fd);
+    gAccessLog.fd = -1;
+}
+
+/**
+ * REVERSE PROXY
+ */
+
+/// @brief a connection to a backend, pooled by its worker between
+/// requests, and the exchange running on it: the request as it is written
+/// and the response as it is read and passed on to the client
+struct upstream {
+    int fd;                 // -1 while on the free list
+    int backend;            // gBackends index fd is connected to
+    upstream_state_t state;
+    connection_t* client;   // NULL while pooled or free
+    upstream_t* next;       // idle or free list link
+
+    // the route, backends that failed this request, connections tried,
+    // whether it counts towards the backend's outstanding requests and
+    // whether fd came from the pool; after a pooled connection turned out
+    // closed by the backend, only fresh ones are tried
+    int route;
+    uint64_t tried;
+    int attempts;
+    int outstanding;
+    int reused;
+    int fresh;
+
+    // the client spoke HTTP/1.0 (chunked framing is stripped and the body
+    // ends with the connection) or sent HEAD (no body, whatever the head says)
+    int http10;
+    int head_only;
+
+    // response framing: body bytes (or bytes of the current chunk) still
+    // to come, UINT64_MAX for a body that ends with the connection; keep
+    // is whether the connection can be pooled afterwards
+    int chunked;
+    int keep;
+    uint64_t body_left;
+
+    // access log and metrics, recorded once the response is complete
+    uint64_t request_start;
+    int status;
+    uint64_t bytes;
+    log_record_t log;
+
+    // out holds the request, then the client's response head; response
+    // bytes read but not yet forwarded are [in_start, in_len)
+    size_t out_len;
+    size_t out_sent;
+    size_t in_start;
+    size_t in_len;
+    char out[UPSTREAM_BUFFER_SIZE];
+    char in[UPSTREAM_BUFFER_SIZE];
+};
+
+/// @brief add a -R route, "<prefix>=<host>:<port>[,<host>:<port>...]"
+/// @return APP_ERR if the spec is malformed or a backend doesn't resolve
+result_t proxy_route_add(const char* spec) {
+    const char* eq = strchr(spec, '=');
+    if (!eq || spec[0] != '/' || (size_t) (eq - spec) >= PROXY_PREFIX_MAX || gNumRoutes == PROXY_MAX_ROUTES) {
+        return APP_ERR;
+    }
+
+    // "/api/" routes the same paths as "/api"
+    proxy_route_t* route = &gRoutes[gNumRoutes];
+    route->prefix_len = eq - spec;
+    memcpy(route->prefix, spec, route->prefix_len);
+    while (route->prefix_len > 1 && route->prefix[route->prefix_len - 1] == '/') route->prefix_len--;
+    route->prefix[route->prefix_len] = '\0';
+    route->first_backend = gNumBackends;
+    route->num_backends = 0;
+
+    for (const char* p = eq + 1; *p; ) {
+        const char* end = strchrnul(p, ',');
+        size_t len = end - p;
+        const char* colon = memrchr(p, ':', len);
+        if (!colon || colon == p || len >= PROXY_NAME_MAX || gNumBackends == PROXY_MAX_BACKENDS) return APP_ERR;
+
+        // an IPv6 address is bracketed, "[::1]:8080"
+        char host[PROXY_NAME_MAX];
+        char port[16];
+        const char* host_start = p;
+        size_t host_len = colon - p;
+        if (host_len > 2 && p[0] == '[' && colon[-1] == ']') {
+            host_start++;
+            host_len -= 2;
+        }
+        size_t port_len = end - colon - 1;
+        if (port_len == 0 || port_len >= sizeof(port)) return APP_ERR;
+        memcpy(host, host_start, host_len);
+        host[host_len] = '\0';
+        memcpy(port, colon + 1, port_len);
+        port[port_len] = '\0';
+
+        struct addrinfo hints, *res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (!IS_OK_SYS(getaddrinfo(host, port, &hints, &res)) || !res) return APP_ERR;
+
+        backend_t* backend = &gBackends[gNumBackends++];
+        memcpy(&backend->addr, res->ai_addr, res->ai_addrlen);
+        backend->addr_len = res->ai_addrlen;
+        freeaddrinfo(res);
+        memcpy(backend->name, p, len);
+        backend->name[len] = '\0';
+        route->num_backends++;
+
+        p = *end ? end + 1 : end;
+    }
+    if (route->num_backends == 0) return APP_ERR;
+
+    gNumRoutes++;
+    return APP_OK;
+}
+
+/// @brief the route with the longest prefix covering the path, in whole
+/// segments: "/api" takes "/api" and "/api/v1" but not "/apis"
+const proxy_route_t* proxy_route_match(const char* path, size_t len) {
+    const proxy_route_t* best = NULL;
+    for (int i = 0; i < gNumRoutes; i++) {
+        const proxy_route_t* route = &gRoutes[i];
+        size_t n = route->prefix_len;
+        if (n > len || memcmp(path, route->prefix, n) != 0) continue;
+        if (n > 1 && n < len && path[n] != '/') continue;
+        if (!best || n > best->prefix_len) best = route;
+    }
+    return best;
+}
+
+/// @brief fields that describe one connection and are never forwarded
+static inline int header_hop_by_hop(header_id_t id) {
+    return id == HDR_CONNECTION || id == HDR_KEEP_ALIVE || id == HDR_PROXY_CONNECTION || id == HDR_TE ||
+        id == HDR_TRAILER || id == HDR_TRANSFER_ENCODING || id == HDR_UPGRADE;
+}
+
+/// @brief whether the message's Connection fields name this field, which
+/// makes it hop-by-hop as well (RFC 9110 7.6.1)
+int header_connection_listed(const http_request_t* message, const http_header_t* header) {
+    for (size_t i = 0; i < message->num_headers; i++) {
+        const http_header_t* connection = &message->headers[i];
+        if (connection->id != HDR_CONNECTION) continue;
+
+        const char* p = connection->value;
+        const char* end = connection->value + connection->value_len;
+        while (p < end) {
+            // a comma-separated list of field names
+            const char* token_end = memchr(p, ',', end - p);
+            if (!token_end) token_end = end;
+            while (p < token_end && (*p == ' ' || *p == '\t')) p++;
+            const char* token = p;
+            p = token_end;
+            while (p > token && (p[-1] == ' ' || p[-1] == '\t')) p--;
+
+            size_t token_len = p - token;
+            if (token_len == header->name_len && strncasecmp(token, header->name, token_len) == 0) return 1;
+            p = token_end + 1;
+        }
+    }
+    return 0;
+}
+
+/// @brief a connect or a response failed; PROXY_MAX_FAILS in a row take the
+/// backend out of rotation for PROXY_RETRY_MS, after which it gets requests
+/// again and the next failure takes it out again
+void backend_failed(int index) {
+    backend_t* backend = &gBackends[index];
+    METRIC_ADD(upstream_failures, 1);
+    if (atomic_fetch_add_explicit(&backend->fails, 1, memory_order_relaxed) + 1 < PROXY_MAX_FAILS) return;
+
+    uint64_t until = monotonic_ns() + PROXY_RETRY_MS * 1000000ull;
+    if (atomic_exchange_explicit(&backend->down_until, until, memory_order_relaxed) == 0) {
+        LOG_WARN("backend %s is down, retrying in %d ms\n", backend->name, PROXY_RETRY_MS);
+    }
+}
+
+/// @brief a response head arrived, the backend is healthy
+void backend_ok(int index) {
+    backend_t* backend = &gBackends[index];
+    if (atomic_load_explicit(&backend->fails, memory_order_relaxed) == 0) return;
+
+    atomic_store_explicit(&backend->fails, 0, memory_order_relaxed);
+    if (atomic_exchange_explicit(&backend->down_until, 0, memory_order_relaxed) != 0) {
+        LOG_INFO("backend %s is back up\n", backend->name);
+    }
+}
+
+/// @brief least outstanding requests among the route's backends that are
+/// in rotation and haven't failed this request, ties taken round robin
+/// @return gBackends index, -1 if none is left
+int backend_pick(worker_t* w, const proxy_route_t* route, uint64_t tried) {
+    uint64_t now = 0;
+    int best = -1;
+    int best_load = INT_MAX;
+    unsigned turn = w->up_turn++;
+    for (int i = 0; i < route->num_backends; i++) {
+        int index = route->first_backend + (int) ((turn + i) % route->num_backends);
+        backend_t* backend = &gBackends[index];
+        if (tried & (1ull << index)) continue;
+
+        uint64_t down_until = atomic_load_explicit(&backend->down_until, memory_order_relaxed);
+        if (down_until) {
+            if (now == 0) now = monotonic_ns();
+            if (now < down_until) continue;
+        }
+
+        int load = atomic_load_explicit(&backend->outstanding, memory_order_relaxed);
+        if (load < best_load) {
+            best = index;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+/// @brief an upstream object from the worker's free list, or a new one
+upstream_t* upstream_alloc(worker_t* w) {
+    upstream_t* up = w->up_free;
+    if (up) w->up_free = up->next;
+    else if (!(up = malloc(sizeof(upstream_t)))) return NULL;
+
+    up->fd = -1;
+    up->client = NULL;
+    up->outstanding = 0;
+    up->reused = 0;
+    return up;
+}
+
+/// @brief close the connection and keep the object; objects are only freed
+/// with their worker, so an event still queued for a closed one finds it
+/// on the free list rather than freed memory
+void upstream_release(worker_t* w, upstream_t* up) {
+    if (up->fd >= 0) close(up->fd);
+    up->fd = -1;
+    up->client = NULL;
+    up->next = w->up_free;
+    w->up_free = up;
+}
+
+/// @brief a pooled connection to the backend, the most recently used first
+upstream_t* upstream_idle_take(worker_t* w, int backend) {
+    upstream_t* up = w->up_idle[backend];
+    if (!up) return NULL;
+    w->up_idle[backend] = up->next;
+    w->up_idle_cnt[backend]--;
+    return up;
+}
+
+/// @brief pool a connection whose response was read in full, unless the
+/// backend's pool is full
+void upstream_park(worker_t* w, upstream_t* up) {
+    if (w->up_idle_cnt[up->backend] >= PROXY_IDLE_MAX) {
+        upstream_release(w, up);
+        return;
+    }
+    up->state = UP_IDLE;
+    up->client = NULL;
+    up->next = w->up_idle[up->backend];
+    w->up_idle[up->backend] = up;
+    w->up_idle_cnt[up->backend]++;
+}
+
+/// @brief readiness on a pooled connection: the backend closed it, or sent
+/// something nobody asked for; either way it can't carry a request
+void upstream_idle_event(worker_t* w, upstream_t* up) {
+    if (up->fd < 0 || up->client) return;
+
+    char byte;
+    ssize_t peeked = recv(up->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (peeked < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+
+    upstream_t** link = &w->up_idle[up->backend];
+    while (*link && *link != up) link = &(*link)->next;
+    if (*link) {
+        *link = up->next;
+        w->up_idle_cnt[up->backend]--;
+    }
+    upstream_release(w, up);
+}
+
+/// @brief close the pooled connections and free every upstream object,
+/// once the worker's clients (and with them their exchanges) are gone
+void upstream_pool_free(worker_t* w) {
+    for (int i = 0; i < gNumBackends; i++) {
+        while (w->up_idle[i]) upstream_release(w, upstream_idle_take(w, i));
+    }
+    while (w->up_free) {
+        upstream_t* up = w->up_free;
+        w->up_free = up->next;
+        free(up);
+    }
+}
+
+/// @brief start a non-blocking connect and watch the socket, completion
+/// shows as the first send going through
+/// @return APP_ERR if it failed outright, e.g. refused on loopback
+result_t upstream_open(worker_t* w, upstream_t* up, int backend) {
+    const backend_t* b = &gBackends[backend];
+    int fd = socket(b->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return APP_ERR;
+
+    // requests are written in one piece, Nagle would only hold them back
+    int yes_nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes_nodelay, sizeof(yes_nodelay));
+    if (connect(fd, (const struct sockaddr*) &b->addr, b->addr_len) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return APP_ERR;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.u64 = (uintptr_t) up | UPSTREAM_TAG;
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        close(fd);
+        return APP_ERR;
+    }
+
+    up->fd = fd;
+    up->backend = backend;
+    up->reused = 0;
+    return APP_OK;
+}
+
+/// @brief connect the exchange to `backend`, or (-1) to the least loaded
+/// backend of its route left to try; a pooled connection is preferred
+/// unless the last one turned out stale
+/// @return APP_ERR once no backend is left
+result_t proxy_connect(worker_t* w, upstream_t* up, int backend) {
+    for (;;) {
+        if (backend < 0) backend = backend_pick(w, &gRoutes[up->route], up->tried);
+        if (backend < 0) return APP_ERR;
+
+        upstream_t* idle = up->fresh ? NULL : upstream_idle_take(w, backend);
+        if (idle) {
+            // the pooled socket moves over to this exchange's object
+            struct epoll_event ev;
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.u64 = (uintptr_t) up | UPSTREAM_TAG;
+            if (epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, idle->fd, &ev) < 0) {
+                upstream_release(w, idle);
+                continue;
+            }
+            up->fd = idle->fd;
+            up->backend = backend;
+            up->reused = 1;
+            idle->fd = -1;
+            upstream_release(w, idle);
+            return APP_OK;
+        }
+
+        if (IS_OK_APP(upstream_open(w, up, backend))) return APP_OK;
+
+        // running out of descriptors is ours to fix, not the backend's
+        if (errno == EMFILE || errno == ENFILE) return APP_ERR;
+        backend_failed(backend);
+        up->tried |= 1ull << backend;
+        backend = -1;
+    }
+}
+
+/// @brief the connection is about to carry the request
+void upstream_begin(upstream_t* up) {
+    up->state = UP_SENDING;
+    up->out_sent = 0;
+    up->in_start = up->in_len = 0;
+    up->outstanding = 1;
+    atomic_fetch_add_explicit(&gBackends[up->backend].outstanding, 1, memory_order_relaxed);
+
+    METRIC_ADD(upstream_requests, 1);
+    if (up->reused) METRIC_ADD(upstream_requests_reused, 1);
+}
+
+void upstream_end(upstream_t* up) {
+    if (!up->outstanding) return;
+    up->outstanding = 0;
+    atomic_fetch_sub_explicit(&gBackends[up->backend].outstanding, 1, memory_order_relaxed);
+}
+
+/// @brief the request as the backend gets it: same method and target over
+/// HTTP/1.1 on a persistent connection, without hop-by-hop fields or a
+/// body, and the client's address appended to X-Forwarded-For
+/// @return APP_ERR if it doesn't fit the upstream buffer
+result_t proxy_build_request(upstream_t* up, int backend, const connection_t* conn, const http_request_t* request) {
+    strbuf_t sb;
+    sb_init(&sb, up->out, sizeof(up->out));
+    sb_append(&sb, request->method, request->method_len);
+    sb_append(&sb, " ", 1);
+    sb_append(&sb, request->path, request->path_len);
+    sb_puts(&sb, " HTTP/1.1\r\n");
+
+    for (size_t i = 0; i < request->num_headers; i++) {
+        const http_header_t* header = &request->headers[i];
+        if (header_hop_by_hop(header->id) || header->id == HDR_CONTENT_LENGTH || header->id == HDR_X_FORWARDED_FOR ||
+            header_connection_listed(request, header)) {
+            continue;
+        }
+        sb_append(&sb, header->name, header->name_len);
+        sb_append(&sb, ": ", 2);
+        sb_append(&sb, header->value, header->value_len);
+        sb_append(&sb, "\r\n", 2);
+    }
+    if (!http_get_header(request, HDR_HOST)) sb_header(&sb, "Host", gBackends[backend].name);
+
+    char addr[INET6_ADDRSTRLEN] = "unknown";
+    if (conn->peer.sa.sa_family == AF_INET) inet_ntop(AF_INET, &conn->peer.in.sin_addr, addr, sizeof(addr));
+    else if (conn->peer.sa.sa_family == AF_INET6) inet_ntop(AF_INET6, &conn->peer.in6.sin6_addr, addr, sizeof(addr));
+
+    sb_puts(&sb, "X-Forwarded-For: ");
+    for (size_t i = 0; i < request->num_headers; i++) {
+        const http_header_t* header = &request->headers[i];
+        if (header->id != HDR_X_FORWARDED_FOR) continue;
+        sb_append(&sb, header->value, header->value_len);
+        sb_append(&sb, ", ", 2);
+    }
+    sb_puts(&sb, addr);
+    sb_append(&sb, "\r\n", 2);
+
+    sb_header(&sb, "Connection", "keep-alive");
+    sb_append(&sb, "\r\n", 2);
+    up->out_len = sb.len;
+    return sb.overflow ? APP_ERR : APP_OK;
+}
+
+/// @brief hand a GET or HEAD under a routed prefix to a backend, whose
+/// response proxy_pump() passes on as it arrives
+/// @return 0 if the request isn't proxied and is served locally
+int proxy_request(connection_t* conn, const http_request_t* request) {
+    if (gNumRoutes == 0) return 0;
+
+    // other methods and versions get their 405 / 505 from handle_request()
+    int head_only = slice_equals(request->method, request->method_len, "HEAD");
+    int http10 = slice_equals(request->version, request->version_len, "HTTP/1.0");
+    if ((!head_only && !slice_equals(request->method, request->method_len, "GET")) ||
+        (!http10 && !slice_equals(request->version, request->version_len, "HTTP/1.1"))) {
+        return 0;
+    }
+
+    // routed by the canonical path, the target is forwarded as received
+    char path[PATH_MAX_LEN];
+    ssize_t path_len = http_normalize_path(request->path, request->path_len, path, sizeof(path));
+    if (path_len < 0) return 0;
+    path[path_len] = '\0';
+    const proxy_route_t* route = proxy_route_match(path, path_len);
+    if (!route || (gMetricsPath && strcmp(path, gMetricsPath) == 0)) return 0;
+
+    worker_t* w = conn->worker;
+    int backend = backend_pick(w, route, 0);
+    if (backend < 0) {
+        LOG_DEBUG("no backend left for %s\n", path);
+        send_error(conn, 502, request);
+        return 1;
+    }
+
+    // a pooled connection to the least loaded backend is used as is
+    upstream_t* up = upstream_idle_take(w, backend);
+    if (up) {
+        up->reused = 1;
+    } else if (!(up = upstream_alloc(w))) {
+        send_error(conn, 500, request);
+        return 1;
+    }
+
+    // built before connecting: a request that doesn't fit costs no
+    // connection, a pooled one goes back to the pool
+    if (!IS_OK_APP(proxy_build_request(up, backend, conn, request))) {
+        if (up->reused) upstream_park(w, up);
+        else upstream_release(w, up);
+        send_error(conn, 431, request);
+        return 1;
+    }
+
+    up->route = route - gRoutes;
+    up->tried = 0;
+    up->attempts = 1;
+    up->fresh = 0;
+    up->http10 = http10;
+    up->head_only = head_only;
+    up->request_start = conn->request_start;
+    up->status = 0;
+    up->bytes = 0;
+    if (up->fd < 0 && !IS_OK_APP(proxy_connect(w, up, backend))) {
+        LOG_DEBUG("no backend left for %s\n", path);
+        upstream_release(w, up);
+        send_error(conn, 502, request);
+        return 1;
+    }
+
+    // the request's fields go with it, its slices of the receive buffer don't
+    if (w->log_ring) access_log_fill(&up->log, conn, request);
+
+    upstream_begin(up);
+    up->client = conn;
+    conn->proxy = up;
+    return 1;
+}
+
+/// @brief the backend failed before the response began, try again: on a
+/// fresh connection if a pooled one had been closed under us, on another
+/// backend if this one failed
+/// @param stale whether the failure was a pooled connection closed by the backend
+/// @return APP_ERR once attempts or backends run out
+result_t proxy_retry(connection_t* conn, int stale) {
+    upstream_t* up = conn->proxy;
+    upstream_end(up);
+    close(up->fd);
+    up->fd = -1;
+
+    if (stale) {
+        up->fresh = 1;
+    } else {
+        backend_failed(up->backend);
+        up->tried |= 1ull << up->backend;
+    }
+    if (up->attempts++ >= PROXY_MAX_ATTEMPTS || !IS_OK_APP(proxy_connect(conn->worker, up, -1))) return APP_ERR;
+
+    upstream_begin(up);
+    return APP_OK;
+}
+
+/// @brief the client goes away mid-exchange, so does the upstream connection
+void proxy_abort(connection_t* conn) {
+    upstream_t* up = conn->proxy;
+    conn->proxy = NULL;
+    upstream_end(up);
+    upstream_release(conn->worker, up);
+}
+
+/**
+ * REQUEST FRAMING
+ */
+
+// request heads up to this size fit the large receive tier (431 beyond),
+// bodies up to this size are read and dropped (413 beyond)
+static size_t gMaxHeaderSize = DEFAULT_MAX_HEADER_SIZE;
+static size_t gMaxBodySize = DEFAULT_MAX_BODY_SIZE;
+
+/// @brief count the response just queued for a request and mark its first
+/// and last segments for the latency histograms
+/// @param first_seg segment count before the response was queued
+void conn_finish_response(connection_t* conn, int first_seg) {
+    if (conn->seg_cnt > first_seg) {
+        conn->segs[first_seg].ttfb_start = conn->request_start;
+        conn->segs[conn->seg_cnt - 1].done_start = conn->request_start;
+    }
+
+    METRIC_ADD(requests, 1);
+    if (conn->requests++ > 0) METRIC_ADD(requests_reused, 1);
+    METRIC_ADD(requests_by_status[metric_status_index(conn->resp_status)], 1);
+}
+
+/// @brief frame and handle at most one request from the receive buffer
+/// @return 1 if a request was consumed, 0 if more bytes are needed
+int conn_process_one(connection_t* conn) {
+    // body bytes of an already answered request are dropped as they arrive
+    if (conn->discard > 0) {
+        size_t skip = conn->buffer_len - conn->buffer_start;
+        if (skip > conn->discard) skip = conn->discard;
+        conn->buffer_start += skip;
+        conn->discard -= skip;
+        if (conn->discard > 0) return 0;
+    }
+
+    char* buffer = conn->buffer + conn->buffer_start;
+    size_t buffer_len = conn->buffer_len - conn->buffer_start;
+    size_t total_size;
+
+    http_request_t request;
+    uint64_t parse_start = monotonic_ns();
+    ssize_t eoh = http_parse_request(buffer, buffer_len, &conn->scan_pos, &request);
+    if (eoh > 0) hist_record(&tMetrics->parse_ns, monotonic_ns() - parse_start);
+
+    int first_seg = conn->seg_cnt;
+
+    // no complete headers, need more bytes unless the head is already too large
+    if (eoh == 0 && buffer_len < gMaxHeaderSize) return 0;
+
+    if (eoh <= 0) {
+        // can't tell where the next request starts, give up on the connection
+        int status = eoh == 0 ? 431 : 400;
+        LOG_DEBUG(eoh == 0 ? "request head too large\n" : "malformed request head\n");
+        conn->keep_alive = 0;
+        send_error(conn, status, NULL);
+        conn_finish_response(conn, first_seg);
+        access_log(conn, NULL);
+        conn->close_after_write = 1;
+        total_size = buffer_len;
+        goto cleanup;
+    }
+
+    // the body is never used: what arrived with the head is skipped here,
+    // the rest as it comes in. A chunked body isn't parsed, the connection
+    // ends after the response; bad or too large lengths are refused
+    long content_length = 0;
+    const http_header_t* cl_header = http_get_header(&request, HDR_CONTENT_LENGTH);
+    int unframed = http_get_header(&request, HDR_TRANSFER_ENCODING) != NULL;
+    int bad_length = !unframed && cl_header &&
+        !IS_OK_APP(parse_content_length(cl_header->value, cl_header->value_len, &content_length));
+    if (bad_length || (!unframed && (size_t) content_length > gMaxBodySize)) {
+        LOG_DEBUG("request body length '%.*s' refused\n", (int) cl_header->value_len, cl_header->value);
+        conn->keep_alive = 0;
+        send_error(conn, bad_length ? 400 : 413, &request);
+        conn_finish_response(conn, first_seg);
+        access_log(conn, &request);
+        conn->close_after_write = 1;
+        total_size = buffer_len;
+        goto cleanup;
+    }
+
+    size_t body_here = buffer_len - eoh < (size_t) content_length ? buffer_len - eoh : (size_t) content_length;
+    total_size = eoh + body_here;
+    conn->discard = content_length - body_here;
+
+    // connection timeout handling
+    const http_header_t* conn_header = http_get_header(&request, HDR_CONNECTION);
+    conn->keep_alive = conn_header &&
+        conn_header->value_len == strlen("keep-alive") &&
+        strncasecmp(conn_header->value, "keep-alive", conn_header->value_len) == 0;
+
+    // a draining process answers what it has been sent, then hangs up
+    if (atomic_load_explicit(&gDrainDeadline, memory_order_relaxed)) conn->keep_alive = 0;
+
+    /**
+     * HANDLE REQUEST
+     */
+    conn->resp_status = 0;
+    conn->resp_bytes = 0;
+    if (!proxy_request(conn, &request)) handle_request(conn, &request);
+
+    // a proxied response is accounted for once it is complete
+    if (!conn->proxy) {
+        conn_finish_response(conn, first_seg);
+        access_log(conn, &request);
+    }
+    if (!conn->keep_alive || unframed) {
+        LOG_DEBUG("no keep-alive, closing connection after response...\n");
+        conn->close_after_write = 1;
+    }
+
+cleanup:
+    // step over the complete request, the bytes are reclaimed lazily
+    conn->buffer_start += total_size;
+    conn->scan_pos = 0;
+
+    // whatever comes next is a new request with a fresh header deadline
+    conn->timer_kind = TIMER_IDLE;
+    if (conn->buffer_start == conn->buffer_len) {
+        conn->buffer_start = conn->buffer_len = 0;
+    } else {
+        // a pipelined request, it arrived with the last read
+        conn->request_start = conn->last_fill;
+    }
+    return 1;
+}
+
+/**
+ * IO_URING
+ */
+static io_backend_t gBackend = BACKEND_EPOLL;
+
+// liburing isn't required, the three system calls are used directly
+int uring_enter(uring_t* ring, unsigned to_submit, unsigned min_complete, unsigned flags, const void* arg, size_t arg_size) {
+    return (int) syscall(__NR_io_uring_enter, ring->enter_fd, to_submit, min_complete, flags | ring->enter_flags, arg, arg_size);
+}
+
+int uring_register(uring_t* ring, unsigned opcode, const void* arg, unsigned nr_args) {
+    return (int) syscall(__NR_io_uring_register, ring->fd, opcode, arg, nr_args);
+}
+
+void uring_free(uring_t* ring) {
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_map && ring->cq_map != ring->sq_map) munmap(ring->cq_map, ring->cq_map_len);
+    if (ring->sq_map) munmap(ring->sq_map, ring->sq_map_len);
+    if (ring->buf_ring) munmap(ring->buf_ring, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+    if (ring->bufs) munmap(ring->bufs, (size_t) URING_BUF_COUNT * URING_BUF_SIZE);
+    if (ring->fd >= 0) close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+void* uring_map(uring_t* ring, size_t len, off_t offset) {
+    void* map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, offset);
+    return map == MAP_FAILED ? NULL : map;
+}
+
+/// @brief create a ring and map its queues; single-issuer with deferred
+/// completion work where the kernel has it (6.1+), plain otherwise
+result_t uring_init(uring_t* ring) {
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+
+    static const unsigned flag_sets[] = {
+        IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_R_DISABLED,
+        IORING_SETUP_COOP_TASKRUN,
+        0,
+    };
+    struct io_uring_params params;
+    for (size_t i = 0; i < sizeof(flag_sets) / sizeof(flag_sets[0]) && ring->fd < 0; i++) {
+        // completions outnumber submissions (multishot), give them room
+        memset(&params, 0, sizeof(params));
+        params.flags = flag_sets[i] | IORING_SETUP_CQSIZE;
+        params.cq_entries = URING_ENTRIES * 4;
+        ring->fd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+        ring->disabled = flag_sets[i] & IORING_SETUP_R_DISABLED;
+    }
+    if (ring->fd < 0) return APP_ERR;
+    ring->features = params.features;
+    ring->enter_fd = ring->fd;
+
+    ring->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_map_len > ring->sq_map_len) ring->sq_map_len = ring->cq_map_len;
+        ring->cq_map_len = ring->sq_map_len;
+    }
+
+    ring->sq_map = uring_map(ring, ring->sq_map_len, IORING_OFF_SQ_RING);
+    ring->cq_map = params.features & IORING_FEAT_SINGLE_MMAP ? ring->sq_map : uring_map(ring, ring->cq_map_len, IORING_OFF_CQ_RING);
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = uring_map(ring, ring->sqes_len, IORING_OFF_SQES);
+    if (!ring->sq_map || !ring->cq_map || !ring->sqes) {
+        uring_free(ring);
+        return APP_ERR;
+    }
+
+    char* sq = ring->sq_map;
+    ring->sq_head = (unsigned*) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned*) (sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+
+    char* cq = ring->cq_map;
+    ring->cq_head = (unsigned*) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+    // entries are always submitted in order, so the index array is the identity
+    unsigned* array = (unsigned*) (sq + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) array[i] = i;
+    return APP_OK;
+}
+
+/// @brief hand a provided receive buffer (back) to the kernel
+static inline void uring_buf_recycle(uring_t* ring, unsigned short bid) {
+    struct io_uring_buf* buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUF_COUNT - 1)];
+    buf->addr = (uintptr_t) (ring->bufs + (size_t) bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/// @brief finish setting the ring up on the thread that will submit to it:
+/// enable it, register its descriptor and the provided buffer ring
+result_t uring_start(uring_t* ring) {
+    if (ring->disabled && uring_register(ring, IORING_REGISTER_ENABLE_RINGS, NULL, 0) < 0) return APP_ERR;
+    ring->disabled = 0;
+
+    // a registered ring skips the descriptor table lookup on every enter
+    struct io_uring_rsrc_update update = { .offset = -1U, .data = (uint64_t) ring->fd };
+    if (uring_register(ring, IORING_REGISTER_RING_FDS, &update, 1) == 1) {
+        ring->enter_fd = update.offset;
+        ring->enter_flags = IORING_ENTER_REGISTERED_RING;
+    }
+
+    ring->buf_ring = mmap(NULL, URING_BUF_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->bufs = mmap(NULL, (size_t) URING_BUF_COUNT * URING_BUF_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED) ring->buf_ring = NULL;
+    if (ring->bufs == MAP_FAILED) ring->bufs = NULL;
+    if (!ring->buf_ring || !ring->bufs) return APP_ERR;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t) ring->buf_ring;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+    if (uring_register(ring, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return APP_ERR;
+
+    for (unsigned i = 0; i < URING_BUF_COUNT; i++) uring_buf_recycle(ring, i);
+    return APP_OK;
+}
+
+/// @brief whether this kernel has everything the backend uses: extended
+/// enter arguments, provided buffer rings and the opcodes below
+int uring_supported(void) {
+    uring_t ring;
+    if (!IS_OK_APP(uring_init(&ring))) return 0;
+
+    int ok = IS_OK_APP(uring_start(&ring)) && (ring.features & IORING_FEAT_EXT_ARG);
+
+    // multishot receive arrived with the zero-copy send opcode (6.0)
+    static const unsigned char ops[] = {
+        IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_POLL_ADD,
+        IORING_OP_SPLICE, IORING_OP_ASYNC_CANCEL, IORING_OP_SEND_ZC,
+    };
+    size_t probe_len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, probe_len);
+    if (!probe || uring_register(&ring, IORING_REGISTER_PROBE, probe, 256) < 0) ok = 0;
+    for (size_t i = 0; ok && i < sizeof(ops); i++) {
+        ok = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    free(probe);
+    uring_free(&ring);
+    return ok;
+}
+
+/// @brief publish prepared entries and wait for at least `wait_nr` completions
+/// @param timeout give up waiting after this long, NULL to wait indefinitely
+/// @return io_uring_enter's result, -1 with errno set on failure
+int uring_submit_and_wait(uring_t* ring, unsigned wait_nr, struct __kernel_timespec* timeout) {
+    unsigned to_submit = ring->sq_local_tail - *ring->sq_tail;
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uintptr_t) timeout;
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0;
+    return uring_enter(ring, to_submit, wait_nr, flags, wait_nr > 0 ? &arg : NULL, wait_nr > 0 ? sizeof(arg) : 0);
+}
+
+/// @brief make sure `count` submission entries are free, submitting what
+/// is queued if needed, so linked entries never straddle a flush
+result_t uring_reserve(uring_t* ring, unsigned count) {
+    if (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) + count <= ring->sq_entries) return APP_OK;
+    if (uring_submit_and_wait(ring, 0, NULL) < 0) return APP_ERR;
+    return ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) + count <= ring->sq_entries ? APP_OK : APP_ERR;
+}
+
+/// @brief next submission entry, cleared and filled with the common fields;
+/// the caller has reserved room for it
+struct io_uring_sqe* uring_prep(uring_t* ring, int opcode, int fd, const void* addr, unsigned len, uint64_t off, uint64_t user_data) {
+    struct io_uring_sqe* sqe = &ring->sqes[ring->sq_local_tail++ & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) addr;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = user_data;
+    return sqe;
+}
+
+static inline uint64_t uring_data(const void* owner, uring_op_t op) {
+    return (uintptr_t) owner | op;
+}
+
+/**
+ * EVENT LOOP
+ */
+
+/// @brief called between batches of events, when the loop holds no
+/// pointers into a document root index
+static inline void worker_quiesce(worker_t* w) {
+    uint64_t epoch = atomic_load_explicit(&gDocIndexEpoch, memory_order_acquire);
+    if (atomic_load_explicit(&w->index_epoch, memory_order_relaxed) != epoch) {
+        atomic_store_explicit(&w->index_epoch, epoch, memory_order_release);
+    }
+}
+
+/// @brief take a connection object from the worker's pool
+/// @return NULL once the pool is exhausted
+connection_t* conn_acquire(worker_t* w) {
+    if (w->free_conns) {
+        connection_t* conn = w->free_conns;
+        w->free_conns = conn->timer_next;
+        return conn;
+    }
+    if (w->pool_next < w->pool_size) return &w->pool[w->pool_next++];
+    return NULL;
+}
+
+void conn_release(worker_t* w, connection_t* conn) {
+    conn->timer_next = w->closed_conns;
+    w->closed_conns = conn;
+}
+
+/// @brief make the connections closed during the last batch available
+/// again; until then a stale event can't reach a new client through a
+/// recycled object
+void worker_recycle_conns(worker_t* w) {
+    while (w->closed_conns) {
+        connection_t* conn = w->closed_conns;
+        w->closed_conns = conn->timer_next;
+        conn->timer_next = w->free_conns;
+        w->free_conns = conn;
+    }
+}
+
+static inline size_t recv_tier_size(recv_tier_t tier) {
+    return tier == RECV_SMALL ? RECV_SMALL_SIZE : gMaxHeaderSize;
+}
+
+/// @brief take a receive buffer of the given tier from the worker's pool
+void* recv_buffer_get(worker_t* w, recv_tier_t tier) {
+    void* buffer = w->recv_free[tier];
+    if (buffer) {
+        memcpy(&w->recv_free[tier], buffer, sizeof(void*));
+        w->recv_free_cnt[tier]--;
+        return buffer;
+    }
+    return malloc(recv_tier_size(tier));
+}
+
+void recv_buffer_put(worker_t* w, recv_tier_t tier, void* buffer) {
+    if (w->recv_free_cnt[tier] >= RECV_POOL_KEEP) {
+        free(buffer);
+        return;
+    }
+    memcpy(buffer, &w->recv_free[tier], sizeof(void*));
+    w->recv_free[tier] = buffer;
+    w->recv_free_cnt[tier]++;
+}
+
+/// @brief hand the receive buffer back once nothing unparsed is left in it
+void conn_buffer_idle(connection_t* conn) {
+    if (!conn->buffer || conn->buffer_len > conn->buffer_start) return;
+    recv_buffer_put(conn->worker, conn->buffer_tier, conn->buffer);
+    conn->buffer = NULL;
+    conn->buffer_cap = conn->buffer_start = conn->buffer_len = 0;
+}
+
+/// @brief switch to a receive buffer of another tier, moving the unparsed bytes
+/// @return APP_ERR if no buffer could be allocated
+result_t conn_buffer_resize(connection_t* conn, recv_tier_t tier) {
+    char* buffer = recv_buffer_get(conn->worker, tier);
+    if (!buffer) return APP_ERR;
+
+    size_t unparsed = conn->buffer_len - conn->buffer_start;
+    if (conn->buffer) {
+        memcpy(buffer, conn->buffer + conn->buffer_start, unparsed);
+        recv_buffer_put(conn->worker, conn->buffer_tier, conn->buffer);
+    }
+    conn->buffer = buffer;
+    conn->buffer_cap = recv_tier_size(tier);
+    conn->buffer_tier = tier;
+    conn->buffer_start = 0;
+    conn->buffer_len = unparsed;
+    return APP_OK;
+}
+
+/**
+ * TIMERS
+ */
+
+// bytes a connection may send per event loop turn, 0 means unlimited
+static size_t gSendBudget = DEFAULT_SEND_BUDGET;
+
+// microseconds a loop keeps polling after its last event before it
+// sleeps, 0 disables busy polling
+static uint32_t gBusyPollUs = 0;
+
+// per-kind timeouts in ticks, indexed by timer_kind_t
+static uint64_t gTimeoutTicks[TIMER_KINDS] = {
+    DEFAULT_IDLE_TIMEOUT * 1000 / TIMER_TICK_MS,
+    DEFAULT_HEADER_TIMEOUT * 1000 / TIMER_TICK_MS,
+    DEFAULT_WRITE_TIMEOUT * 1000 / TIMER_TICK_MS,
+};
+
+// live client connections across all workers, and the count at which
+// idle ones start being closed early to keep descriptors available
+static atomic_size_t gOpenConns = 0;
+static size_t gConnHighWater = SIZE_MAX;
+
+uint64_t monotonic_ticks(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ((uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / TIMER_TICK_MS;
+}
+
+void timer_unlink(worker_t* w, connection_t* conn) {
+    if (conn->timer_slot < 0) return;
+    if (conn->timer_prev) conn->timer_prev->timer_next = conn->timer_next;
+    else w->wheel[conn->timer_slot] = conn->timer_next;
+    if (conn->timer_next) conn->timer_next->timer_prev = conn->timer_prev;
+    conn->timer_slot = -1;
+}
+
+void timer_link(worker_t* w, connection_t* conn) {
+    int slot = conn->deadline % TIMER_SLOTS;
+    conn->timer_slot = slot;
+    conn->timer_prev = NULL;
+    conn->timer_next = w->wheel[slot];
+    if (w->wheel[slot]) w->wheel[slot]->timer_prev = conn;
+    w->wheel[slot] = conn;
+}
+
+/// @brief (re)arm the connection's timer, O(1)
+void conn_set_timer(connection_t* conn, timer_kind_t kind) {
+    worker_t* w = conn->worker;
+
+    // a header deadline runs from the first byte of the request, more
+    // bytes trickling in must not extend it
+    if (kind == TIMER_HEADER && conn->timer_kind == TIMER_HEADER && conn->timer_slot >= 0) return;
+
+    uint64_t deadline = w->now_tick + gTimeoutTicks[kind];
+    conn->timer_kind = kind;
+    if (conn->timer_slot >= 0 && deadline == conn->deadline) return;
+
+    timer_unlink(w, conn);
+    conn->deadline = deadline;
+    timer_link(w, conn);
+}
+
+/// @brief append to the worker's ready list, no-op if already queued
+void conn_defer(connection_t* conn) {
+    worker_t* w = conn->worker;
+    if (conn->ready) return;
+
+    conn->ready = 1;
+    conn->ready_next = NULL;
+    conn->ready_prev = w->ready_tail;
+    if (w->ready_tail) w->ready_tail->ready_next = conn;
+    else w->ready_head = conn;
+    w->ready_tail = conn;
+    w->num_ready++;
+}
+
+void conn_undefer(connection_t* conn) {
+    worker_t* w = conn->worker;
+    if (!conn->ready) return;
+
+    if (conn->ready_prev) conn->ready_prev->ready_next = conn->ready_next;
+    else w->ready_head = conn->ready_next;
+    if (conn->ready_next) conn->ready_next->ready_prev = conn->ready_prev;
+    else w->ready_tail = conn->ready_prev;
+    conn->ready = 0;
+    w->num_ready--;
+}
+
+/// @brief drop whatever output was still queued
+void conn_drop_output(connection_t* conn) {
+    for (int i = conn->seg_idx; i < conn->seg_cnt; i++) {
+        if (conn->segs[i].file) fd_entry_release(conn->segs[i].file);
+        if (conn->segs[i].entry) cache_entry_release(conn->segs[i].entry);
+    }
+    conn->seg_idx = conn->seg_cnt = 0;
+}
+
+void conn_close(connection_t* conn) {
+    // already closed, e.g. shed earlier in the same batch of events
+    if (conn->fd < 0) return;
+
+    worker_t* w = conn->worker;
+    LOG_DEBUG("closing client connection...\n");
+    conn_undefer(conn);
+
+    timer_unlink(w, conn);
+    if (conn->proxy) proxy_abort(conn);
+    if (conn->pipe_fds[0] >= 0) {
+        close(conn->pipe_fds[0]);
+        close(conn->pipe_fds[1]);
+        conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+    }
+
+    if (w->ring.fd >= 0) {
+        while (conn->parked_cnt > 0) {
+            uring_buf_recycle(&w->ring, conn->parked[conn->parked_head].bid);
+            conn->parked_head = (conn->parked_head + 1) % URING_PARKED_MAX;
+            conn->parked_cnt--;
+        }
+
+        // submissions in flight still use this connection and its output;
+        // shutdown makes them complete promptly, the last one pools it
+        if (conn->ring_ops > 0) {
+            shutdown(conn->fd, SHUT_RDWR);
+            conn->closing = 1;
+        }
+    }
+    if (!conn->closing) conn_drop_output(conn);
+
+    if (conn->buffer) {
+        recv_buffer_put(w, conn->buffer_tier, conn->buffer);
+        conn->buffer = NULL;
+    }
+
+    if (conn->tls) {
+        // best effort close_notify, the socket is non-blocking
+        if (conn->tls_ready) SSL_shutdown(conn->tls);
+        SSL_free(conn->tls);
+        conn->tls = NULL;
+        ERR_clear_error();
+    }
+
+    // closing the socket also removes it from the epoll set; an event for
+    // it still pending in this batch finds fd -1 and is skipped, the object
+    // isn't handed out again before the batch is over
+    close(conn->fd);
+    conn->fd = -1;
+    METRIC_ADD(connections_closed, 1);
+    w->num_conns--;
+    atomic_fetch_sub(&gOpenConns, 1);
+    if (!conn->closing) conn_release(w, conn);
+}
+
+/// @brief expire connections whose deadline has passed, visiting each
+/// bucket between the last tick and now once
+void worker_advance_timers(worker_t* w) {
+    w->now_tick = monotonic_ticks();
+
+    uint64_t steps = w->now_tick - w->wheel_tick;
+    if (steps > TIMER_SLOTS) steps = TIMER_SLOTS;
+
+    for (uint64_t i = 1; i <= steps; i++) {
+        connection_t* conn = w->wheel[(w->wheel_tick + i) % TIMER_SLOTS];
+        while (conn) {
+            connection_t* next = conn->timer_next;
+            if (conn->deadline <= w->now_tick) {
+                LOG_DEBUG("connection timed out (%s)\n",
+                    conn->timer_kind == TIMER_IDLE ? "idle" : conn->timer_kind == TIMER_HEADER ? "header" : "write");
+                conn_close(conn);
+            }
+            conn = next;
+        }
+    }
+    w->wheel_tick = w->now_tick;
+}
+
+/// @brief close up to `count` idle keep-alive connections, the ones closest
+/// to expiring first; safe because they have no request in flight
+/// @return number of connections closed
+size_t worker_shed_idle(worker_t* w, size_t count) {
+    size_t shed = 0;
+    for (uint64_t i = 1; i <= TIMER_SLOTS && shed < count; i++) {
+        connection_t* conn = w->wheel[(w->wheel_tick + i) % TIMER_SLOTS];
+        while (conn && shed < count) {
+            connection_t* next = conn->timer_next;
+            if (conn->timer_kind == TIMER_IDLE && conn->seg_cnt == 0 && conn->buffer_len == conn->buffer_start) {
+                conn_close(conn);
+                shed++;
+            }
+            conn = next;
+        }
+    }
+    return shed;
+}
+
+/// @brief record a response's latency once its first / last byte is written
+/// @param complete whether the whole segment has been written
+/// @param now read lazily, at most once per flush
+static inline void seg_account(out_seg_t* seg, int complete, uint64_t* now) {
+    if (!seg->ttfb_start && !(complete && seg->done_start)) return;
+    if (*now == 0) *now = monotonic_ns();
+
+    if (seg->ttfb_start) {
+        hist_record(&tMetrics->ttfb_ns, *now - seg->ttfb_start);
+        seg->ttfb_start = 0;
+    }
+    if (complete && seg->done_start) {
+        hist_record(&tMetrics->total_ns, *now - seg->done_start);
+        seg->done_start = 0;
+    }
+}
+
+/// @brief retire the memory segments in [seg_idx, end) that `bytes`
+/// written cover, trimming a partially written one
+void conn_advance(connection_t* conn, int end, size_t bytes, uint64_t* now) {
+    METRIC_ADD(bytes_buffered, bytes);
+    while (conn->seg_idx < end && bytes >= conn->segs[conn->seg_idx].iov.iov_len) {
+        out_seg_t* seg = &conn->segs[conn->seg_idx++];
+        bytes -= seg->iov.iov_len;
+        seg_account(seg, 1, now);
+        if (seg->entry) {
+            cache_entry_release(seg->entry);
+            seg->entry = NULL;
+        }
+    }
+    if (bytes > 0) {
+        out_seg_t* seg = &conn->segs[conn->seg_idx];
+        seg_account(seg, 0, now);
+        seg->iov.iov_base = (char*) seg->iov.iov_base + bytes;
+        seg->iov.iov_len -= bytes;
+    }
+}
+
+/**
+ * TLS
+ */
+static SSL_CTX* gTlsCtx = NULL;
+
+// plaintext staged for SSL_write when the kernel doesn't encrypt
+static _Thread_local char tTlsChunk[TLS_CHUNK_SIZE];
+
+/// @brief ALPN: this server only speaks HTTP/1.1
+int tls_select_alpn(SSL* ssl, const unsigned char** out, unsigned char* out_len,
+                    const unsigned char* in, unsigned int in_len, void* arg) {
+    static const unsigned char http11[] = "\x08http/1.1";
+    unsigned char* selected;
+    if (SSL_select_next_proto(&selected, out_len, http11, sizeof(http11) - 1, in, in_len) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+/// @brief set up the shared server context: kTLS offload where the kernel
+/// and cipher allow it, and resumption through stateless tickets (TLS 1.3
+/// and 1.2) plus a session cache for TLS 1.2 session ids
+result_t tls_init(const char* cert_path, const char* key_path) {
+    gTlsCtx = SSL_CTX_new(TLS_server_method());
+    if (!gTlsCtx) return APP_ERR;
+
+    SSL_CTX_set_min_proto_version(gTlsCtx, TLS1_2_VERSION);
+    SSL_CTX_set_options(gTlsCtx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+
+    // writes may be partial and retried from re-gathered segments; idle
+    // connections give their record buffers back
+    SSL_CTX_set_mode(gTlsCtx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+
+    static const unsigned char session_context[] = "networksys_tcp_http_server";
+    SSL_CTX_set_session_id_context(gTlsCtx, session_context, sizeof(session_context) - 1);
+    SSL_CTX_set_session_cache_mode(gTlsCtx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(gTlsCtx, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(gTlsCtx, TLS_SESSION_TIMEOUT);
+    SSL_CTX_set_alpn_select_cb(gTlsCtx, tls_select_alpn, NULL);
+
+    if (SSL_CTX_use_certificate_chain_file(gTlsCtx, cert_path) != 1 ||
+        SSL_CTX_use_PrivateKey_file(gTlsCtx, key_path, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(gTlsCtx) != 1) {
+        SSL_CTX_free(gTlsCtx);
+        gTlsCtx = NULL;
+        return APP_ERR;
+    }
+    return APP_OK;
+}
+
+/// @brief whether the kernel offers the "tls" upper layer protocol at all
+int tls_kernel_available(void) {
+    char ulps[256] = {0};
+    FILE* file = fopen("/proc/sys/net/ipv4/tcp_available_ulp", "r");
+    if (!file) return 0;
+    size_t len = fread(ulps, 1, sizeof(ulps) - 1, file);
+    fclose(file);
+    ulps[len] = '\0';
+
+    for (char* token = strtok(ulps, " \n"); token; token = strtok(NULL, " \n")) {
+        if (strcmp(token, "tls") == 0) return 1;
+    }
+    return 0;
+}
+
+/// @brief attach a server-side TLS session to a freshly accepted connection
+result_t tls_conn_start(connection_t* conn) {
+    conn->tls = SSL_new(gTlsCtx);
+    if (!conn->tls) return APP_ERR;
+
+    // OpenSSL's own socket BIO, which is what turns kTLS on after the handshake
+    if (SSL_set_fd(conn->tls, conn->fd) != 1) return APP_ERR;
+    SSL_set_accept_state(conn->tls);
+    return APP_OK;
+}
+
+/// @brief advance the handshake without blocking
+/// @return IO_DONE once it completed, IO_PENDING while it waits for the peer
+io_result_t tls_handshake(connection_t* conn) {
+    int ret = SSL_do_handshake(conn->tls);
+    if (ret == 1) {
+        conn->tls_ready = 1;
+        conn->ktls_send = BIO_get_ktls_send(SSL_get_wbio(conn->tls));
+        LOG_DEBUG("TLS handshake done (%s, %s, kTLS %s, %s)\n", SSL_get_version(conn->tls),
+                  SSL_get_cipher_name(conn->tls), conn->ktls_send ? "on" : "off",
+                  SSL_session_reused(conn->tls) ? "resumed" : "full");
+        return IO_DONE;
+    }
+
+    int err = SSL_get_error(conn->tls, ret);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) return IO_PENDING;
+    LOG_DEBUG("TLS handshake failed\n");
+    ERR_clear_error();
+    return IO_CLOSED;
+}
+
+/// @brief map an SSL_read / SSL_write failure onto recv / send semantics
+ssize_t tls_error(connection_t* conn, int ret) {
+    int err = SSL_get_error(conn->tls, ret);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (err == SSL_ERROR_ZERO_RETURN) return 0;
+
+    ERR_clear_error();
+    errno = EIO;
+    return -1;
+}
+
+/// @brief recv() through the TLS session
+ssize_t tls_recv(connection_t* conn, char* data, size_t len) {
+    size_t bytes_read;
+    int ret = SSL_read_ex(conn->tls, data, len, &bytes_read);
+    return ret == 1 ? (ssize_t) bytes_read : tls_error(conn, ret);
+}
+
+/// @brief userspace-encrypted counterpart of sendmsg, gathers up to one
+/// record of plaintext; a retry after EAGAIN gathers the same bytes again
+ssize_t tls_sendv(connection_t* conn, const struct iovec* iov, int iov_cnt) {
+    const char* data = iov[0].iov_base;
+    size_t len = iov[0].iov_len;
+
+    if (iov_cnt > 1 && len < TLS_CHUNK_SIZE) {
+        len = 0;
+        for (int i = 0; i < iov_cnt && len < TLS_CHUNK_SIZE; i++) {
+            size_t take = iov[i].iov_len < TLS_CHUNK_SIZE - len ? iov[i].iov_len : TLS_CHUNK_SIZE - len;
+            memcpy(tTlsChunk + len, iov[i].iov_base, take);
+            len += take;
+        }
+        data = tTlsChunk;
+    }
+
+    size_t bytes_written;
+    int ret = SSL_write_ex(conn->tls, data, len, &bytes_written);
+    if (ret == 1) return bytes_written;
+    ssize_t result = tls_error(conn, ret);
+    if (result == 0) errno = EPIPE;
+    return result == 0 ? -1 : result;
+}
+
+/// @brief userspace-encrypted counterpart of sendfile, one record at a time
+ssize_t tls_sendfile(connection_t* conn, int file_fd, off_t* offset, size_t count) {
+    size_t len = count < TLS_CHUNK_SIZE ? count : TLS_CHUNK_SIZE;
+    ssize_t bytes_read = pread(file_fd, tTlsChunk, len, *offset);
+    if (bytes_read <= 0) return bytes_read;
+
+    struct iovec iov = { .iov_base = tTlsChunk, .iov_len = bytes_read };
+    ssize_t bytes_sent = tls_sendv(conn, &iov, 1);
+    if (bytes_sent > 0) *offset += bytes_sent;
+    return bytes_sent;
+}
+
+/// @brief write as much of the queued output as the socket accepts, with
+/// one sendmsg per run of memory segments and one sendfile per file region;
+/// HTTPS output goes through OpenSSL unless the kernel encrypts it
+/// @return IO_YIELD once gSendBudget bytes went out and more are queued,
+/// the file offsets record where to resume
+io_result_t conn_flush(connection_t* conn) {
+    int userspace_tls = conn->tls && !conn->ktls_send;
+    size_t budget = gSendBudget ? gSendBudget : SIZE_MAX;
+    size_t sent = 0;
+    uint64_t now = 0;
+    while (conn->seg_idx < conn->seg_cnt) {
+        out_seg_t* seg = &conn->segs[conn->seg_idx];
+        if (sent >= budget) return IO_YIELD;
+
+        if (seg->file) {
+            while (seg->file_off < seg->file_end) {
+                if (sent >= budget) return IO_YIELD;
+
+                size_t count = seg->file_end - seg->file_off;
+                if (count > budget - sent) count = budget - sent;
+                ssize_t bytes_sent = userspace_tls ?
+                    tls_sendfile(conn, seg->file->fd, &seg->file_off, count) :
+                    sendfile(conn->fd, seg->file->fd, &seg->file_off, count);
+                if (bytes_sent < 0) {
+                    if (errno == EINTR) continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) return IO_PENDING;
+                    return IO_CLOSED;
+                }
+
+                // file shrank underneath us, the promised length can't be met
+                if (bytes_sent == 0) return IO_CLOSED;
+
+                METRIC_ADD(bytes_sendfile, bytes_sent);
+                seg_account(seg, seg->file_off == seg->file_end, &now);
+                sent += bytes_sent;
+            }
+
+            seg_account(seg, 1, &now);
+            fd_entry_release(seg->file);
+            seg->file = NULL;
+            conn->seg_idx++;
+            continue;
+        }
+
+        // gather the run of memory segments up to the next file region
+        struct iovec iov[CONN_SEG_MAX];
+        int iov_cnt = 0;
+        int i = conn->seg_idx;
+        while (i < conn->seg_cnt && !conn->segs[i].file) {
+            iov[iov_cnt++] = conn->segs[i++].iov;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iov_cnt;
+
+        // with a file body still to come, let the kernel hold the headers
+        // back so they share a segment with the first sendfile bytes
+        int flags = MSG_NOSIGNAL | (i < conn->seg_cnt ? MSG_MORE : 0);
+        ssize_t bytes_sent = userspace_tls ? tls_sendv(conn, iov, iov_cnt) : sendmsg(conn->fd, &msg, flags);
+        if (bytes_sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return IO_PENDING;
+            return IO_CLOSED;
+        }
+
+        conn_advance(conn, i, bytes_sent, &now);
+        sent += bytes_sent;
+    }
+
+    // everything written, the arena can be reused by the next batch
+    conn->seg_idx = conn->seg_cnt = 0;
+    conn->arena_used = 0;
+    return IO_DONE;
+}
+
+/// @brief free tail of the receive buffer, taking one from the pool if
+/// the connection was idle and promoting a small one that is full of an
+/// unfinished request head
+/// @return 0 once the head has reached gMaxHeaderSize (or memory ran out)
+size_t conn_buffer_space(connection_t* conn) {
+    if (!conn->buffer && !IS_OK_APP(conn_buffer_resize(conn, RECV_SMALL))) return 0;
+
+    // reclaim consumed bytes once the free tail runs low, so the
+    // leftover of a pipelined batch is moved at most once per read
+    if (conn->buffer_start > 0 && conn->buffer_cap - conn->buffer_len < conn->buffer_cap / 4) {
+        memmove(conn->buffer, conn->buffer + conn->buffer_start, conn->buffer_len - conn->buffer_start);
+        conn->buffer_len -= conn->buffer_start;
+        conn->buffer_start = 0;
+    }
+
+    if (conn->buffer_len == conn->buffer_cap && conn->buffer_tier == RECV_SMALL) {
+        conn_buffer_resize(conn, RECV_LARGE);
+    }
+    return conn->buffer_cap - conn->buffer_len;
+}
+
+/// @brief read until the socket is drained or the receive buffer is full
+/// @return IO_PENDING once drained, IO_DONE if the buffer filled up first,
+/// IO_CLOSED on EOF or error
+io_result_t conn_fill(connection_t* conn) {
+    uint64_t now = 0;
+    for (;;) {
+        size_t space = conn_buffer_space(conn);
+        if (space == 0) return IO_DONE;
+
+        ssize_t bytes_recv = conn->tls ? tls_recv(conn, conn->buffer + conn->buffer_len, space) :
+            recv(conn->fd, conn->buffer + conn->buffer_len, space, 0);
+        if (bytes_recv < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return IO_PENDING;
+            // otherwise, an error must have occurred
+            return IO_CLOSED;
+        }
+
+        if (bytes_recv == 0) {
+            // connection closed
+            return IO_CLOSED;
+        }
+
+        // the first bytes of a new request start its latency clock
+        if (now == 0) now = monotonic_ns();
+        if (conn->buffer_len == conn->buffer_start) conn->request_start = now;
+        conn->last_fill = now;
+
+        conn->buffer_len += bytes_recv;
+    }
+}
+
+/// @brief count and log a proxied request once its response is settled
+/// @param first_seg segment count before the response's queued part, if any
+void proxy_account(connection_t* conn, upstream_t* up, int first_seg) {
+    // requests pipelined behind this one have started their clocks already
+    uint64_t request_start = conn->request_start;
+    conn->request_start = up->request_start;
+    conn->resp_status = up->status;
+    conn->resp_bytes = up->bytes;
+    conn_finish_response(conn, first_seg);
+    conn->request_start = request_start;
+
+    log_ring_t* ring = conn->worker->log_ring;
+    log_record_t* record = ring ? access_log_reserve(ring) : NULL;
+    if (record) {
+        *record = up->log;
+        access_log_commit(ring, record, up->request_start, up->status, up->bytes);
+    }
+}
+
+/// @brief answer 502 in place of a response that never started, the
+/// upstream connection is closed
+void proxy_fail(connection_t* conn) {
+    upstream_t* up = conn->proxy;
+    conn->proxy = NULL;
+    upstream_end(up);
+
+    // the request is gone from the receive buffer, only its version is echoed
+    http_request_t request;
+    request.version = up->http10 ? "HTTP/1.0" : "HTTP/1.1";
+    request.version_len = strlen(request.version);
+    int first_seg = conn->seg_cnt;
+    send_error(conn, 502, &request);
+
+    up->status = conn->resp_status;
+    up->bytes = conn->resp_bytes;
+    proxy_account(conn, up, first_seg);
+    upstream_release(conn->worker, up);
+}
+
+/// @brief the client has the whole response; the upstream connection is
+/// pooled if the backend keeps it open and sent nothing past the response
+void proxy_complete(connection_t* conn) {
+    upstream_t* up = conn->proxy;
+    conn->proxy = NULL;
+    upstream_end(up);
+
+    hist_record(&tMetrics->total_ns, monotonic_ns() - up->request_start);
+    proxy_account(conn, up, conn->seg_cnt);
+    if (!conn->keep_alive) conn->close_after_write = 1;
+
+    if (up->keep && up->in_start == up->in_len) upstream_park(conn->worker, up);
+    else upstream_release(conn->worker, up);
+}
+
+/// @brief turn the backend's response head at the front of the buffer
+/// into the client's and queue it, skipping interim (1xx) responses
+/// @return 1 on progress, 0 if more bytes are needed, -1 if it is malformed
+int proxy_response_head(connection_t* conn, upstream_t* up) {
+    // the request parser splits a status line just the same: "method" is
+    // the version, "target" the status code and "version" the reason phrase
+    http_request_t head;
+    size_t scan_pos = 0;
+    ssize_t eoh = http_parse_request(up->in + up->in_start, up->in_len - up->in_start, &scan_pos, &head);
+    if (eoh == 0) return 0;
+    if (eoh < 0 || head.path_len != 3 || head.method_len < 5 || memcmp(head.method, "HTTP/", 5) != 0) return -1;
+
+    int code = 0;
+    for (size_t i = 0; i < 3; i++) {
+        if (head.path[i] < '0' || head.path[i] > '9') return -1;
+        code = code * 10 + (head.path[i] - '0');
+    }
+    if (code < 100) return -1;
+    up->in_start += eoh;
+    if (code < 200) return 1;
+    backend_ok(up->backend);
+
+    // the connection stays usable unless the backend says otherwise
+    const http_header_t* connection = http_get_header(&head, HDR_CONNECTION);
+    if (slice_equals(head.method, head.method_len, "HTTP/1.0")) {
+        up->keep = connection && connection->value_len == strlen("keep-alive") &&
+            strncasecmp(connection->value, "keep-alive", connection->value_len) == 0;
+    } else {
+        up->keep = !(connection && connection->value_len == strlen("close") &&
+            strncasecmp(connection->value, "close", connection->value_len) == 0);
+    }
+
+    // framing: no body, chunked (chunked has to be the last coding, any
+    // other runs to the close), Content-Length, or up to the close
+    const http_header_t* encoding = http_get_header(&head, HDR_TRANSFER_ENCODING);
+    const http_header_t* length = http_get_header(&head, HDR_CONTENT_LENGTH);
+    long content_length;
+    up->chunked = 0;
+    if (up->head_only || code == 204 || code == 304) {
+        up->body_left = 0;
+    } else if (encoding) {
+        up->chunked = encoding->value_len >= 7 &&
+            strncasecmp(encoding->value + encoding->value_len - 7, "chunked", 7) == 0;
+        up->body_left = up->chunked ? 0 : UINT64_MAX;
+    } else if (length) {
+        if (!IS_OK_APP(parse_content_length(length->value, length->value_len, &content_length))) return -1;
+        up->body_left = content_length;
+    } else {
+        up->body_left = UINT64_MAX;
+    }
+
+    // a body that ends with the upstream connection ends the client's too,
+    // and so does a chunked one for an HTTP/1.0 client
+    if (up->body_left == UINT64_MAX) up->keep = 0;
+    if (up->body_left == UINT64_MAX || (up->chunked && up->http10)) conn->keep_alive = 0;
+
+    strbuf_t sb;
+    sb_init(&sb, up->out, sizeof(up->out));
+    sb_puts(&sb, up->http10 ? "HTTP/1.0 " : "HTTP/1.1 ");
+    sb_append(&sb, head.path, 3);
+    sb_append(&sb, " ", 1);
+    sb_append(&sb, head.version, head.version_len);
+    sb_append(&sb, "\r\n", 2);
+    for (size_t i = 0; i < head.num_headers; i++) {
+        const http_header_t* header = &head.headers[i];
+        if (header_hop_by_hop(header->id) || header_connection_listed(&head, header)) continue;
+        sb_append(&sb, header->name, header->name_len);
+        sb_append(&sb, ": ", 2);
+        sb_append(&sb, header->value, header->value_len);
+        sb_append(&sb, "\r\n", 2);
+    }
+    if (up->chunked && !up->http10) sb_header(&sb, "Transfer-Encoding", "chunked");
+    sb_header(&sb, "Connection", conn->keep_alive ? "keep-alive" : "close");
+    sb_append(&sb, "\r\n", 2);
+    if (sb.overflow || !IS_OK_APP(conn_queue(conn, sb.data, sb.len, NULL))) return -1;
+
+    conn->segs[conn->seg_cnt - 1].ttfb_start = up->request_start;
+    up->status = code;
+    up->state = up->chunked ? UP_CHUNK_SIZE : up->body_left > 0 ? UP_BODY : UP_DONE;
+    return 1;
+}
+
+/// @brief queue body bytes buffered from the upstream, following the
+/// chunked framing (passed through, or dropped for an HTTP/1.0 client)
+/// @return 1 on progress, 0 if more bytes are needed, -1 if the framing is broken
+int proxy_forward(connection_t* conn, upstream_t* up) {
+    char* data = up->in + up->in_start;
+    size_t avail = up->in_len - up->in_start;
+
+    if (up->state == UP_BODY || up->state == UP_CHUNK_DATA) {
+        size_t take = avail < up->body_left ? avail : up->body_left;
+        if (!IS_OK_APP(conn_queue(conn, data, take, NULL))) return -1;
+        up->in_start += take;
+        up->bytes += take;
+        if (up->body_left != UINT64_MAX) up->body_left -= take;
+        if (up->body_left == 0) up->state = up->state == UP_BODY ? UP_DONE : UP_CHUNK_END;
+        return 1;
+    }
+
+    // the framing around the data comes a line at a time
+    const char* newline = memchr(data, '\n', avail);
+    if (!newline) return 0;
+    size_t line_len = newline - data + 1;
+    if (up->state == UP_CHUNK_SIZE) {
+        uint64_t size = 0;
+        size_t digits = 0;
+        int digit;
+        for (; digits < line_len && (digit = hex_digit(data[digits])) >= 0; digits++) {
+            if (size >> 60) return -1;
+            size = size << 4 | digit;
+        }
+        if (digits == 0) return -1;
+        up->body_left = size;
+        up->state = size > 0 ? UP_CHUNK_DATA : UP_TRAILER;
+    } else if (up->state == UP_CHUNK_END) {
+        if (line_len > 2 || (line_len == 2 && data[0] != '\r')) return -1;
+        up->state = UP_CHUNK_SIZE;
+    } else if (line_len == 1 || (line_len == 2 && data[0] == '\r')) {
+        // the blank line after the trailer fields
+        up->state = UP_DONE;
+    }
+
+    if (!up->http10 && !IS_OK_APP(conn_queue(conn, data, line_len, NULL))) return -1;
+    up->in_start += line_len;
+    return 1;
+}
+
+/// @brief move a proxied exchange along: send the request, turn the
+/// response head around, then pass the body on. Body bytes that aren't
+/// already buffered are spliced from the upstream socket through the
+/// connection's pipe into the client's, never copied to userspace, except
+/// over userspace TLS
+/// @param moved body bytes passed on during this turn, across calls
+/// @return IO_DONE with output queued (the caller flushes it and calls
+/// again) or with the exchange complete (conn->proxy is NULL then),
+/// IO_PENDING while a socket would block, IO_YIELD once gSendBudget bytes
+/// were passed on, IO_CLOSED if the client has to be closed
+io_result_t proxy_pump(connection_t* conn, size_t* moved) {
+    upstream_t* up = conn->proxy;
+    size_t budget = gSendBudget ? gSendBudget : SIZE_MAX;
+    int splice_ok = !conn->tls || conn->ktls_send;
+
+    // the bytes queued from the buffer last time have been written
+    if (up->in_start > 0) {
+        memmove(up->in, up->in + up->in_start, up->in_len - up->in_start);
+        up->in_len -= up->in_start;
+        up->in_start = 0;
+    }
+
+    for (;;) {
+        if (*moved >= budget) return conn->seg_cnt > 0 ? IO_DONE : IO_YIELD;
+
+        // spliced bytes reach the client before anything else is read
+        if (conn->pipe_pending > 0) {
+            ssize_t bytes_sent = splice(conn->pipe_fds[0], NULL, conn->fd, NULL, conn->pipe_pending,
+                                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (bytes_sent < 0) {
+                if (errno == EINTR) continue;
+                return errno == EAGAIN || errno == EWOULDBLOCK ? IO_PENDING : IO_CLOSED;
+            }
+            conn->pipe_pending -= bytes_sent;
+            *moved += bytes_sent;
+            METRIC_ADD(bytes_spliced, bytes_sent);
+            continue;
+        }
+
+        if (up->state == UP_DONE) {
+            // queued pieces point into the buffer, they go out first
+            if (conn->seg_cnt == 0) proxy_complete(conn);
+            return IO_DONE;
+        }
+
+        if (up->state == UP_SENDING) {
+            ssize_t bytes_sent = send(up->fd, up->out + up->out_sent, up->out_len - up->out_sent, MSG_NOSIGNAL);
+            if (bytes_sent < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return IO_PENDING;
+                if (!IS_OK_APP(proxy_retry(conn, up->reused && !up->fresh))) {
+                    proxy_fail(conn);
+                    return IO_DONE;
+                }
+                continue;
+            }
+            up->out_sent += bytes_sent;
+            if (up->out_sent == up->out_len) up->state = UP_HEAD;
+            continue;
+        }
+
+        size_t avail = up->in_len - up->in_start;
+        if (avail > 0) {
+            // keep a segment spare, the queue is flushed before it runs out
+            if (conn->seg_cnt >= CONN_SEG_MAX - 1) return IO_DONE;
+
+            size_t before = up->in_start;
+            int step = up->state == UP_HEAD ? proxy_response_head(conn, up) : proxy_forward(conn, up);
+            if (step < 0 && up->state == UP_HEAD) {
+                LOG_DEBUG("malformed response from backend %s\n", gBackends[up->backend].name);
+                backend_failed(up->backend);
+                proxy_fail(conn);
+                return IO_DONE;
+            }
+            if (step < 0) return IO_CLOSED;
+            if (step > 0) {
+                if (up->state != UP_HEAD) *moved += up->in_start - before;
+                continue;
+            }
+        } else if ((up->state == UP_BODY || up->state == UP_CHUNK_DATA) && splice_ok) {
+            // what was queued from the buffer goes first, then the rest is spliced
+            if (conn->seg_cnt > 0) return IO_DONE;
+            if (conn->pipe_fds[0] < 0 && pipe2(conn->pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+                conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+                splice_ok = 0;
+                continue;
+            }
+
+            size_t count = up->body_left < PROXY_SPLICE_CHUNK ? up->body_left : PROXY_SPLICE_CHUNK;
+            ssize_t bytes_read = splice(up->fd, NULL, conn->pipe_fds[1], NULL, count, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (bytes_read < 0) {
+                if (errno == EINTR) continue;
+                return errno == EAGAIN || errno == EWOULDBLOCK ? IO_PENDING : IO_CLOSED;
+            }
+            if (bytes_read == 0) {
+                // the end of a close-delimited body, anything else is cut short
+                if (up->body_left != UINT64_MAX) return IO_CLOSED;
+                up->state = UP_DONE;
+                continue;
+            }
+
+            conn->pipe_pending += bytes_read;
+            up->bytes += bytes_read;
+            if (up->body_left != UINT64_MAX) up->body_left -= bytes_read;
+            if (up->body_left == 0) up->state = up->state == UP_BODY ? UP_DONE : UP_CHUNK_END;
+            continue;
+        }
+
+        // more bytes needed; a full buffer is flushed and compacted first,
+        // a head or framing line that doesn't fit at all is malformed
+        if (up->in_len == sizeof(up->in)) {
+            if (up->in_start > 0) return IO_DONE;
+            if (up->state != UP_HEAD) return IO_CLOSED;
+            LOG_DEBUG("response head from backend %s too large\n", gBackends[up->backend].name);
+            proxy_fail(conn);
+            return IO_DONE;
+        }
+
+        ssize_t bytes_recv = recv(up->fd, up->in + up->in_len, sizeof(up->in) - up->in_len, 0);
+        if (bytes_recv < 0 && errno == EINTR) continue;
+        if (bytes_recv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return conn->seg_cnt > 0 ? IO_DONE : IO_PENDING;
+        if (bytes_recv > 0) {
+            up->in_len += bytes_recv;
+            continue;
+        }
+
+        // the upstream connection ended
+        if (up->state == UP_BODY && up->body_left == UINT64_MAX && bytes_recv == 0) {
+            up->state = UP_DONE;
+        } else if (up->state == UP_HEAD && up->in_len == 0) {
+            // nothing came back, the request can go out again
+            if (!IS_OK_APP(proxy_retry(conn, up->reused && !up->fresh))) {
+                proxy_fail(conn);
+                return IO_DONE;
+            }
+        } else if (up->state == UP_HEAD) {
+            backend_failed(up->backend);
+            proxy_fail(conn);
+            return IO_DONE;
+        } else {
+            return IO_CLOSED;
+        }
+    }
+}
+
+/// @brief advance the connection state machine as far as possible
+/// without blocking, closes the connection when it is finished
+void conn_drive(connection_t* conn) {
+    while (!gShouldStop) {
+        // no HTTP before the TLS handshake is done, it runs on the header deadline
+        if (conn->tls && !conn->tls_ready) {
+            io_result_t hs = tls_handshake(conn);
+            if (hs == IO_CLOSED) break;
+            if (hs == IO_PENDING) {
+                conn_set_timer(conn, TIMER_HEADER);
+                return;
+            }
+        }
+
+        // pull in everything that has arrived
+        io_result_t rd = conn_fill(conn);
+
+        // queue responses for every complete request, in order; a proxied
+        // one holds back the requests behind it until it is complete
+        int stalled = 0;
+        while (!conn->close_after_write && !conn->proxy) {
+            if (!conn_has_room(conn)) {
+                stalled = 1;
+                break;
+            }
+            if (!conn_process_one(conn)) break;
+        }
+
+        // then write the whole batch out, a proxied response alternates
+        // between writing and reading more from its upstream
+        int proxied = conn->proxy != NULL;
+        size_t moved = 0;
+        io_result_t io = conn_flush(conn);
+        while (io == IO_DONE && conn->proxy) {
+            io = proxy_pump(conn, &moved);
+            if (io == IO_DONE) io = conn_flush(conn);
+        }
+        if (io == IO_CLOSED) break;
+        if (io == IO_PENDING) {
+            // wait for EPOLLOUT, the peer has to keep reading
+            conn_set_timer(conn, TIMER_WRITE);
+            return;
+        }
+        if (io == IO_YIELD) {
+            // the other connections go first, then the ready list resumes this one
+            conn_set_timer(conn, TIMER_WRITE);
+            conn_defer(conn);
+            return;
+        }
+
+        if (conn->close_after_write) break;
+
+        // more complete requests are waiting for output room, or were
+        // waiting for the proxied response to complete
+        if (stalled || proxied) continue;
+
+        // peer is gone and everything it sent has been answered
+        if (rd == IO_CLOSED) break;
+
+        // no room to read into and nothing to answer, out of memory
+        if (rd == IO_DONE && conn->buffer_start == 0 && conn->buffer_len == conn->buffer_cap) break;
+
+        // drained, wait for EPOLLIN; an idle connection holds no buffer
+        if (rd == IO_PENDING) {
+            conn_set_timer(conn, conn->buffer_len > conn->buffer_start ? TIMER_HEADER : TIMER_IDLE);
+            conn_buffer_idle(conn);
+            return;
+        }
+    }
+
+    conn_close(conn);
+}
+
+/// @brief wrap a freshly accepted socket in a connection and register it
+/// with epoll; with io_uring the caller arms the first receive
+/// @param peer client address, NULL if unknown
+/// @return NULL if the socket had to be dropped
+connection_t* worker_adopt(worker_t* w, int client_fd, const peer_addr_t* peer) {
+    connection_t* conn = conn_acquire(w);
+    if (!conn) {
+        LOG_WARN("connection pool of worker %d exhausted, dropping client\n", w->id);
+        close(client_fd);
+        return NULL;
+    }
+
+    conn->fd = client_fd;
+    conn->keep_alive = 0;
+    conn->close_after_write = 0;
+    conn->timer_slot = -1;
+    conn->timer_kind = TIMER_IDLE;
+    conn->ready = 0;
+    conn->worker = w;
+    conn->buffer = NULL;
+    conn->buffer_cap = conn->buffer_start = conn->buffer_len = 0;
+    conn->discard = 0;
+    conn->scan_pos = 0;
+    conn->arena_used = 0;
+    conn->seg_idx = conn->seg_cnt = 0;
+    conn->request_start = conn->last_fill = monotonic_ns();
+    conn->ring_ops = conn->send_ops = 0;
+    conn->recv_armed = conn->recv_cancelled = conn->send_poll = 0;
+    conn->peer_eof = conn->closing = 0;
+    conn->parked_head = conn->parked_cnt = 0;
+    conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+    conn->pipe_pending = 0;
+    conn->proxy = NULL;
+    conn->tls = NULL;
+    conn->tls_ready = conn->ktls_send = 0;
+    if (peer) conn->peer = *peer;
+    else conn->peer.sa.sa_family = AF_UNSPEC;
+
+    LOG_DEBUG("initiating new connection with client (worker %d)...\n", w->id);
+
+    // responses are coalesced before they are written (writev / MSG_MORE),
+    // so Nagle would only delay the final segment
+    int yes_nodelay = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &yes_nodelay, sizeof(yes_nodelay));
+
+    // edge-triggered for both directions, the state machine always
+    // runs until EAGAIN so no re-arming is needed
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+    if (w->ring.fd < 0 && epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+        close(client_fd);
+        conn_release(w, conn);
+        return NULL;
+    }
+
+    w->num_conns++;
+    conn->requests = 0;
+    METRIC_ADD(connections_accepted, 1);
+    atomic_fetch_add(&gOpenConns, 1);
+    conn_set_timer(conn, TIMER_IDLE);
+    return conn;
+}
+
+/// @brief accept a batch of pending connections, the listener is level-triggered
+/// so anything left over after ACCEPT_BATCH is reported again on the next wait
+/// @param listen_fd the plain or the HTTPS listener
+void worker_accept(worker_t* w, int listen_fd) {
+    // running short on descriptors, make room by retiring idle keep-alives
+    if (atomic_load(&gOpenConns) >= gConnHighWater) {
+        worker_shed_idle(w, SHED_BATCH);
+    }
+
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+        peer_addr_t peer;
+        socklen_t peer_len = sizeof(peer);
+        int client_fd = accept4(listen_fd, &peer.sa, &peer_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if ((errno == EMFILE || errno == ENFILE) && worker_shed_idle(w, SHED_BATCH) > 0) continue;
+            if (errno == EMFILE || errno == ENFILE) {
+                // nothing to shed, stop the level-triggered listener from
+                // spinning until the next tick
+                LOG_WARN("out of descriptors, worker %d pausing accept\n", w->id);
+                epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, w->listen_fd, NULL);
+                if (w->tls_listen_fd >= 0) epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, w->tls_listen_fd, NULL);
+                w->accept_paused = 1;
+            }
+            // EAGAIN: queue drained (or another worker took it)
+            return;
+        }
+
+        connection_t* conn = worker_adopt(w, client_fd, &peer);
+        if (conn && listen_fd == w->tls_listen_fd && !IS_OK_APP(tls_conn_start(conn))) conn_close(conn);
+    }
+}
+
+/// @brief register the worker's listeners with its epoll set
+result_t worker_watch_listener(worker_t* w) {
+    // a shared listener wakes only one waiting worker per connection
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (w->owns_listener ? 0 : EPOLLEXCLUSIVE);
+    ev.data.ptr = &w->listen_fd;
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->listen_fd, &ev) < 0) return APP_ERR;
+
+    if (w->tls_listen_fd < 0) return APP_OK;
+    ev.data.ptr = &w->tls_listen_fd;
+    return epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->tls_listen_fd, &ev) < 0 ? APP_ERR : APP_OK;
+}
+
+/// @brief once the process drains, stop accepting; every connection gets
+/// its next response with Connection: close, idle ones are left to their
+/// timeout rather than closed under a request that may be on its way
+/// @return whether the loop should stop, everything answered or out of time
+int worker_drain(worker_t* w) {
+    uint64_t deadline = atomic_load_explicit(&gDrainDeadline, memory_order_relaxed);
+    if (deadline == 0) return 0;
+
+    if (!w->draining) {
+        w->draining = 1;
+
+        // the listeners stay open for whoever took them over
+        if (w->epoll_fd >= 0) {
+            epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, w->listen_fd, NULL);
+            if (w->tls_listen_fd >= 0) epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, w->tls_listen_fd, NULL);
+        } else if (w->accept_armed && IS_OK_APP(uring_reserve(&w->ring, 1))) {
+            uring_prep(&w->ring, IORING_OP_ASYNC_CANCEL, -1, (void*) (uintptr_t) uring_data(w, URING_OP_ACCEPT), 0, 0,
+                       uring_data(NULL, URING_OP_IGNORE));
+        }
+
+        LOG_DEBUG("worker %d draining %zu connections\n", w->id, w->num_conns);
+    }
+    return w->num_conns == 0 || monotonic_ns() >= deadline;
+}
+
+void worker_epoll_loop(worker_t* w) {
+    struct epoll_event events[MAX_EVENTS];
+
+    while (!gShouldStop) {
+        worker_recycle_conns(w);
+        worker_quiesce(w);
+        if (worker_drain(w)) break;
+
+        // tick while there are deadlines to enforce, otherwise just wake up
+        // now and then to notice shutdown; yielded writers only poll
+        int timeout = w->num_ready > 0 ? 0 : w->num_conns > 0 || w->accept_paused ? TIMER_TICK_MS : EPOLL_TIMEOUT_MS;
+        if (gBusyPollUs > 0 && timeout > 0 && monotonic_ns() < w->spin_until) timeout = 0;
+        int n = epoll_wait(w->epoll_fd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            LOG_ERROR("epoll_wait failed on worker %d\n", w->id);
+            break;
+        }
+        if (gBusyPollUs > 0 && n > 0) w->spin_until = monotonic_ns() + gBusyPollUs * 1000ull;
+
+        w->now_tick = monotonic_ticks();
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &w->listen_fd || events[i].data.ptr == &w->tls_listen_fd) {
+                worker_accept(w, *(int*) events[i].data.ptr);
+            } else if (events[i].data.u64 & UPSTREAM_TAG) {
+                // an upstream socket moves its client's exchange along, after
+                // the batch: driving it here could close a client whose own
+                // event is still further down the batch
+                upstream_t* up = (upstream_t*) (uintptr_t) (events[i].data.u64 & ~(uint64_t) UPSTREAM_TAG);
+                if (up->client) conn_defer(up->client);
+                else upstream_idle_event(w, up);
+            } else {
+                // a connection shed to make room for an accept earlier in
+                // this batch is closed (and not yet reused), its event is stale
+                connection_t* conn = events[i].data.ptr;
+                if (conn->fd >= 0) conn_drive(conn);
+            }
+        }
+
+        // one more turn for each connection that yielded before this batch
+        // or was woken by its upstream, the ones yielding again wait for the
+        // next round
+        for (size_t turns = w->num_ready; turns > 0 && w->ready_head; turns--) {
+            connection_t* conn = w->ready_head;
+            conn_undefer(conn);
+            conn_drive(conn);
+        }
+
+        if (w->now_tick != w->wheel_tick) {
+            worker_advance_timers(w);
+
+            if (w->accept_paused && !w->draining && IS_OK_APP(worker_watch_listener(w))) {
+                w->accept_paused = 0;
+            }
+        }
+    }
+}
+
+/**
+ * IO_URING EVENT LOOP
+ */
+
+/// @brief arm a multishot receive into the worker's provided buffers
+result_t uring_conn_recv(connection_t* conn) {
+    uring_t* ring = &conn->worker->ring;
+    if (!IS_OK_APP(uring_reserve(ring, 1))) return APP_ERR;
+
+    struct io_uring_sqe* sqe = uring_prep(ring, IORING_OP_RECV, conn->fd, NULL, 0, 0, uring_data(conn, URING_OP_RECV));
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    conn->ring_ops++;
+    conn->recv_armed = 1;
+    conn->recv_cancelled = 0;
+    return APP_OK;
+}
+
+/// @brief copy parked receive buffers into the connection's buffer as far
+/// as it has room, handing emptied ones back to the kernel
+void uring_conn_unpark(connection_t* conn) {
+    uring_t* ring = &conn->worker->ring;
+    uint64_t now = 0;
+
+    while (conn->parked_cnt > 0) {
+        size_t space = conn_buffer_space(conn);
+        if (space == 0) return;
+
+        // the first bytes of a new request start its latency clock
+        if (now == 0) now = monotonic_ns();
+        if (conn->buffer_len == conn->buffer_start) conn->request_start = now;
+        conn->last_fill = now;
+
+        __typeof__(conn->parked[0])* parked = &conn->parked[conn->parked_head];
+        size_t len = parked->len < space ? parked->len : space;
+        memcpy(conn->buffer + conn->buffer_len, ring->bufs + (size_t) parked->bid * URING_BUF_SIZE + parked->off, len);
+        conn->buffer_len += len;
+        parked->off += len;
+        parked->len -= len;
+
+        if (parked->len == 0) {
+            uring_buf_recycle(ring, parked->bid);
+            conn->parked_head = (conn->parked_head + 1) % URING_PARKED_MAX;
+            conn->parked_cnt--;
+        }
+    }
+}
+
+/// @brief take a received buffer; what doesn't fit into the connection's
+/// buffer stays parked and the multishot receive is cancelled until it drains
+result_t uring_conn_take(connection_t* conn, unsigned short bid, size_t len) {
+    uring_t* ring = &conn->worker->ring;
+    if (conn->parked_cnt == URING_PARKED_MAX) {
+        uring_buf_recycle(ring, bid);
+        return APP_ERR;
+    }
+
+    __typeof__(conn->parked[0])* parked = &conn->parked[(conn->parked_head + conn->parked_cnt) % URING_PARKED_MAX];
+    parked->bid = bid;
+    parked->off = 0;
+    parked->len = len;
+    conn->parked_cnt++;
+    uring_conn_unpark(conn);
+
+    if (conn->parked_cnt > 0 && conn->recv_armed && !conn->recv_cancelled) {
+        if (!IS_OK_APP(uring_reserve(ring, 1))) return APP_ERR;
+        uring_prep(ring, IORING_OP_ASYNC_CANCEL, -1, (void*) (uintptr_t) uring_data(conn, URING_OP_RECV), 0, 0,
+                   uring_data(NULL, URING_OP_IGNORE));
+        conn->recv_cancelled = 1;
+    }
+    return APP_OK;
+}
+
+/// @brief submit the next piece of queued output: one sendmsg for the run
+/// of memory segments, or a file region spliced through the connection's
+/// pipe as a linked file -> pipe, wait for POLLOUT, pipe -> socket chain
+result_t uring_conn_send(connection_t* conn) {
+    uring_t* ring = &conn->worker->ring;
+    out_seg_t* seg = &conn->segs[conn->seg_idx];
+
+    if (seg->file) {
+        if (conn->pipe_fds[0] < 0 && pipe2(conn->pipe_fds, O_CLOEXEC) < 0) {
+            conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+            return APP_ERR;
+        }
+        if (!IS_OK_APP(uring_reserve(ring, 3))) return APP_ERR;
+
+        // the pipe is drained before more of the file goes in
+        size_t out_len = conn->pipe_pending;
+        if (out_len == 0) {
+            off_t remaining = seg->file_end - seg->file_off;
+            out_len = remaining < URING_SPLICE_CHUNK ? remaining : URING_SPLICE_CHUNK;
+            struct io_uring_sqe* sqe = uring_prep(ring, IORING_OP_SPLICE, conn->pipe_fds[1], NULL, out_len, (uint64_t) -1,
+                                                  uring_data(conn, URING_OP_SPLICE_IN));
+            sqe->splice_fd_in = seg->file->fd;
+            sqe->splice_off_in = seg->file_off;
+            sqe->flags = IOSQE_IO_LINK;
+            conn->ring_ops++;
+            conn->send_ops++;
+        }
+
+        // splices run on kernel workers with the socket non-blocking, so
+        // wait for room first instead of failing with EAGAIN
+        struct io_uring_sqe* sqe = uring_prep(ring, IORING_OP_POLL_ADD, conn->fd, NULL, 0, 0, uring_data(conn, URING_OP_POLL));
+        sqe->poll32_events = POLLOUT;
+        sqe->flags = IOSQE_IO_LINK;
+
+        sqe = uring_prep(ring, IORING_OP_SPLICE, conn->fd, NULL, out_len, (uint64_t) -1, uring_data(conn, URING_OP_SPLICE_OUT));
+        sqe->splice_fd_in = conn->pipe_fds[0];
+        sqe->splice_off_in = (uint64_t) -1;
+        conn->ring_ops += 2;
+        conn->send_ops += 2;
+        return APP_OK;
+    }
+
+    // gather the run of memory segments up to the next file region
+    int i = conn->seg_idx;
+    int iov_cnt = 0;
+    while (i < conn->seg_cnt && !conn->segs[i].file) {
+        conn->send_iov[iov_cnt++] = conn->segs[i++].iov;
+    }
+    conn->send_seg_end = i;
+
+    memset(&conn->send_msg, 0, sizeof(conn->send_msg));
+    conn->send_msg.msg_iov = conn->send_iov;
+    conn->send_msg.msg_iovlen = iov_cnt;
+
+    // the socket was full last time, wait for room first
+    if (!IS_OK_APP(uring_reserve(ring, 2))) return APP_ERR;
+    if (conn->send_poll) {
+        struct io_uring_sqe* sqe = uring_prep(ring, IORING_OP_POLL_ADD, conn->fd, NULL, 0, 0, uring_data(conn, URING_OP_POLL));
+        sqe->poll32_events = POLLOUT;
+        sqe->flags = IOSQE_IO_LINK;
+        conn->ring_ops++;
+        conn->send_ops++;
+        conn->send_poll = 0;
+    }
+
+    // with a file body still to come, let the kernel hold the headers back
+    struct io_uring_sqe* sqe = uring_prep(ring, IORING_OP_SENDMSG, conn->fd, &conn->send_msg, 1, 0, uring_data(conn, URING_OP_SEND));
+    sqe->msg_flags = MSG_NOSIGNAL | (i < conn->seg_cnt ? MSG_MORE : 0);
+    conn->ring_ops++;
+    conn->send_ops++;
+    return APP_OK;
+}
+
+/// @brief io_uring counterpart of conn_drive, run after each completion
+/// for the connection: parse what has arrived, submit output, re-arm
+/// the receive, closes the connection when it is finished
+void uring_conn_drive(connection_t* conn) {
+    while (!gShouldStop) {
+        // a file region fully through the pipe is done
+        out_seg_t* seg = &conn->segs[conn->seg_idx];
+        if (conn->send_ops == 0 && conn->seg_idx < conn->seg_cnt && seg->file &&
+            seg->file_off == seg->file_end && conn->pipe_pending == 0) {
+            uint64_t now = 0;
+            seg_account(seg, 1, &now);
+            fd_entry_release(seg->file);
+            seg->file = NULL;
+            conn->seg_idx++;
+        }
+        if (conn->seg_idx == conn->seg_cnt) {
+            // everything written, the arena can be reused by the next batch
+            conn->seg_idx = conn->seg_cnt = 0;
+            conn->arena_used = 0;
+        }
+
+        // queue responses for every complete request, in order
+        uring_conn_unpark(conn);
+        while (!conn->close_after_write && conn_has_room(conn)) {
+            if (!conn_process_one(conn)) break;
+        }
+
+        if (conn->send_ops == 0 && conn->seg_idx < conn->seg_cnt && !IS_OK_APP(uring_conn_send(conn))) break;
+
+        // keep receiving while output is pending, parked buffers push back
+        if (!conn->recv_armed && !conn->peer_eof && conn->parked_cnt == 0 && !IS_OK_APP(uring_conn_recv(conn))) break;
+
+        if (conn->send_ops > 0) {
+            conn_set_timer(conn, TIMER_WRITE);
+            return;
+        }
+        if (conn->close_after_write) break;
+
+        // no room to read into even after promotion, out of memory
+        if (conn->buffer && conn_buffer_space(conn) == 0) break;
+
+        // requests consumed made room for parked bytes
+        if (conn->parked_cnt > 0) continue;
+
+        // peer is gone and everything it sent has been answered
+        if (conn->peer_eof) break;
+
+        conn_set_timer(conn, conn->buffer_len > conn->buffer_start ? TIMER_HEADER : TIMER_IDLE);
+        conn_buffer_idle(conn);
+        return;
+    }
+
+    conn_close(conn);
+}
+
+/// @brief arm a multishot accept on the worker's listener
+result_t uring_arm_accept(worker_t* w) {
+    if (!IS_OK_APP(uring_reserve(&w->ring, 1))) return APP_ERR;
+    struct io_uring_sqe* sqe = uring_prep(&w->ring, IORING_OP_ACCEPT, w->listen_fd, NULL, 0, 0, uring_data(w, URING_OP_ACCEPT));
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    w->accept_armed = 1;
+    return APP_OK;
+}
+
+void uring_accepted(worker_t* w, const struct io_uring_cqe* cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) w->accept_armed = 0;
+
+    if (cqe->res < 0) {
+        if ((cqe->res == -EMFILE || cqe->res == -ENFILE) && worker_shed_idle(w, SHED_BATCH) == 0) {
+            // nothing to shed, re-armed on the next tick
+            LOG_WARN("out of descriptors, worker %d pausing accept\n", w->id);
+            w->accept_paused = 1;
+        }
+        return;
+    }
+
+    // running short on descriptors, make room by retiring idle keep-alives
+    if (atomic_load(&gOpenConns) >= gConnHighWater) {
+        worker_shed_idle(w, SHED_BATCH);
+    }
+
+    // multishot accept has nowhere to put each peer address, look it up
+    // only when the access log needs it
+    peer_addr_t peer;
+    socklen_t peer_len = sizeof(peer);
+    int has_peer = gAccessLog.fd >= 0 && getpeername(cqe->res, &peer.sa, &peer_len) == 0;
+
+    connection_t* conn = worker_adopt(w, cqe->res, has_peer ? &peer : NULL);
+    if (conn && !IS_OK_APP(uring_conn_recv(conn))) conn_close(conn);
+}
+
+void uring_complete(worker_t* w, const struct io_uring_cqe* cqe) {
+    uring_op_t op = cqe->user_data & URING_OP_MASK;
+    if (op == URING_OP_IGNORE) return;
+    if (op == URING_OP_ACCEPT) {
+        uring_accepted(w, cqe);
+        return;
+    }
+
+    connection_t* conn = (connection_t*) (uintptr_t) (cqe->user_data & ~(uint64_t) URING_OP_MASK);
+    int res = cqe->res;
+    int failed = 0;
+    uint64_t now = 0;
+    if (!(cqe->flags & IORING_CQE_F_MORE)) conn->ring_ops--;
+
+    switch (op) {
+        case URING_OP_RECV:
+            if (!(cqe->flags & IORING_CQE_F_MORE)) conn->recv_armed = 0;
+            if (cqe->flags & IORING_CQE_F_BUFFER) {
+                unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                if (conn->closing || res <= 0) uring_buf_recycle(&w->ring, bid);
+                else failed = !IS_OK_APP(uring_conn_take(conn, bid, res));
+            }
+            // out of provided buffers or cancelled for back-pressure: re-armed
+            // by the drive once there is room, anything else ends the stream
+            if (res == 0 || (res < 0 && res != -ENOBUFS && res != -ECANCELED)) conn->peer_eof = 1;
+            break;
+        case URING_OP_SEND:
+            conn->send_ops--;
+            if (res == -EAGAIN || res == -ECANCELED) conn->send_poll = 1;
+            else if (res < 0) failed = 1;
+            else conn_advance(conn, conn->send_seg_end, res, &now);
+            break;
+        case URING_OP_POLL:
+            conn->send_ops--;
+            break;
+        case URING_OP_SPLICE_IN:
+            conn->send_ops--;
+            // zero bytes: the file shrank, the promised length can't be met
+            if (res <= 0) {
+                failed = 1;
+            } else {
+                conn->pipe_pending += res;
+                conn->segs[conn->seg_idx].file_off += res;
+            }
+            break;
+        case URING_OP_SPLICE_OUT:
+            conn->send_ops--;
+            // cancelled when the chain broke, e.g. a short splice into the pipe
+            if (res > 0) {
+                conn->pipe_pending -= res;
+                METRIC_ADD(bytes_sendfile, res);
+                seg_account(&conn->segs[conn->seg_idx], 0, &now);
+            } else if (res != -EAGAIN && res != -ECANCELED) {
+                failed = 1;
+            }
+            break;
+        default:
+            break;
+    }
+
+    if (conn->closing) {
+        // the last submission of a closed connection pools it again
+        if (conn->ring_ops == 0) {
+            conn_drop_output(conn);
+            conn->closing = 0;
+            conn_release(w, conn);
+        }
+        return;
+    }
+    if (failed) {
+        conn_close(conn);
+        return;
+    }
+    if (conn->send_ops == 0 || op == URING_OP_RECV) uring_conn_drive(conn);
+}
+
+void worker_uring_loop(worker_t* w) {
+    uring_t* ring = &w->ring;
+    if (!IS_OK_APP(uring_start(ring)) || !IS_OK_APP(uring_arm_accept(w))) {
+        LOG_ERROR("failed to start io_uring on worker %d\n", w->id);
+        return;
+    }
+
+    while (!gShouldStop) {
+        worker_recycle_conns(w);
+        worker_quiesce(w);
+        if (worker_drain(w)) break;
+
+        // tick while there are deadlines to enforce, otherwise just wake up
+        // now and then to notice shutdown
+        int timeout = w->num_conns > 0 || w->accept_paused ? TIMER_TICK_MS : EPOLL_TIMEOUT_MS;
+        if (gBusyPollUs > 0 && monotonic_ns() < w->spin_until) timeout = 0;
+        struct __kernel_timespec ts = { .tv_sec = timeout / 1000, .tv_nsec = (timeout % 1000) * 1000000L };
+        if (uring_submit_and_wait(ring, 1, &ts) < 0 && errno != EINTR && errno != ETIME && errno != EBUSY && errno != EAGAIN) {
+            LOG_ERROR("io_uring_enter failed on worker %d\n", w->id);
+            break;
+        }
+        if (gBusyPollUs > 0 && *ring->cq_head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            w->spin_until = monotonic_ns() + gBusyPollUs * 1000ull;
+        }
+
+        w->now_tick = monotonic_ticks();
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe cqe = ring->cqes[head & ring->cq_mask];
+            uring_complete(w, &cqe);
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        if (w->now_tick != w->wheel_tick) {
+            worker_advance_timers(w);
+            w->accept_paused = 0;
+        }
+        if (!w->accept_armed && !w->accept_paused && !w->draining) uring_arm_accept(w);
+    }
+}
+
+void* worker_func(void* arg) {
+    worker_t* w = (worker_t*) arg;
+
+    w->now_tick = w->wheel_tick = monotonic_ticks();
+    tMetrics = &w->metrics;
+
+    if (w->ring.fd >= 0) worker_uring_loop(w);
+    else worker_epoll_loop(w);
+    atomic_store(&w->index_epoch, UINT64_MAX);
+
+    // close everything that is left, pooled upstream connections last
+    for (int slot = 0; slot < TIMER_SLOTS; slot++) {
+        while (w->wheel[slot]) {
+            conn_close(w->wheel[slot]);
+        }
+    }
+    upstream_pool_free(w);
+
+    // tearing the ring down cancels whatever closed connections still had in flight
+    if (w->owns_listener) close(w->listen_fd);
+    if (w->owns_listener && w->tls_listen_fd >= 0) close(w->tls_listen_fd);
+    if (w->epoll_fd >= 0) close(w->epoll_fd);
+    uring_free(&w->ring);
+    free(w->pool);
+    return NULL;
+}
+
+/**
+ * CPU PLACEMENT
+ */
+
+/// @brief the CPUs this process may run on, in ascending order
+/// @return how many were written to cpus
+int cpu_list_allowed(int* cpus, int max) {
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) return 0;
+
+    int n = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++) {
+        if (CPU_ISSET(cpu, &set)) cpus[n++] = cpu;
+    }
+    return n;
+}
+
+/// @brief pin a thread to one CPU
+result_t thread_pin(pthread_t thread, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(thread, sizeof(set), &set) == 0 ? APP_OK : APP_ERR;
+}
+
+/// @brief hand each new connection to the listener of the worker pinned to
+/// the CPU its packets arrived on, so softirq, socket and worker share a
+/// cache; the group's sockets are numbered in the order the workers opened
+/// them, which makes a worker's id its index
+result_t listener_steer_by_cpu(int listen_fd, const worker_t* workers, int num_workers) {
+    struct sock_filter code[2 * MAX_WORKERS + 3];
+    unsigned short len = 0;
+    code[len++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    for (int i = 0; i < num_workers; i++) {
+        code[len++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (unsigned) workers[i].cpu, 0, 1);
+        code[len++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, (unsigned) i);
+    }
+
+    // CPUs without a worker of their own spread by number
+    code[len++] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (unsigned) num_workers);
+    code[len++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_A, 0);
+
+    struct sock_fprog prog = { .len = len, .filter = code };
+    return IS_OK_SYS(setsockopt(listen_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog))) ? APP_OK : APP_ERR;
+}
+
+/// @brief create a bound, non-blocking listening socket
+/// @param reuse_port set SO_REUSEPORT so several sockets can share the port
+/// @return descriptor, or -1 on failure
+int create_listener(const struct addrinfo* res, int reuse_port) {
+    int listen_fd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, res->ai_protocol);
+    if (listen_fd < 0) {
+        LOG_ERROR("error creating socket\n");
+        return -1;
+    }
+
+    // allow socket reuse on program reruns
+    int yes_reuse_socket = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes_reuse_socket, sizeof(yes_reuse_socket));
+
+    // let the kernel spread incoming connections across per-worker listeners
+    if (reuse_port && !IS_OK_SYS(setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &yes_reuse_socket, sizeof(yes_reuse_socket)))) {
+        LOG_ERROR("failed to set SO_REUSEPORT\n");
+        close(listen_fd);
+        return -1;
+    }
+
+    // accepted sockets inherit the busy poll settings of their listener
+    if (gBusyPollUs > 0) {
+        int usecs = (int) gBusyPollUs;
+        if (!IS_OK_SYS(setsockopt(listen_fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs))) ||
+            !IS_OK_SYS(setsockopt(listen_fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &yes_reuse_socket, sizeof(yes_reuse_socket)))) {
+            LOG_WARN("SO_BUSY_POLL refused (needs CAP_NET_ADMIN), sockets won't busy poll\n");
+        }
+    }
+
+    if (!IS_OK_SYS(bind(listen_fd, res->ai_addr, res->ai_addrlen))) {
+        LOG_ERROR("failed to bind listening socket\n");
+        close(listen_fd);
+        return -1;
+    }
+
+    // listen on the socket
+    if (!IS_OK_SYS(listen(listen_fd, LISTEN_QUEUE_SIZE))) {
+        LOG_ERROR("failed to configure socket to listen\n");
+        close(listen_fd);
+        return -1;
+    }
+
+    return listen_fd;
+}
+
+/// @brief set up a worker's epoll instance and register its listeners
+/// @param listen_fd shared listener, one of this worker's own inherited
+/// from a predecessor, or -1 to open a private SO_REUSEPORT one
+/// @param tls_listen_fd the same for HTTPS, when tls_res is given
+/// @param owns_listener whether the listeners are this worker's alone
+/// @param max_conns size of the worker's connection pool
+/// @param cpu CPU the worker will be pinned to, or -1
+result_t worker_init(worker_t* w, int id, int listen_fd, const struct addrinfo* res, int tls_listen_fd,
+                     const struct addrinfo* tls_res, int owns_listener, size_t max_conns, int cpu) {
+    memset(w, 0, sizeof(*w));
+    w->id = id;
+    w->cpu = cpu;
+
+    // reserve the whole pool up front, pages are only faulted in as
+    // connections are first handed out
+    w->pool = aligned_alloc(CACHE_LINE_SIZE, max_conns * sizeof(connection_t));
+    if (!w->pool) return APP_ERR;
+    w->pool_size = max_conns;
+
+    // the ring is enabled by the worker thread, its only submitter
+    w->epoll_fd = -1;
+    w->ring.fd = -1;
+    if (gBackend == BACKEND_URING) {
+        if (!IS_OK_APP(uring_init(&w->ring))) return APP_ERR;
+    } else {
+        w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (w->epoll_fd < 0) return APP_ERR;
+
+        // let epoll_wait poll the NIC queues of its sockets before sleeping
+        struct epoll_params params = { .busy_poll_usecs = gBusyPollUs, .busy_poll_budget = BUSY_POLL_BUDGET, .prefer_busy_poll = 1 };
+        if (gBusyPollUs > 0 && ioctl(w->epoll_fd, EPIOCSPARAMS, &params) < 0 && id == 0) {
+            LOG_WARN("epoll busy polling unavailable (needs Linux 6.9), spinning in userspace only\n");
+        }
+    }
+
+    gMetrics[id] = &w->metrics;
+    if (id >= gNumMetrics) gNumMetrics = id + 1;
+
+    // the ring outlives the worker, access_log_close() frees it
+    if (gAccessLog.fd >= 0) {
+        w->log_ring = log_ring_create();
+        if (!w->log_ring) return APP_ERR;
+        gAccessLog.rings[id] = w->log_ring;
+        if (id >= gAccessLog.num_rings) gAccessLog.num_rings = id + 1;
+    }
+
+    w->owns_listener = owns_listener;
+    w->listen_fd = listen_fd >= 0 ? listen_fd : create_listener(res, 1);
+    if (w->listen_fd < 0) return APP_ERR;
+
+    w->tls_listen_fd = !tls_res ? -1 : tls_listen_fd >= 0 ? tls_listen_fd : create_listener(tls_res, 1);
+    if (tls_res && w->tls_listen_fd < 0) return APP_ERR;
+
+    // a private listener prefers connections whose packets arrive on this
+    // worker's CPU, listener_steer_by_cpu() makes it a rule
+    if (w->owns_listener && cpu >= 0) {
+        setsockopt(w->listen_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+        if (w->tls_listen_fd >= 0) setsockopt(w->tls_listen_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+    }
+
+    // io_uring workers arm a multishot accept once running
+    return gBackend == BACKEND_URING ? APP_OK : worker_watch_listener(w);
+}
+
+/**
+ * HOT RESTART
+ */
+
+// first record of a handoff, the listeners follow in SCM_RIGHTS messages:
+// num_listeners for the plain port, then as many again for HTTPS if tls
+typedef struct {
+    uint32_t magic;
+    uint32_t num_listeners;
+    uint32_t reuse_port;
+    uint32_t tls;
+} handoff_header_t;
+
+/// @brief "<encoding> <path>\n" for every body in the memory cache, so a
+/// successor can load the same working set before it takes traffic
+/// @return malloc'd text, NULL if the cache is empty or allocation failed
+char* cache_snapshot(size_t* len) {
+    pthread_rwlock_rdlock(&gFileCache.lock);
+    size_t cap = gFileCache.num_entries * (PATH_MAX_LEN + 4) + 1;
+    char* keys = gFileCache.num_entries > 0 ? malloc(cap) : NULL;
+    *len = 0;
+    for (size_t i = 0; keys && i < gFileCache.num_entries; i++) {
+        const cache_node_t* node = gFileCache.ring[i];
+        int n = snprintf(keys + *len, cap - *len, "%d %s\n", (int) node->encoding, node->path);
+        if (n > 0 && (size_t) n < cap - *len) *len += n;
+    }
+    pthread_rwlock_unlock(&gFileCache.lock);
+    return keys;
+}
+
+/// @brief load one (path, encoding) into the memory cache the way the
+/// first request for it would
+void cache_warm(const char* path, content_encoding_t encoding) {
+    fd_entry_t* file = fd_cache_acquire(path);
+    if (!file) return;
+    if (!S_ISREG(file->node.st.st_mode) || !file->mime_type) {
+        fd_entry_release(file);
+        return;
+    }
+
+    cache_entry_t* entry = NULL;
+    if (encoding != ENC_IDENTITY && (file->siblings & (1 << encoding))) {
+        char sibling_path[PATH_MAX_LEN];
+        int len = snprintf(sibling_path, sizeof(sibling_path), "%s%s", path, gEncodings[encoding].suffix);
+        fd_entry_t* sibling = len > 0 && (size_t) len < sizeof(sibling_path) ? fd_cache_acquire(sibling_path) : NULL;
+        if (sibling && S_ISREG(sibling->node.st.st_mode)) {
+            entry = cache_insert(path, encoding, sibling->fd, &sibling->node.st, file->mime_type);
+            if (entry) table_remove(&gFdCache, &sibling->node);
+        }
+        if (sibling) fd_entry_release(sibling);
+    } else {
+        entry = encoding == ENC_IDENTITY ?
+            cache_insert(path, encoding, file->fd, &file->node.st, file->mime_type) :
+            cache_insert_compressed(path, encoding, file->fd, &file->node.st, file->mime_type);
+        if (entry) table_remove(&gFdCache, &file->node);
+    }
+
+    if (entry) cache_entry_release(entry);
+    fd_entry_release(file);
+}
+
+/// @brief warm the cache from a predecessor's cache_snapshot()
+/// @return entries loaded
+size_t cache_warm_all(char* keys, size_t len) {
+    size_t loaded = 0;
+    char* end = keys + len;
+    for (char* line = keys; line < end;) {
+        char* eol = memchr(line, '\n', end - line);
+        if (!eol) break;
+        *eol = '\0';
+
+        // only paths this process would have produced itself
+        if (line[0] >= '0' && line[0] < '0' + ENC_KINDS && line[1] == ' ' &&
+            strncmp(line + 2, DOCUMENT_ROOT, strlen(DOCUMENT_ROOT)) == 0 && !strstr(line + 2, "/../")) {
+            cache_warm(line + 2, (content_encoding_t) (line[0] - '0'));
+            loaded++;
+        }
+        line = eol + 1;
+    }
+    return loaded;
+}
+
+/// @brief bind the upgrade socket a successor connects to, replacing any
+/// stale one at that path
+/// @return descriptor, or -1 on failure
+int handoff_listen(const char* path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    unlink(path);
+    if (!IS_OK_SYS(bind(fd, (struct sockaddr*) &addr, sizeof(addr))) || !IS_OK_SYS(listen(fd, 1))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/// @brief bound the time either side blocks on the other
+void handoff_set_timeouts(int fd) {
+    struct timeval tv = { .tv_sec = HANDOFF_IO_TIMEOUT };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/// @brief connect to a running predecessor's upgrade socket
+/// @return descriptor, or -1 if nothing is listening there
+int handoff_connect(const char* path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (!IS_OK_SYS(connect(fd, (struct sockaddr*) &addr, sizeof(addr)))) {
+        close(fd);
+        return -1;
+    }
+    handoff_set_timeouts(fd);
+    return fd;
+}
+
+/// @brief hand the listeners and the cache's keys to a successor; the
+/// descriptors are duplicated, ours stay open until we exit
+result_t handoff_send(int fd, const handoff_header_t* header, const int* fds) {
+    if (send(fd, header, sizeof(*header), MSG_NOSIGNAL) != sizeof(*header)) return APP_ERR;
+
+    size_t num_fds = header->num_listeners * (header->tls ? 2 : 1);
+    for (size_t sent = 0; sent < num_fds;) {
+        size_t batch = num_fds - sent < HANDOFF_FDS_PER_MSG ? num_fds - sent : HANDOFF_FDS_PER_MSG;
+        char control[CMSG_SPACE(HANDOFF_FDS_PER_MSG * sizeof(int))];
+        memset(control, 0, sizeof(control));
+        char byte = 'F';
+        struct iovec iov = { &byte, 1 };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = CMSG_SPACE(batch * sizeof(int)) };
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(batch * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds + sent, batch * sizeof(int));
+        if (sendmsg(fd, &msg, MSG_NOSIGNAL) != 1) return APP_ERR;
+        sent += batch;
+    }
+
+    // the keys go in records of whole lines, a key that isn't sent only
+    // costs the successor a miss
+    size_t len = 0;
+    char* keys = cache_snapshot(&len);
+    for (size_t off = 0; keys && off < len;) {
+        size_t n = len - off;
+        if (n > HANDOFF_RECORD_SIZE) {
+            n = HANDOFF_RECORD_SIZE;
+            while (n > 0 && keys[off + n - 1] != '\n') n--;
+            if (n == 0) break;
+        }
+        if (send(fd, keys + off, n, MSG_NOSIGNAL) != (ssize_t) n) break;
+        off += n;
+    }
+    free(keys);
+
+    // end of the records, the successor answers once it is serving
+    return IS_OK_SYS(shutdown(fd, SHUT_WR)) ? APP_OK : APP_ERR;
+}
+
+/// @brief receive a predecessor's listeners and cache keys
+/// @param fds room for 2 * MAX_WORKERS descriptors
+/// @param keys set to malloc'd key text (may be NULL), keys_len to its length
+result_t handoff_receive(int fd, handoff_header_t* header, int* fds, char** keys, size_t* keys_len) {
+    *keys = NULL;
+    *keys_len = 0;
+    if (recv(fd, header, sizeof(*header), 0) != sizeof(*header) || header->magic != HANDOFF_MAGIC ||
+        header->num_listeners < 1 || header->num_listeners > MAX_WORKERS) {
+        return APP_ERR;
+    }
+
+    size_t num_fds = header->num_listeners * (header->tls ? 2 : 1);
+    for (size_t got = 0; got < num_fds;) {
+        char control[CMSG_SPACE(HANDOFF_FDS_PER_MSG * sizeof(int))];
+        char byte;
+        struct iovec iov = { &byte, 1 };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+        if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != 1) return APP_ERR;
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) return APP_ERR;
+        size_t batch = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (batch == 0 || got + batch > num_fds) return APP_ERR;
+        memcpy(fds + got, CMSG_DATA(cmsg), batch * sizeof(int));
+        got += batch;
+    }
+
+    // key records until the predecessor shuts its side down
+    size_t cap = 0;
+    for (;;) {
+        if (cap - *keys_len < HANDOFF_RECORD_SIZE) {
+            char* grown = realloc(*keys, cap + 4 * HANDOFF_RECORD_SIZE);
+            if (!grown) break;
+            *keys = grown;
+            cap += 4 * HANDOFF_RECORD_SIZE;
+        }
+        ssize_t n = recv(fd, *keys + *keys_len, cap - *keys_len, 0);
+        if (n <= 0) break;
+        *keys_len += n;
+    }
+    return APP_OK;
+}
+
+/// @brief the local port a listener is bound to
+long listener_port(int fd) {
+    peer_addr_t addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(fd, &addr.sa, &len) != 0) return -1;
+    return ntohs(addr.sa.sa_family == AF_INET6 ? addr.in6.sin6_port : addr.in.sin_port);
+}
+
+/// @brief stop taking connections and let the workers finish what they have
+void drain_start(long timeout) {
+    if (atomic_load(&gDrainDeadline)) return;
+    atomic_store(&gDrainDeadline, monotonic_ns() + (uint64_t) timeout * 1000000000ull);
+    LOG_INFO("draining, open connections get up to %ld s to finish\n", timeout);
+}
+
+void print_usage(void) {
+    printf("usage: ./server [-w workers] [-r] [-A] [-P busy_poll_us] [-c cache_bytes] [-t cache_ttl] [-f max_fds] [-m max_conns]\n              [-k idle_timeout] [-H header_timeout] [-W write_timeout]\n              [-l log_level] [-a access_log] [-F log_format] [-M metrics_path] [-B backend] [-I] [-T mime.types] [-z send_budget]\n              [-L max_header] [-b max_body] [-U upgrade_socket] [-D drain_timeout] [-R prefix=host:port,...]\n              [-S https_port -C cert.pem -K key.pem] <port>\n");
+    printf("  -w N  number of event loops (default: one per core)\n");
+    printf("  -r    give each event loop its own SO_REUSEPORT listener\n");
+    printf("  -A    pin each event loop to a CPU; with -r connections go to the loop on the CPU that received them\n");
+    printf("  -P N  busy poll: microseconds an event loop keeps polling after its last event before sleeping (default: 0, off)\n");
+    printf("  -c N  file cache capacity in bytes, 0 disables (default: %d)\n", CACHE_DEFAULT_CAPACITY);
+    printf("  -t N  seconds before a cached file is revalidated (default: %d)\n", CACHE_DEFAULT_TTL);
+    printf("  -f N  max descriptors kept open by the file cache, 0 disables (default: %d)\n", FD_CACHE_DEFAULT_MAX);
+    printf("  -m N  connections per event loop, preallocated pool (default: %d)\n", DEFAULT_MAX_CONNS);
+    printf("  -k N  seconds an idle keep-alive connection is kept open (default: %d)\n", DEFAULT_IDLE_TIMEOUT);
+    printf("  -H N  seconds allowed to receive a complete request (default: %d)\n", DEFAULT_HEADER_TIMEOUT);
+    printf("  -W N  seconds a response may wait for the peer to read it (default: %d)\n", DEFAULT_WRITE_TIMEOUT);
+    printf("  -l L  diagnostics level: error, warn, info or debug (default: info)\n");
+    printf("  -a F  append an access log line per request to file F, '-' for stdout\n");
+    printf("  -F F  access log format: combined or json (default: combined)\n");
+    printf("  -M P  serve Prometheus metrics on request path P, e.g. /metrics (default: off)\n");
+    printf("  -B B  I/O backend: epoll or uring (io_uring, Linux 6.0+) (default: epoll)\n");
+    printf("  -L N  largest request head in bytes, 431 beyond (default: %d)\n", DEFAULT_MAX_HEADER_SIZE);
+    printf("  -b N  largest request body read and discarded in bytes, 413 beyond (default: %d)\n", DEFAULT_MAX_BODY_SIZE);
+    printf("  -z N  bytes a connection may send per event loop turn before others are served, 0 = unlimited (default: %d)\n", DEFAULT_SEND_BUDGET);
+    printf("  -T F  load extension -> media type mappings from a mime.types file F\n");
+    printf("  -I    index the document root at startup and answer lookups from memory, SIGHUP reindexes\n");
+    printf("  -U P  hot restart: hand the listeners to a new process started with the same -U P, then drain\n");
+    printf("  -D N  seconds a draining process (after -U handoff or SIGTERM) lets connections finish (default: %d)\n", DEFAULT_DRAIN_TIMEOUT);
+    printf("  -R R  reverse proxy GET / HEAD under a path prefix to backends, '/api=127.0.0.1:9000,127.0.0.1:9001' (repeatable)\n");
+    printf("  -S N  also serve HTTPS on port N, with certificate chain -C and private key -K (PEM)\n");
+}
+
+// benchmarks include this file directly and bring their own main
+#ifndef SERVER_NO_MAIN
+/// @brief program entrypoint
+int main(int argc, char* argv[]) {
+    signal(SIGINT, cleanup_handler);
+    signal(SIGHUP, reload_handler);
+    signal(SIGTERM, drain_handler);
+    signal(SIGPIPE, SIG_IGN);
+
+    // one event loop per core unless told otherwise
+    long num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_workers < 1) num_workers = 1;
+
+    int reuse_port = 0;
+    int pin_workers = 0;
+    const char* upgrade_path = NULL;
+    long drain_timeout = DEFAULT_DRAIN_TIMEOUT;
+    long max_conns = DEFAULT_MAX_CONNS;
+    long value;
+    int opt;
+    const char* access_log_path = NULL;
+    const char* tls_port_str = NULL;
+    int index_docroot = 0;
+    const char* tls_cert_path = NULL;
+    const char* tls_key_path = NULL;
+    while ((opt = getopt(argc, argv, "w:rAP:c:t:f:m:k:H:W:l:a:F:M:B:IT:z:L:b:S:C:K:U:D:R:")) != -1) {
+        switch (opt) {
+            case 'w':
+                if (!IS_OK_APP(try_conv_long(optarg, &num_workers)) || num_workers < 1 || num_workers > MAX_WORKERS) {
+                    printf("invalid worker count provided: '%s'\n", optarg);
+                    return APP_ERR;
+                }
+                break;
+            case 'r':
+                reuse_port = 1;
+                break;
+            case 'A':
+                pin_workers = 1;
+                break;
+            case 'P':
+                if (!IS_OK_APP(try_conv_long(optarg, &value)) || value < 0 || value > 1000000) {
+                    printf("invalid busy poll time provided: '%s'\n", optarg);
+                    return APP_ERR;
+                }
+                gBusyPollUs = (uint32_t) value;
+                break;
+            case 'c':
+                if (!IS_OK_APP(try_conv_long(optarg, &value)) || value < 0) {
+                    printf("invalid cache capacity provided: '%s'\n", optarg);
+                    return APP_ERR;
+                }
+                gFileCache.capacity = value;
+                break;
+            case 't':
+                if (!IS_OK_APP(try_conv_long(optarg, &value)) || value < 0) {
+                    printf("invalid cache TTL provided: '%s'\n", optarg);
+                    return APP_ERR;
+                }
+                gCacheTtl = value;
+                break;
+            case 'f':
+                if (!IS_OK_APP(try_conv_long(optarg, &value)) || value < 0 || value > CACHE_MAX_ENTRIES) {
+                    printf("invalid descriptor cap provided: '%s'\n", optarg);
+                    return APP_ERR;
+                }
+                gFdCache.capacity = value;
+                break;
+            case 'k':
+            case 'H':
+            case 'W':
+                if (!IS_OK_APP(try_conv_long(optarg, &value)) || value < 1 || value > 86400) {
+                    printf("invalid timeout provided: '%s'\n", optarg);
+                    return APP_ERR;
+                }
+                gTimeoutTicks[opt == 'k' ? TIMER_IDLE : opt == 'H' ? TIMER_HEADER : TIMER_WRITE] = value * 1000 / TIMER_TICK_MS;
+                break;
+            case 'm':
+                if (!IS_OK_APP(try_conv_long(optarg, &max_conns)) || max_conns < 1) {
+                    printf("invalid connection limit provided: '%s'\n", optarg);
+                    return APP_ERR;
+                }
+                break;
+            case 'l':
+                if (strcasecmp(optarg, "error") == 0) gLogLevel = LOG_LEVEL_ERROR;
+                else if (strcasecmp(optarg, "warn") == 0) gLogLevel = LOG_LEVEL_WARN;
+                else if (strcasecmp(optarg, "info") == 0) gLogLevel = LOG_LEVEL_INFO;
+                else if (strcasecmp(optarg, "debug") == 0) gLogLevel = LOG_LEVEL_DEBUG;
+                else {
+                    printf("invalid log level provided: '%s'\n", optarg);
+                    return APP_ERR;
+                }
+                break;
+            case 'a':
+                access_log_path = optarg;
+                break;
+            case 'M':
+                if (optarg[0] != '/') {
+                    printf("invalid metrics path provided: '%s'\n", optarg);
+                    return APP_ERR;
+                }
+                gMetricsPath = optarg;
+                break;
+            case 'B':
+                if (strcasecmp(optarg, "epoll") == 0) gBackend = BACKEND_EPOLL;
+                else if (strcasecmp(optarg, "uring") == 0 || strcasecmp(optarg, "io_uring") == 0) gBackend = BACKEND_URING;
+                else {
+                    printf("invalid I/O backend provided: '%s'\n", optarg);
+                    return APP_ERR;
+                }
+                break;
+            case 'I':
+                index_docroot = 1;
+                break;
+            case 'L':
+                if (!IS_OK_APP(try_conv_long(optarg, &value)) || value < RECV_SMALL_SIZE || value > MAX_HEADER_SIZE_LIMIT) {
+                    printf("invalid header limit provided: '%s' (%d to %d)\n", optarg, RECV_SMALL_SIZE, MAX_HEADER_SIZE_LIMIT);
+                    return APP_ERR;
+                }
+                gMaxHeaderSize = (size_t) value;
+                break;
+            case 'b':
+                if (!IS_OK_APP(try_conv_long(optarg, &value)) || value < 0) {
+                    printf("invalid body limit provided: '%s'\n", optarg);
+                    return APP_ERR;
+                }
+                gMaxBodySize = (size_t) value;
+                break;
+            case 'z':
+                if (!IS_OK_APP(try_conv_long(optarg, &value)) || value < 0) {
+                    printf("invalid send budget provided: '%s'\n", optarg);
+                    return APP_ERR;
+                }
+                gSendBudget = (size_t) value;
+                break;
+            case 'T':
+                if (!IS_OK_APP(mime_types_load(optarg))) {
+                    printf("could not read MIME types from '%s'\n", optarg);
+                    return APP_ERR;
+                }
+                break;
+            case 'S':
+                if (!IS_OK_APP(try_conv_long(optarg, &value)) || value < 0 || value > 65535) {
+                    printf("invalid HTTPS port provided: '%s'\n", optarg);
+                    return APP_ERR;
+                }
+                tls_port_str = optarg;
+                break;
+            case 'C':
+                tls_cert_path = optarg;
+                break;
+            case 'U':
+                if (strlen(optarg) >= sizeof(((struct sockaddr_un*) 0)->sun_path)) {
+                    printf("upgrade socket path too long: '%s'\n", optarg);
+                    return APP_ERR;
+                }
+                upgrade_path = optarg;
+                break;
+            case 'D':
+                if (!IS_OK_APP(try_conv_long(optarg, &drain_timeout)) || drain_timeout < 0 || drain_timeout > 86400) {
+                    printf("invalid drain timeout provided: '%s'\n", optarg);
+                    return APP_ERR;
+                }
+                break;
+            case 'K':
+                tls_key_path = optarg;
+                break;
+            case 'R':
+                if (!IS_OK_APP(proxy_route_add(optarg))) {
+                    printf("invalid proxy route provided: '%s'\n", optarg);
+                    return APP_ERR;
+                }
+                break;
+            case 'F':
+                if (strcasecmp(optarg, "combined") == 0) gAccessLog.format = LOG_FORMAT_COMBINED;
+                else if (strcasecmp(optarg, "json") == 0) gAccessLog.format = LOG_FORMAT_JSON;
+                else {
+                    printf("invalid log format provided: '%s'\n", optarg);
+                    return APP_ERR;
+                }
+                break;
+            default:
+                print_usage();
+                return APP_ERR;
+        }
+    }
+
+    // port number should be provided in CLI arguments
+    if (optind >= argc) {
+        print_usage();
+        return APP_ERR;
+    }
+    const char* port_str = argv[optind];
+
+    // get port number
+    long port;
+    if (!IS_OK_APP(try_conv_long(port_str, &port)) || port < 0) {
+        printf("invalid port number provided: '%s'\n", port_str);
+        return APP_ERR;
+    }
+
+    if (tls_port_str && (!tls_cert_path || !tls_key_path)) {
+        printf("HTTPS needs a certificate (-C) and a private key (-K)\n");
+        return APP_ERR;
+    }
+    if (tls_port_str && !IS_OK_APP(tls_init(tls_cert_path, tls_key_path))) {
+        printf("could not load certificate '%s' / key '%s'\n", tls_cert_path, tls_key_path);
+        ERR_print_errors_fp(stdout);
+        return APP_ERR;
+    }
+
+    // the handshake drives non-blocking OpenSSL I/O from readiness events
+    if (tls_port_str && gBackend == BACKEND_URING) {
+        LOG_WARN("HTTPS is only served by the epoll backend, using epoll\n");
+        gBackend = BACKEND_EPOLL;
+    }
+
+    // upstream sockets are driven by readiness events as well
+    if (gNumRoutes > 0 && gBackend == BACKEND_URING) {
+        LOG_WARN("the reverse proxy only runs on the epoll backend, using epoll\n");
+        gBackend = BACKEND_EPOLL;
+    }
+
+    if (gBackend == BACKEND_URING && !uring_supported()) {
+        LOG_WARN("io_uring is unavailable or too old (needs Linux 6.0), using epoll\n");
+        gBackend = BACKEND_EPOLL;
+    }
+
+    LOG_INFO("starting server on port %ld with %ld workers (%s)\n", port, num_workers,
+             gBackend == BACKEND_URING ? "io_uring" : "epoll");
+    for (int i = 0; i < gNumRoutes; i++) {
+        LOG_INFO("proxying %s to %d backends\n", gRoutes[i].prefix, gRoutes[i].num_backends);
+    }
+
+    // use host IP
     struct addrinfo hints, *res;
     memset(&hints, 0, sizeof(hints));
-    
+
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_PASSIVE;
-    
-    if (!IS_OK_SYS(getaddrinfo(NULL, argv[1], &hints, &res))) {
+
+    if (!IS_OK_SYS(getaddrinfo(NULL, port_str, &hints, &res))) {
         printf("could not get host address information\n");
         return APP_ERR;
     }
@@ -561,64 +6430,247 @@ int main(int argc, char* argv[]) {
         return APP_ERR;
     }
 
-    // bind socket to host
-    int listen_fd = -1;
-    if (res && (listen_fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol)) < 0) {
-        printf("error creating socket\n");
+    struct addrinfo* tls_res = NULL;
+    if (tls_port_str) {
+        if (!IS_OK_SYS(getaddrinfo(NULL, tls_port_str, &hints, &tls_res)) || !tls_res) {
+            printf("could not get host address information for the HTTPS port\n");
+            return APP_ERR;
+        }
+        LOG_INFO("serving HTTPS on port %s, record encryption %s\n", tls_port_str,
+                 tls_kernel_available() ? "offloaded to the kernel (kTLS) where the cipher allows" : "in userspace (no kernel TLS)");
+    }
+
+    // start closing idle keep-alives once client sockets approach the
+    // descriptor limit, keeping room for cached files and listeners
+    struct rlimit fd_limit;
+    if (getrlimit(RLIMIT_NOFILE, &fd_limit) == 0 && fd_limit.rlim_cur != RLIM_INFINITY) {
+        size_t reserved = gFdCache.capacity + num_workers * 2 + 64;
+        gConnHighWater = fd_limit.rlim_cur > reserved ? (fd_limit.rlim_cur - reserved) * 9 / 10 : 1;
+    }
+
+    if (access_log_path && !IS_OK_APP(access_log_open(access_log_path))) {
+        printf("could not open access log '%s'\n", access_log_path);
         return APP_ERR;
     }
 
-    // make nonblocking
-    int flags = fcntl(listen_fd, F_GETFL, 0);
-    fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK);
+    // a running predecessor hands over its listeners, so no connection is
+    // refused while both processes are up, and the keys of its warm cache
+    static int inherited[2 * MAX_WORKERS];
+    handoff_header_t handoff = {0};
+    char* warm_keys = NULL;
+    size_t warm_len = 0;
+    int predecessor = upgrade_path ? handoff_connect(upgrade_path) : -1;
+    if (predecessor >= 0) {
+        if (!IS_OK_APP(handoff_receive(predecessor, &handoff, inherited, &warm_keys, &warm_len))) {
+            printf("could not take over the listeners of the process at '%s'\n", upgrade_path);
+            return APP_ERR;
+        }
+        if ((int) handoff.reuse_port != reuse_port || listener_port(inherited[0]) != port ||
+            (handoff.tls && tls_res && listener_port(inherited[handoff.num_listeners]) != strtol(tls_port_str, NULL, 10))) {
+            printf("the process at '%s' listens differently (port, HTTPS port or -r), not taking over\n", upgrade_path);
+            return APP_ERR;
+        }
+        LOG_INFO("took over %u listeners from the previous process\n", handoff.num_listeners * (handoff.tls ? 2 : 1));
+    }
+    int num_inherited = predecessor >= 0 ? (int) handoff.num_listeners : 0;
+    const int* inherited_tls = handoff.tls && tls_res ? inherited + handoff.num_listeners : NULL;
 
-    // allow socket reuse on program reruns
-    int yes_reuse_socket = 1;
-    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes_reuse_socket, sizeof(yes_reuse_socket));
+    // HTTPS listeners we don't serve, and private ones beyond our worker
+    // count, are closed; connections queued on them are reset
+    for (int i = 0; i < num_inherited; i++) {
+        int unused = reuse_port && i >= num_workers;
+        if (unused) close(inherited[i]);
+        if (handoff.tls && (unused || !tls_res)) close(inherited[num_inherited + i]);
+    }
 
-    if (res && !IS_OK_SYS(bind(listen_fd, res->ai_addr, res->ai_addrlen))) {
-        printf("failed to bind listening socket\n");
+    // bind socket to host, per-worker listeners are opened by the workers
+    int listen_fd = -1;
+    if (!reuse_port && (listen_fd = num_inherited ? inherited[0] : create_listener(res, 0)) < 0) {
+        return APP_ERR;
+    }
+    int tls_listen_fd = -1;
+    if (!reuse_port && tls_res && (tls_listen_fd = inherited_tls ? inherited_tls[0] : create_listener(tls_res, 0)) < 0) {
         return APP_ERR;
     }
 
-    // listen on the socket
-    if (!IS_OK_SYS(listen(listen_fd, LISTEN_QUEUE_SIZE))) {
-        printf("failed to configure socket to listen\n");
+    // load the predecessor's working set while it still serves
+    if (warm_keys) {
+        LOG_INFO("warmed %zu cache entries from the previous process\n", cache_warm_all(warm_keys, warm_len));
+        free(warm_keys);
+    }
+
+    if (index_docroot) {
+        doc_index_t* index = doc_index_build();
+        if (!index) {
+            printf("could not index document root '%s'\n", DOCUMENT_ROOT);
+            return APP_ERR;
+        }
+        atomic_store(&gDocIndex, index);
+    }
+
+    // only the main thread handles SIGINT and SIGHUP, workers poll gShouldStop
+    sigset_t block_set, old_set;
+    sigemptyset(&block_set);
+    sigaddset(&block_set, SIGINT);
+    sigaddset(&block_set, SIGHUP);
+    sigaddset(&block_set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block_set, &old_set);
+
+    // pinned workers take the allowed CPUs in turn
+    static int cpus[CPU_SETSIZE];
+    int num_cpus = pin_workers ? cpu_list_allowed(cpus, CPU_SETSIZE) : 0;
+    cpu_set_t main_cpus;
+    sched_getaffinity(0, sizeof(main_cpus), &main_cpus);
+
+    // start event loops, each one accepts for itself
+    static worker_t workers[MAX_WORKERS];
+    for (long i = 0; i < num_workers; i++) {
+        int cpu = num_cpus > 0 ? cpus[i % num_cpus] : -1;
+
+        // memory is placed on the node of the CPU that first touches it, so
+        // a pinned worker is set up from its own CPU and only ever runs there
+        if (cpu >= 0 && !IS_OK_APP(thread_pin(pthread_self(), cpu))) {
+            printf("could not pin worker %ld to CPU %d\n", i, cpu);
+            return APP_ERR;
+        }
+
+        int own_fd = reuse_port && i < num_inherited ? inherited[i] : listen_fd;
+        int own_tls_fd = reuse_port && inherited_tls && i < num_inherited ? inherited_tls[i] : tls_listen_fd;
+        if (!IS_OK_APP(worker_init(&workers[i], (int) i, own_fd, res, own_tls_fd, tls_res, reuse_port, max_conns, cpu))) {
+            printf("could not initialize worker %ld\n", i);
+            return APP_ERR;
+        }
+
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (cpu >= 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        }
+        int created = pthread_create(&workers[i].thread, &attr, worker_func, &workers[i]);
+        pthread_attr_destroy(&attr);
+        if (created != 0) {
+            printf("could not create thread for worker %ld\n", i);
+            return APP_ERR;
+        }
+        LOG_DEBUG("worker %ld pinned to CPU %d\n", i, cpu);
+    }
+    if (num_cpus > 0) sched_setaffinity(0, sizeof(main_cpus), &main_cpus);
+
+    // per-worker listeners form one reuseport group per port; workers
+    // sharing a CPU leave the kernel's hash to spread their connections
+    if (num_cpus >= num_workers && reuse_port) {
+        if (!IS_OK_APP(listener_steer_by_cpu(workers[0].listen_fd, workers, (int) num_workers)) ||
+            (tls_res && !IS_OK_APP(listener_steer_by_cpu(workers[0].tls_listen_fd, workers, (int) num_workers)))) {
+            LOG_WARN("could not attach the reuseport CPU steering program, relying on SO_INCOMING_CPU\n");
+        }
+    }
+
+    // records are drained by a thread of their own, SIGINT stays blocked there too
+    if (gAccessLog.fd >= 0 && pthread_create(&gAccessLog.thread, NULL, log_drain_func, NULL) != 0) {
+        printf("could not create access log thread\n");
         return APP_ERR;
     }
 
-    // setup server
-    while (!gShouldStop) {
-        struct sockaddr_in client_addr;
-        size_t client_len = sizeof(client_addr);
+    // serving: the predecessor can go, and the next upgrade connects here
+    if (predecessor >= 0) {
+        send(predecessor, "K", 1, MSG_NOSIGNAL);
+        close(predecessor);
+    }
+    int upgrade_fd = upgrade_path ? handoff_listen(upgrade_path) : -1;
+    if (upgrade_path && upgrade_fd < 0) {
+        LOG_WARN("could not listen for upgrades on '%s'\n", upgrade_path);
+    }
 
-        int* client_fd = malloc(sizeof(int));
-        *client_fd = accept(listen_fd, (struct sockaddr*) &client_addr, (socklen_t*) &client_len);
+    // nothing left to do here but wait for signals and successors; the
+    // signals stay blocked outside of ppoll so they can't slip in between
+    // check and sleep. While a replaced index waits for the workers to pass
+    // it by, the wait is short enough to free it soon after
+    int successor = -1;
+    int handed_over = 0;
+    int retired_pending = 0;
+    const struct timespec retire_poll = { .tv_sec = 0, .tv_nsec = DOC_INDEX_RELOAD_POLL_MS * 1000000L };
+    while (!gShouldStop && !atomic_load(&gDrainDeadline)) {
+        struct pollfd pfds[2] = { { upgrade_fd, POLLIN, 0 }, { successor, POLLIN, 0 } };
+        if (ppoll(pfds, 2, retired_pending ? &retire_poll : NULL, &old_set) < 0 && errno != EINTR) break;
 
-        if (*client_fd < 0) {
-            free(client_fd);
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                // no clients pending, sleep
-                usleep(10000); // 10 millis
+        if (gShouldReload && !gShouldStop) {
+            gShouldReload = 0;
+            if (atomic_load(&gDocIndex)) {
+                LOG_INFO("reindexing %s\n", DOCUMENT_ROOT);
+                doc_index_reload();
             }
+        }
+        retired_pending = doc_index_collect(workers, num_workers);
+        if (gShouldDrain) drain_start(drain_timeout);
 
-            if (gShouldStop) break;
-            continue;
+        // a new binary asks for the listeners, one at a time
+        if ((pfds[0].revents & POLLIN) && successor < 0) {
+            successor = accept4(upgrade_fd, NULL, NULL, SOCK_CLOEXEC);
+            int* fds = inherited;
+            handoff_header_t header = { HANDOFF_MAGIC, reuse_port ? (uint32_t) num_workers : 1, reuse_port, tls_res != NULL };
+            for (long i = 0; i < (long) header.num_listeners; i++) {
+                fds[i] = reuse_port ? workers[i].listen_fd : listen_fd;
+                if (tls_res) fds[header.num_listeners + i] = reuse_port ? workers[i].tls_listen_fd : tls_listen_fd;
+            }
+            if (successor >= 0) handoff_set_timeouts(successor);
+            if (successor >= 0 && !IS_OK_APP(handoff_send(successor, &header, fds))) {
+                LOG_WARN("handing the listeners to a new process failed, still serving\n");
+                close(successor);
+                successor = -1;
+            }
         }
 
-        pthread_t task_id;
-        if (pthread_create(&task_id, NULL, client_func, client_fd) != 0) {
-            printf("could not create thread for client\n");
-            close(*client_fd);
-            free(client_fd);
-            continue;
+        // it is serving once it says so, without that we carry on
+        if (pfds[1].revents) {
+            char ack = 0;
+            if (recv(successor, &ack, 1, 0) == 1 && ack == 'K') {
+                LOG_INFO("a new process took over the listeners\n");
+                handed_over = 1;
+                drain_start(drain_timeout);
+            } else {
+                LOG_WARN("the new process went away before serving, still serving\n");
+            }
+            close(successor);
+            successor = -1;
         }
+    }
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+
+    // draining without a successor, nobody accepts from the listeners again:
+    // shut them so new connections are refused at once rather than queued
+    // unanswered until exit. The descriptors stay valid for workers that
+    // haven't dropped them yet; with a successor the sockets are shared
+    if (!handed_over && !gShouldStop) {
+        for (long i = 0; i < num_workers; i++) {
+            shutdown(workers[i].listen_fd, SHUT_RD);
+            if (workers[i].tls_listen_fd >= 0) shutdown(workers[i].tls_listen_fd, SHUT_RD);
+        }
+    }
 
-        pthread_detach(task_id);
+    // the socket path belongs to the successor now, if there is one
+    if (upgrade_fd >= 0) {
+        close(upgrade_fd);
+        if (!handed_over) unlink(upgrade_path);
     }
 
-    printf("closing listening socket...\n");
-    close(listen_fd);
+    for (long i = 0; i < num_workers; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    access_log_close();
+
+    LOG_INFO("closing listening socket...\n");
+    if (listen_fd >= 0) close(listen_fd);
+    if (tls_listen_fd >= 0) close(tls_listen_fd);
+
     freeaddrinfo(res);
+    if (tls_res) freeaddrinfo(tls_res);
+    if (gTlsCtx) SSL_CTX_free(gTlsCtx);
+    // every worker has stopped, nothing reads any index any more
+    doc_index_collect(workers, num_workers);
+    doc_index_free(atomic_load(&gDocIndex));
     return APP_OK;
-}
\ No newline at end of file
+}
+#endif
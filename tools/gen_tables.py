@@ -0,0 +1,179 @@
+#!/usr/bin/env python3
+"""
+Generate http_tables.h: collision-free hash tables for the header fields
+the server interprets (in requests, and in upstream responses when it
+proxies) and for the built-in MIME types.
+
+Keys hash with case-folding FNV-1a (fold_hash() in server.c) from a seed
+searched here, so every key owns its slot and a lookup is one hash, one
+load and one compare.
+
+usage: python3 tools/gen_tables.py > http_tables.h   (or: make tables)
+"""
+import sys
+
+# header fields, in header_id_t order; the hop-by-hop ones are dropped
+# when proxying
+HEADERS = [
+    "Connection",
+    "Content-Length",
+    "Transfer-Encoding",
+    "Accept-Encoding",
+    "If-None-Match",
+    "If-Modified-Since",
+    "Range",
+    "If-Range",
+    "Referer",
+    "User-Agent",
+    "Host",
+    "X-Forwarded-For",
+    "Keep-Alive",
+    "Proxy-Connection",
+    "TE",
+    "Trailer",
+    "Upgrade",
+]
+
+# extension -> media type
+MIME_TYPES = [
+    ("html", "text/html"),
+    ("htm", "text/html"),
+    ("css", "text/css"),
+    ("js", "application/javascript"),
+    ("mjs", "application/javascript"),
+    ("json", "application/json"),
+    ("map", "application/json"),
+    ("webmanifest", "application/manifest+json"),
+    ("xml", "application/xml"),
+    ("txt", "text/plain"),
+    ("csv", "text/csv"),
+    ("md", "text/markdown"),
+    ("ics", "text/calendar"),
+    ("png", "image/png"),
+    ("jpg", "image/jpeg"),
+    ("jpeg", "image/jpeg"),
+    ("gif", "image/gif"),
+    ("ico", "image/x-icon"),
+    ("svg", "image/svg+xml"),
+    ("webp", "image/webp"),
+    ("avif", "image/avif"),
+    ("bmp", "image/bmp"),
+    ("tif", "image/tiff"),
+    ("tiff", "image/tiff"),
+    ("woff", "font/woff"),
+    ("woff2", "font/woff2"),
+    ("ttf", "font/ttf"),
+    ("otf", "font/otf"),
+    ("eot", "application/vnd.ms-fontobject"),
+    ("wasm", "application/wasm"),
+    ("pdf", "application/pdf"),
+    ("zip", "application/zip"),
+    ("gz", "application/gzip"),
+    ("tar", "application/x-tar"),
+    ("mp4", "video/mp4"),
+    ("m4v", "video/mp4"),
+    ("webm", "video/webm"),
+    ("ogv", "video/ogg"),
+    ("mp3", "audio/mpeg"),
+    ("m4a", "audio/mp4"),
+    ("ogg", "audio/ogg"),
+    ("oga", "audio/ogg"),
+    ("wav", "audio/wav"),
+    ("flac", "audio/flac"),
+    ("vtt", "text/vtt"),
+]
+
+
+def fold_hash(key, seed):
+    h = seed
+    for c in key.encode():
+        h ^= c | 0x20
+        h = (h * 16777619) & 0xFFFFFFFF
+    return h ^ (h >> 15)
+
+
+def place(keys, num_slots):
+    for seed in range(1, 1 << 24):
+        slots = {}
+        for i, key in enumerate(keys):
+            slot = fold_hash(key, seed) & (num_slots - 1)
+            if slot in slots:
+                break
+            slots[slot] = i
+        else:
+            return seed, slots
+    sys.exit("no collision-free seed for %d keys in %d slots" % (len(keys), num_slots))
+
+
+def table_size(n, load):
+    size = 16
+    while size < n / load:
+        size *= 2
+    return size
+
+
+def enum_name(header):
+    return "HDR_" + header.upper().replace("-", "_")
+
+
+def main():
+    out = []
+    out.append("// generated by tools/gen_tables.py (make tables), do not edit")
+    out.append("#ifndef HTTP_TABLES_H")
+    out.append("#define HTTP_TABLES_H")
+    out.append("")
+
+    header_slots = table_size(len(HEADERS), 0.5)
+    header_seed, placed = place(HEADERS, header_slots)
+    out.append("/// @brief header fields interned while parsing")
+    out.append("typedef enum {")
+    for header in HEADERS:
+        out.append("    %s," % enum_name(header))
+    out.append("    HDR_KINDS,")
+    out.append("    HDR_UNKNOWN = HDR_KINDS,")
+    out.append("} header_id_t;")
+    out.append("")
+    out.append("#define HEADER_HASH_SEED 0x%08xu" % header_seed)
+    out.append("#define HEADER_HASH_SLOTS %d" % header_slots)
+    out.append("")
+    out.append("static const struct {")
+    out.append("    const char* name;")
+    out.append("    size_t len;")
+    out.append("} gHeaderNames[HDR_KINDS] = {")
+    for header in HEADERS:
+        out.append('    { "%s", %d },' % (header, len(header)))
+    out.append("};")
+    out.append("")
+    out.append("// header_id_t by hash slot, HDR_UNKNOWN where no name lands")
+    out.append("static const unsigned char gHeaderSlots[HEADER_HASH_SLOTS] = {")
+    for slot in range(header_slots):
+        name = enum_name(HEADERS[placed[slot]]) if slot in placed else "HDR_UNKNOWN"
+        out.append("    %s," % name)
+    out.append("};")
+    out.append("")
+
+    exts = [ext for ext, _ in MIME_TYPES]
+    if len(set(exts)) != len(exts):
+        sys.exit("duplicate extension")
+    mime_slots = table_size(len(MIME_TYPES), 0.25)
+    mime_seed, placed = place(exts, mime_slots)
+    out.append("#define MIME_HASH_SEED 0x%08xu" % mime_seed)
+    out.append("#define MIME_HASH_SLOTS %d" % mime_slots)
+    out.append("")
+    out.append("// built-in extension -> media type, by hash slot")
+    out.append("static const struct {")
+    out.append("    const char* ext;")
+    out.append("    size_t ext_len;")
+    out.append("    const char* type;")
+    out.append("} gMimeSlots[MIME_HASH_SLOTS] = {")
+    for slot in sorted(placed):
+        ext, mime = MIME_TYPES[placed[slot]]
+        out.append('    [%d] = { "%s", %d, "%s" },' % (slot, ext, len(ext), mime))
+    out.append("};")
+    out.append("")
+    out.append("#endif")
+    print("\n".join(out))
+
+
+if __name__ == "__main__":
+    main()